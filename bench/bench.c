@@ -0,0 +1,439 @@
+// Benchmark driver. Generates deterministic synthetic corpora and measures
+// each filter backend on them: lookups, populating from a file, saving and
+// loading the cache, peak memory, and lines lost to false positives next
+// to an exact table. Results are printed as one JSON object so runs can be
+// compared across releases.
+//
+// usage: bench [-n lines] [-o file]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "bloom.h"
+#include "exact.h"
+
+#define DEFAULT_LINES  1000000
+#define ACCURACY       0.0001f
+
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+typedef struct {
+	char    *data;
+	size_t  *offsets;   // start of every line, plus one past the last
+	size_t   lines;
+	size_t   distinct;
+	bool    *seen;      // whether the exact table already had each line.
+	                    // shared, so the run that fills it can be forked
+	char     path[64];  // the corpus written out, one line per line
+} corpus;
+
+typedef struct {
+	const char *name;
+	void      (*line)(char *, size_t *, const uint64_t);
+	double      pool;   // distinct lines drawn from, per line
+} generator;
+
+typedef struct {
+	const char       *name;
+	bloom_layout_t    layout;
+	bloom_backend_t   backend;
+} config;
+
+static uint64_t splitmix64(uint64_t *state) {
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+// Lines are rendered from an index, so the same index always gives the
+// same line and the share of repeated lines is set by the pool size.
+
+// short passwords: a word, sometimes capitalised, often followed by digits
+static void line_password(char *buf, size_t *len, const uint64_t index) {
+	static const char consonants[] = "bcdfghjklmnprstvwz";
+	static const char vowels[] = "aeiouy";
+	uint64_t state = index;
+	uint64_t r = splitmix64(&state);
+	size_t   letters = 4 + r % 7;
+	size_t   n = 0;
+
+	for (size_t i = 0; i < letters; i++) {
+		uint64_t c = splitmix64(&state);
+
+		buf[n++] = (i % 2) ? vowels[c % 6] : consonants[c % 18];
+	}
+
+	if ((r >> 8) % 4 == 0) {
+		buf[0] -= 'a' - 'A';
+	}
+
+	if ((r >> 16) % 3 != 0) {
+		n += sprintf(buf + n, "%u", (unsigned)(splitmix64(&state) % ((r >> 24) % 2 ? 100 : 10000)));
+	}
+
+	*len = n;
+}
+
+// long URLs: a host, a few path segments and a query string
+static void line_url(char *buf, size_t *len, const uint64_t index) {
+	static const char *const tlds[] = {"com", "net", "org", "io", "de"};
+	uint64_t state = index;
+	uint64_t r = splitmix64(&state);
+	size_t   segments = 2 + r % 6;
+	size_t   n;
+
+	n = sprintf(buf, "https://www.site%u.%s", (unsigned)((r >> 8) % 50000), tlds[(r >> 24) % 5]);
+	for (size_t i = 0; i < segments; i++) {
+		n += sprintf(buf + n, "/%016llx", (unsigned long long)splitmix64(&state));
+	}
+	n += sprintf(buf + n, "?id=%llu&ref=%08x", (unsigned long long)index, (unsigned)splitmix64(&state));
+
+	*len = n;
+}
+
+static const generator generators[] = {
+	{"passwords",     line_password, 0.75},
+	{"urls",          line_url,      0.9},
+	{"high-dup",      line_password, 0.1},
+	{"low-dup",       line_password, 100.0},
+};
+
+static const config configs[] = {
+	{"bloom",         BF_LAYOUT_STANDARD, BF_BACKEND_BLOOM},
+	{"bloom-blocked", BF_LAYOUT_BLOCKED,  BF_BACKEND_BLOOM},
+	{"cuckoo",        BF_LAYOUT_STANDARD, BF_BACKEND_CUCKOO},
+};
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// peak resident memory of this process in kB
+static long peak_rss(void) {
+	struct rusage ru;
+
+	return getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : 0;
+}
+
+static size_t file_size(const char *path) {
+	struct stat sb;
+
+	return stat(path, &sb) == 0 ? (size_t)sb.st_size : 0;
+}
+
+static const char *line_at(const corpus *c, const size_t i, size_t *len) {
+	*len = c->offsets[i + 1] - c->offsets[i] - 1;
+	return c->data + c->offsets[i];
+}
+
+static bool corpus_generate(corpus *c, const generator *g, const size_t lines) {
+	uint64_t  state = 0x6e657762656e6368ULL;
+	uint64_t  pool = g->pool * lines;
+	size_t    capacity = lines * 64;
+	size_t    used = 0;
+	FILE     *fp;
+	int       fd;
+
+	memset(c, 0, sizeof(*c));
+	c->lines = lines;
+	c->data = malloc(capacity);
+	c->offsets = malloc((lines + 1) * sizeof(size_t));
+	c->seen = mmap(NULL, lines, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (c->seen == MAP_FAILED) {
+		c->seen = NULL;
+	}
+	if (c->data == NULL || c->offsets == NULL || c->seen == NULL) {
+		return false;
+	}
+
+	for (size_t i = 0; i < lines; i++) {
+		size_t len;
+
+		if (capacity - used < 512) {
+			char *grown = realloc(c->data, capacity * 2);
+
+			if (grown == NULL) {
+				return false;
+			}
+			c->data = grown;
+			capacity *= 2;
+		}
+
+		c->offsets[i] = used;
+		g->line(c->data + used, &len, splitmix64(&state) % (pool ? pool : 1));
+		used += len;
+		c->data[used++] = '\n';
+	}
+	c->offsets[lines] = used;
+
+	snprintf(c->path, sizeof(c->path), "%s/new-bench-XXXXXX", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+	fd = mkstemp(c->path);
+	if (fd == -1) {
+		perror("mkstemp");
+		return false;
+	}
+
+	fp = fdopen(fd, "w");
+	if (fp == NULL || fwrite(c->data, used, 1, fp) != 1) {
+		perror("write corpus");
+		if (fp) fclose(fp);
+		return false;
+	}
+	fclose(fp);
+
+	return true;
+}
+
+static void corpus_destroy(corpus *c) {
+	if (c->path[0]) {
+		unlink(c->path);
+	}
+	free(c->data);
+	free(c->offsets);
+	if (c->seen) {
+		munmap(c->seen, c->lines);
+	}
+}
+
+// Run the corpus through an exact table, which gives the true answer for
+// every line to measure false positives against.
+static bool run_exact(FILE *out, const corpus *c, const config *cfg) {
+	exact   ex;
+	double  start, elapsed;
+
+	(void)cfg;
+	if (exact_init(&ex, c->lines) != BF_SUCCESS) {
+		return false;
+	}
+
+	start = now();
+	for (size_t i = 0; i < c->lines; i++) {
+		size_t      len;
+		const char *line = line_at(c, i, &len);
+
+		c->seen[i] = exact_lookup_or_add(&ex, line, len);
+	}
+	elapsed = now() - start;
+
+	fprintf(out,
+			"        {\"name\": \"exact\", \"lines_per_sec\": %.0f, \"ns_per_lookup\": %.1f, "
+			"\"memory_bytes\": %zu, \"peak_rss_kb\": %ld, \"false_positive_rate\": 0}",
+			c->lines / elapsed, elapsed * 1e9 / c->lines, exact_memory(&ex), peak_rss());
+
+	exact_destroy(&ex);
+	return true;
+}
+
+static bool run_filter(FILE *out, const corpus *c, const config *cfg) {
+	bloomfilter  bf;
+	char         cache[80];
+	size_t       lost = 0;
+	long         rss;
+	size_t       bitmap_size;
+	size_t       stacks;
+	double       start, lookup, populate, save, load;
+
+	if (bloom_init(&bf, c->lines, ACCURACY, 0, cfg->layout, cfg->backend, BF_HASH_MMH3) != BF_SUCCESS) {
+		return false;
+	}
+
+	start = now();
+	for (size_t i = 0; i < c->lines; i++) {
+		size_t      len;
+		const char *line = line_at(c, i, &len);
+
+		if (bloom_lookup_or_add(&bf, line, len) && !c->seen[i]) {
+			lost++;
+		}
+	}
+	lookup = now() - start;
+	rss = peak_rss();
+	bitmap_size = bf.bitmap_size;
+	stacks = bf.stack_count;
+	bloom_destroy(&bf);
+
+	if (bloom_init(&bf, c->lines, ACCURACY, 0, cfg->layout, cfg->backend, BF_HASH_MMH3) != BF_SUCCESS) {
+		return false;
+	}
+
+	start = now();
+	if (!bloom_populate_from_file(&bf, c->path)) {
+		bloom_destroy(&bf);
+		return false;
+	}
+	populate = now() - start;
+
+	snprintf(cache, sizeof(cache), "%s.cache", c->path);
+	if (bloom_set_target(&bf, c->path) != BF_SUCCESS) {
+		bloom_destroy(&bf);
+		return false;
+	}
+
+	start = now();
+	if (bloom_save(&bf, cache) != BF_SUCCESS) {
+		bloom_destroy(&bf);
+		unlink(cache);
+		return false;
+	}
+	save = now() - start;
+	bloom_destroy(&bf);
+
+	start = now();
+	if (bloom_load(&bf, cache, c->path) != BF_SUCCESS) {
+		unlink(cache);
+		return false;
+	}
+	load = now() - start;
+	bloom_destroy(&bf);
+
+	fprintf(out,
+			"        {\"name\": \"%s\", \"lines_per_sec\": %.0f, \"ns_per_lookup\": %.1f, "
+			"\"populate_lines_per_sec\": %.0f, \"populate_mb_per_sec\": %.1f, "
+			"\"save_ms\": %.3f, \"load_ms\": %.3f, \"cache_bytes\": %zu, "
+			"\"memory_bytes\": %zu, \"stacks\": %zu, \"peak_rss_kb\": %ld, "
+			"\"lost\": %zu, \"false_positive_rate\": %.3g}",
+			cfg->name, c->lines / lookup, lookup * 1e9 / c->lines,
+			c->lines / populate, c->offsets[c->lines] / populate / 1e6,
+			save * 1e3, load * 1e3, file_size(cache),
+			bitmap_size, stacks, rss,
+			lost, c->distinct ? (double)lost / c->distinct : 0.0);
+
+	unlink(cache);
+	return true;
+}
+
+// Run one measurement in a child process, so its peak memory is its own
+// and not that of whichever run came before.
+static bool measure(FILE *out, const corpus *c, const config *cfg,
+		bool (*run)(FILE *, const corpus *, const config *)) {
+	pid_t pid;
+	int   status;
+
+	fflush(out);
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return false;
+	}
+
+	if (pid == 0) {
+		bool ok = run(out, c, cfg);
+
+		fflush(out);
+		_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	if (waitpid(pid, &status, 0) == -1) {
+		perror("waitpid");
+		return false;
+	}
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+static void usage(const char *progname) {
+	fprintf(stderr,
+			"usage: %s [options]\n"
+			"options:\n"
+			"  -n LINES   Lines per corpus (default %d)\n"
+			"  -o FILE    Write results to FILE instead of stdout\n"
+			"  -h         Help\n",
+			progname, DEFAULT_LINES);
+}
+
+int main(int argc, char *argv[]) {
+	size_t  lines = DEFAULT_LINES;
+	FILE   *out = stdout;
+	int     opt;
+
+	while ((opt = getopt(argc, argv, "n:o:h")) != -1) {
+		switch(opt) {
+		case 'n':
+			lines = strtoull(optarg, NULL, 10);
+			break;
+		case 'o':
+			out = fopen(optarg, "w");
+			if (out == NULL) {
+				perror(optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (lines == 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(out, "{\n  \"revision\": \"%s\",\n  \"time\": %lld,\n  \"lines\": %zu,\n  \"corpora\": [\n",
+			BENCH_REVISION, (long long)time(NULL), lines);
+
+	for (size_t g = 0; g < sizeof(generators) / sizeof(generators[0]); g++) {
+		corpus c;
+
+		fprintf(stderr, "%s\n", generators[g].name);
+		if (!corpus_generate(&c, &generators[g], lines)) {
+			fprintf(stderr, "could not generate the %s corpus\n", generators[g].name);
+			corpus_destroy(&c);
+			return EXIT_FAILURE;
+		}
+
+		fprintf(out, "    {\n      \"name\": \"%s\",\n      \"bytes\": %zu,\n      \"filters\": [\n",
+				generators[g].name, c.offsets[c.lines]);
+
+		if (!measure(out, &c, NULL, run_exact)) {
+			fprintf(stderr, "exact table failed on %s\n", generators[g].name);
+			corpus_destroy(&c);
+			return EXIT_FAILURE;
+		}
+
+		for (size_t i = 0; i < c.lines; i++) {
+			c.distinct += !c.seen[i];
+		}
+
+		for (size_t f = 0; f < sizeof(configs) / sizeof(configs[0]); f++) {
+			fprintf(out, ",\n");
+			if (!measure(out, &c, &configs[f], run_filter)) {
+				fprintf(stderr, "%s failed on %s\n", configs[f].name, generators[g].name);
+				corpus_destroy(&c);
+				return EXIT_FAILURE;
+			}
+		}
+
+		fprintf(out, "\n      ],\n      \"distinct\": %zu\n    }%s\n", c.distinct,
+				g + 1 < sizeof(generators) / sizeof(generators[0]) ? "," : "");
+		corpus_destroy(&c);
+	}
+
+	fprintf(out, "  ]\n}\n");
+
+	if (out != stdout && fclose(out) != 0) {
+		perror("fclose");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,62 @@
+#!/bin/sh
+# Compare exact mode (-e) with the Bloom and cuckoo filters: throughput,
+# memory per distinct line, and lines lost to false positives.
+#
+# usage: bench/exact.sh [lines]
+#
+# The same corpus as bench/scaling.sh is appended to an empty target file
+# so each run saves its cache. Memory is taken from the size of the saved
+# cache, which is the filter or table as it was held in memory.
+
+NEW=${NEW:-./new}
+LINES=${1:-5000000}
+CORPUS=${TMPDIR:-/tmp}/new-scaling-$LINES.txt
+WORK=$(mktemp -d)
+
+trap 'rm -rf "$WORK"' EXIT
+
+if [ ! -f "$CORPUS" ]; then
+	awk -v n="$LINES" 'BEGIN {
+		srand(1)
+		for (i = 0; i < n; i++) {
+			printf "pw%x\n", int(rand() * n * 0.75)
+		}
+	}' > "$CORPUS"
+fi
+
+DISTINCT=$(awk '!seen[$0]++' "$CORPUS" | wc -l)
+
+now() {
+	date +%s.%N
+}
+
+printf "%-22s %10s %14s %12s %8s\n" mode seconds lines/sec bytes/line lost
+
+run() {
+	name=$1
+	shift
+
+	rm -rf "$WORK/home" "$WORK/target"
+	mkdir "$WORK/home"
+	: > "$WORK/target"
+
+	start=$(now)
+	HOME="$WORK/home" "$NEW" "$@" "$WORK/target" < "$CORPUS"
+	end=$(now)
+
+	bytes=$(cat "$WORK"/home/.new/* 2>/dev/null | wc -c)
+	kept=$(wc -l < "$WORK/target")
+
+	awk -v m="$name" -v s="$start" -v e="$end" -v n="$LINES" -v b="$bytes" -v d="$DISTINCT" -v k="$kept" 'BEGIN {
+		t = e - s
+		printf "%-22s %10.3f %14.0f %12.1f %8d\n", m, t, n / t, b / d, d - k
+	}'
+}
+
+run "bloom" -F
+run "bloom, sized" -F -s "$DISTINCT"
+run "bloom, sized, blocked" -F -B -s "$DISTINCT"
+run "cuckoo" -F -b cuckoo
+run "cuckoo, sized" -F -b cuckoo -s "$DISTINCT"
+run "exact" -e
+run "exact, sized" -e -s "$DISTINCT"
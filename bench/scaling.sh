@@ -0,0 +1,52 @@
+#!/bin/sh
+# Measure how the -j threaded pipeline scales with the number of threads.
+#
+# usage: bench/scaling.sh [lines] [max jobs]
+#
+# A deterministic corpus of short, password-like lines with about 25%
+# duplicates is generated once, then deduplicated to /dev/null with a
+# filter sized up front so stacking does not skew the results.
+
+NEW=${NEW:-./new}
+LINES=${1:-5000000}
+MAX_JOBS=${2:-$(getconf _NPROCESSORS_ONLN)}
+CORPUS=${TMPDIR:-/tmp}/new-scaling-$LINES.txt
+
+if [ ! -f "$CORPUS" ]; then
+	awk -v n="$LINES" 'BEGIN {
+		srand(1)
+		for (i = 0; i < n; i++) {
+			printf "pw%x\n", int(rand() * n * 0.75)
+		}
+	}' > "$CORPUS"
+fi
+
+now() {
+	date +%s.%N
+}
+
+printf "%-6s %10s %14s %8s\n" jobs seconds lines/sec speedup
+
+jobs=1
+base=""
+while [ "$jobs" -le "$MAX_JOBS" ]; do
+	start=$(now)
+	"$NEW" -j "$jobs" -s "$LINES" < "$CORPUS" > /dev/null
+	end=$(now)
+
+	awk -v j="$jobs" -v s="$start" -v e="$end" -v n="$LINES" -v b="$base" 'BEGIN {
+		t = e - s
+		if (b == "") b = t
+		printf "%-6d %10.3f %14.0f %7.2fx\n", j, t, n / t, b / t
+	}'
+
+	if [ -z "$base" ]; then
+		base=$(awk -v s="$start" -v e="$end" 'BEGIN { print e - s }')
+	fi
+
+	if [ "$jobs" -lt "$MAX_JOBS" ] && [ $((jobs * 2)) -gt "$MAX_JOBS" ]; then
+		jobs=$MAX_JOBS
+	else
+		jobs=$((jobs * 2))
+	fi
+done
@@ -0,0 +1,125 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define BITOPS_X86
+#endif
+
+#include "bitops.h"
+
+typedef void (*bitops_fn)(uint8_t *, const uint8_t *, const size_t, const bool);
+
+static inline __attribute__((always_inline))
+void combine_words(uint8_t *dst, const uint8_t *src, const size_t n, const bool and) {
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		uint64_t d, s;
+
+		memcpy(&d, dst + i, sizeof(d));
+		memcpy(&s, src + i, sizeof(s));
+		d = and ? d & s : d | s;
+		memcpy(dst + i, &d, sizeof(d));
+	}
+
+	for (; i < n; i++) {
+		dst[i] = and ? dst[i] & src[i] : dst[i] | src[i];
+	}
+}
+
+static void combine_scalar(uint8_t *dst, const uint8_t *src, const size_t n, const bool and) {
+	if (and) {
+		combine_words(dst, src, n, true);
+	} else {
+		combine_words(dst, src, n, false);
+	}
+}
+
+#ifdef BITOPS_X86
+__attribute__((target("avx2")))
+static void combine_avx2(uint8_t *dst, const uint8_t *src, const size_t n, const bool and) {
+	size_t i = 0;
+
+	if (and) {
+		for (; i + 64 <= n; i += 64) {
+			__m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+			__m256i b = _mm256_loadu_si256((const __m256i *)(dst + i + 32));
+
+			a = _mm256_and_si256(a, _mm256_loadu_si256((const __m256i *)(src + i)));
+			b = _mm256_and_si256(b, _mm256_loadu_si256((const __m256i *)(src + i + 32)));
+			_mm256_storeu_si256((__m256i *)(dst + i), a);
+			_mm256_storeu_si256((__m256i *)(dst + i + 32), b);
+		}
+		combine_words(dst + i, src + i, n - i, true);
+	} else {
+		for (; i + 64 <= n; i += 64) {
+			__m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+			__m256i b = _mm256_loadu_si256((const __m256i *)(dst + i + 32));
+
+			a = _mm256_or_si256(a, _mm256_loadu_si256((const __m256i *)(src + i)));
+			b = _mm256_or_si256(b, _mm256_loadu_si256((const __m256i *)(src + i + 32)));
+			_mm256_storeu_si256((__m256i *)(dst + i), a);
+			_mm256_storeu_si256((__m256i *)(dst + i + 32), b);
+		}
+		combine_words(dst + i, src + i, n - i, false);
+	}
+}
+
+__attribute__((target("avx512f")))
+static void combine_avx512(uint8_t *dst, const uint8_t *src, const size_t n, const bool and) {
+	size_t i = 0;
+
+	if (and) {
+		for (; i + 64 <= n; i += 64) {
+			__m512i a = _mm512_loadu_si512(dst + i);
+
+			_mm512_storeu_si512(dst + i, _mm512_and_si512(a, _mm512_loadu_si512(src + i)));
+		}
+		combine_words(dst + i, src + i, n - i, true);
+	} else {
+		for (; i + 64 <= n; i += 64) {
+			__m512i a = _mm512_loadu_si512(dst + i);
+
+			_mm512_storeu_si512(dst + i, _mm512_or_si512(a, _mm512_loadu_si512(src + i)));
+		}
+		combine_words(dst + i, src + i, n - i, false);
+	}
+}
+#endif
+
+// pick the widest kernel the CPU runs, once
+static bitops_fn bitops_select(void) {
+#ifdef BITOPS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		return combine_avx512;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return combine_avx2;
+	}
+#endif
+	return combine_scalar;
+}
+
+static bitops_fn selected_kernel(void) {
+	static bitops_fn  selected;
+	bitops_fn         combine = __atomic_load_n(&selected, __ATOMIC_RELAXED);
+
+	if (combine == NULL) {
+		combine = bitops_select();
+		__atomic_store_n(&selected, combine, __ATOMIC_RELAXED);
+	}
+
+	return combine;
+}
+
+void bitops_or(uint8_t *dst, const uint8_t *src, const size_t n) {
+	selected_kernel()(dst, src, n, false);
+}
+
+void bitops_and(uint8_t *dst, const uint8_t *src, const size_t n) {
+	selected_kernel()(dst, src, n, true);
+}
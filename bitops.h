@@ -0,0 +1,12 @@
+#ifndef BITOPS_H
+#define BITOPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// OR or AND one byte range into another, with the widest kernel the CPU
+// runs: AVX-512, AVX2, or plain C a word at a time.
+void  bitops_or(uint8_t *, const uint8_t *, const size_t);
+void  bitops_and(uint8_t *, const uint8_t *, const size_t);
+
+#endif /* BITOPS_H */
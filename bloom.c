@@ -1,14 +1,61 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <math.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "mmh3.h"
+#include "wyhash.h"
 #include "bloom.h"
+#include "reader.h"
+#include "sidecar.h"
+#include "cuckoo.h"
+#include "fuse.h"
+#include "probe.h"
+#include "popcount.h"
+#include "uring.h"
+#include "pack.h"
+#include "bitops.h"
+
+_Static_assert(BLOOM_HASH_WORDS == SIDECAR_WORDS, "sidecar records are filter hashes");
+
+// lines read from the target file per batch while populating
+#define BLOOM_POPULATE_BATCH 1024
+
+// The cuckoo stack that follows a static one takes the keys the filter was
+// sized for beyond those of the static stack, but at least a fraction of
+// them and never less than BLOOM_STATIC_MIN_TAIL.
+#define BLOOM_STATIC_TAIL      4
+#define BLOOM_STATIC_MIN_TAIL  1024
+
+// keys a static stack is built from at most, 2 GB of hashes. lines of a
+// larger file beyond these go to the stacks after it
+#define BLOOM_STATIC_MAX_KEYS  (1ULL << 27)
+
+// a Bloom stack that turns out not to be full yet is looked at again after
+// 1/BLOOM_FILL_STEP more of the keys it was sized for
+#define BLOOM_FILL_STEP 256
+
+// the oldest version whose header can still be read as is
+#define BLOOM_FILE_VERSION_MIN 7
+
+static const char *bloom_backends[] = {
+	"bloom",
+	"cuckoo",
+	"fuse"
+};
+
+static const char *bloom_hashes[] = {
+	"mmh3",
+	"wyhash"
+};
 
 static const char *bloom_errors[] = {
 	"Success",
@@ -17,111 +64,356 @@ static const char *bloom_errors[] = {
 	"Unable to read file",
 	"Unable to write to file",
 	"fstat() failure",
-	"Invalid file format"
+	"Invalid file format",
+	"Unable to map file",
+	"Filter is stale",
+	"Target file has grown",
+	"Filters are not compatible"
 };
 
 static size_t ideal_size(const size_t expected, const float accuracy) {
 	return -(expected * log(accuracy) / pow(log(2.0), 2));
 }
 
-bloom_error_t bloom_init(bloomfilter *bf, const size_t expected, const float accuracy, const size_t max_stacks) {
-	bf->base_size     = ideal_size(expected, accuracy);
-	bf->stack_count   = 1;
+// round a segment size up so that stacked segments stay byte aligned, or
+// block aligned for the blocked layout.
+static size_t round_size(const size_t size, const bloom_layout_t layout) {
+	size_t align = (layout == BF_LAYOUT_BLOCKED) ? BLOOM_BLOCK_BITS : 8;
+
+	return ((size + align - 1) / align) * align;
+}
+
+static uint8_t *bloom_alloc(const size_t size) {
+	void *ptr;
+
+	// cache line alignment lets a blocked filter touch exactly one line per stack
+	if (posix_memalign(&ptr, 64, size) != 0) {
+		return NULL;
+	}
+
+	return ptr;
+}
+
+bloom_error_t bloom_init(bloomfilter *bf, const size_t expected, const float accuracy, const size_t max_stacks, const bloom_layout_t layout, const bloom_backend_t backend, const bloom_hash_t hash) {
+	bf->layout        = layout;
+	bf->backend       = backend;
+	bf->hash          = hash;
+	bf->reduction     = BF_REDUCE_MULTIPLY;
+	bf->stack_count   = 0;
 	bf->max_stacks    = max_stacks;
 	bf->needs_rebuild = false;
-	bf->size          = bf->base_size * bf->stack_count;
-	bf->hashcount     = (bf->size / expected) * log(2);
-	bf->bitmap_size   = bf->size / 8;
+	bf->size          = 0;
+	bf->bitmap_size   = 0;
 	bf->expected      = expected;
 	bf->accuracy      = accuracy;
+	bf->growth        = BLOOM_GROWTH;
+	bf->tightening    = BLOOM_TIGHTENING;
 	bf->insert_count  = 0;
-	bf->bitmap        = calloc(bf->bitmap_size, sizeof(uint8_t));
-	if (bf->bitmap == NULL) {
+	bf->mapped        = false;
+	bf->bitmap        = NULL;
+	bf->fingerprints  = 0;
+	bf->sidecar       = NULL;
+	bf->key           = NULL;
+	memset(bf->hll, 0, sizeof(bf->hll));
+
+	if (!bloom_stack(bf)) {
 		return BF_OUTOFMEMORY;
 	}
 
+	bf->base_size     = bf->stacks[0].size;
+	bf->hashcount     = bf->stacks[0].hashcount;
+
 	return BF_SUCCESS;
 }
 
 void bloom_destroy(bloomfilter *bf) {
+	if (bf->mapped) {
+		munmap(bf->map_base, bf->map_size);
+		close(bf->map_fd);
+		bf->mapped = false;
+		bf->bitmap = NULL;
+	}
+
 	if (bf->bitmap) {
 		free(bf->bitmap);
 		bf->bitmap = NULL;
 	}
 }
 
+static bool populate_static(bloomfilter *, reader *, sidecar *);
+
 // This assumes that the filter is sized appropriately.
 bool bloom_populate_from_file(bloomfilter *bf, const char *filepath) {
-    FILE *fp = fopen(filepath, "r");
-    if (!fp) {
-        perror("fopen");
-        return false;
-    }
+	return bloom_populate_from_offset(bf, filepath, 0);
+}
+
+// Add the lines of a file starting at byte offset, which must be the start
+// of a line. Used to catch a filter up with lines appended to its target
+// file by someone else; see BF_GROWN. Every line goes to the sidecar, not
+// only new keys: a line that collides with others in an overfull filter
+// must still be found once the filter is rebuilt from the sidecar.
+bool bloom_populate_from_offset(bloomfilter *bf, const char *filepath, const off_t offset) {
+	reader       r;
+	const char  *lines[BLOOM_POPULATE_BATCH];
+	size_t       lens[BLOOM_POPULATE_BATCH];
+	uint64_t     hashes[BLOOM_POPULATE_BATCH][BLOOM_HASH_WORDS];
+	sidecar     *sc = bf->sidecar;
+	size_t       n;
+	int          fd;
+
+	fd = open(filepath, O_RDONLY);
+	if (fd == -1) {
+		perror("open");
+		return false;
+	}
 
-    char *line = NULL;
-    size_t len = 0;
+	if (lseek(fd, offset, SEEK_SET) == -1 || !reader_init_fd(&r, fd)) {
+		close(fd);
+		return false;
+	}
+	r.owns_fd = true;
+	r.key = bf->key;
+
+	if (bf->backend == BF_BACKEND_FUSE && bf->stack_count == 1 && bf->insert_count == 0 &&
+		!populate_static(bf, &r, sc)) {
+		reader_close(&r);
+		return false;
+	}
+
+	bf->sidecar = NULL;
+	while ((n = reader_read_lines(&r, lines, lens, BLOOM_POPULATE_BATCH)) > 0) {
+		bloom_hash_batch(bf, (const void *const *)lines, lens, n, hashes);
+
+		if (sc) {
+			sidecar_append(sc, (const uint64_t (*)[SIDECAR_WORDS])hashes, n);
+		}
+		bloom_add_hashed(bf, (const uint64_t (*)[BLOOM_HASH_WORDS])hashes, n);
+	}
+	bf->sidecar = sc;
+
+	reader_close(&r);
+	return true;
+}
+
+// Read the remaining lines, up to BLOOM_STATIC_MAX_KEYS of them, and build
+// the filter from all of them at once. Falls back to adding them one by
+// one if a static stack cannot be built. Lines past the limit are left to
+// the caller.
+static bool populate_static(bloomfilter *bf, reader *r, sidecar *sc) {
+	const char  *lines[BLOOM_POPULATE_BATCH];
+	size_t       lens[BLOOM_POPULATE_BATCH];
+	uint64_t   (*hashes)[BLOOM_HASH_WORDS] = NULL;
+	size_t       capacity = 0;
+	size_t       count = 0;
+	size_t       n;
+
+	while (count + BLOOM_POPULATE_BATCH <= BLOOM_STATIC_MAX_KEYS &&
+		   (n = reader_read_lines(r, lines, lens, BLOOM_POPULATE_BATCH)) > 0) {
+		if (count + n > capacity) {
+			size_t  grown = capacity ? capacity * 2 : BLOOM_POPULATE_BATCH * 64;
+			void   *ptr;
+
+			if (grown > BLOOM_STATIC_MAX_KEYS) {
+				grown = BLOOM_STATIC_MAX_KEYS;
+			}
 
-    while (getline(&line, &len, fp) != -1) {
-        // strip trailing newline
-        size_t read = strlen(line);
-        if (read > 0 && line[read - 1] == '\n') {
-            line[--read] = '\0';
-        }
+			ptr = realloc(hashes, grown * sizeof(*hashes));
 
-        bloom_lookup_or_add_string(bf, line);
-    }
+			if (ptr == NULL) {
+				free(hashes);
+				return false;
+			}
+			hashes = ptr;
+			capacity = grown;
+		}
+
+		bloom_hash_batch(bf, (const void *const *)lines, lens, n, hashes + count);
+		if (sc) {
+			sidecar_append(sc, (const uint64_t (*)[SIDECAR_WORDS])(hashes + count), n);
+		}
+		count += n;
+	}
+
+	bf->sidecar = NULL;
+	if (count > 0 && !bloom_build_static(bf, (const uint64_t (*)[BLOOM_HASH_WORDS])hashes, count)) {
+		bloom_add_hashed(bf, (const uint64_t (*)[BLOOM_HASH_WORDS])hashes, count);
+	}
+	bf->sidecar = sc;
 
-    free(line);
-    fclose(fp);
-    return true;
+	free(hashes);
+	return true;
 }
 
-static inline void calculate_positions(uint64_t position, uint64_t *byte_position, uint8_t *bit_position) {
-	*byte_position = position / 8;
-	*bit_position = position % 8;
+// Reduce a key to the 128-bit hash its bit positions are derived from.
+// hash must hold BLOOM_HASH_WORDS values.
+void bloom_hash(const bloomfilter *bf, const void *element, const size_t len, uint64_t *hash) {
+	if (bf->hash == BF_HASH_WYHASH) {
+		wyhash_128(element, len, 0, hash);
+	} else {
+		mmh3_128(element, len, 0, hash);
+	}
 }
 
-bool bloom_lookup_or_add(bloomfilter *bf, const void *element, const size_t len) {
-	//fprintf(stderr, "DEBUG: base_size=%zu stack_count=%zu size=%zu bitmap_size=%zu hashcount=%zu insert_count=%zu\n", bf->base_size, bf->stack_count, bf->size, bf->bitmap_size, bf->hashcount, bf->insert_count);
-    uint64_t hashes[bf->hashcount];
-    mmh3_64_make_hashes(element, len, bf->hashcount, hashes);
-
-    // search all stacks
-    for (size_t stack = 0; stack < bf->stack_count; stack++) {
-        bool found = true;
-
-        for (size_t i = 0; i < bf->hashcount; i++) {
-            size_t offset = stack * bf->base_size;
-            size_t result = hashes[i] % bf->base_size + offset;
-            size_t byte_position = result / 8;
-            uint8_t bit_position = result % 8;
-
-            if ((bf->bitmap[byte_position] & (1 << bit_position)) == 0) {
-                found = false;
-                break;
-            }
-        }
-
-        if (found) {
+// Hash n keys at once into hashes. mmh3 hashes several keys side by side;
+// wyhash is fast enough one key at a time.
+void bloom_hash_batch(const bloomfilter *bf, const void *const *keys, const size_t *lens, const size_t n, uint64_t (*hashes)[BLOOM_HASH_WORDS]) {
+	if (bf->hash == BF_HASH_WYHASH) {
+		for (size_t i = 0; i < n; i++) {
+			wyhash_128(keys[i], lens[i], 0, hashes[i]);
+		}
+	} else {
+		mmh3_128_batch(keys, lens, n, 0, hashes);
+	}
+}
+
+static inline bool segment_contains(const bloomfilter *bf, const bloom_segment *seg, const uint64_t *hash) {
+	return seg->contains(bf->bitmap, seg, hash);
+}
+
+static inline void segment_set(bloomfilter *bf, const bloom_segment *seg, const uint64_t *hash, const bool atomic) {
+	seg->set(bf->bitmap, seg, hash, atomic);
+}
+
+// Insert a key into the last cuckoo stack. A cuckoo stack can fill up
+// before it has taken the keys it was sized for, so the filter is stacked
+// early if it has to be. If it cannot stack, the key is left out and the
+// filter flagged for a rebuild. Only called for filters that are not shared
+// between threads; see parallel.c.
+static void cuckoo_set(bloomfilter *bf, const uint64_t *hash) {
+	bloom_segment *last = &bf->stacks[bf->stack_count - 1];
+
+	if (last->kind == BF_SEGMENT_CUCKOO && cuckoo_insert(bf->bitmap, last, hash)) {
+		return;
+	}
+
+	if (bloom_stack(bf) && cuckoo_insert(bf->bitmap, &bf->stacks[bf->stack_count - 1], hash)) {
+		return;
+	}
+
+	bf->needs_rebuild = true;
+}
+
+// test a key against every stack, inserting into the last stack if none of
+// them holds it.
+static inline bool lookup_or_set(bloomfilter *bf, const uint64_t *hash, const bool atomic) {
+	for (size_t stack = 0; stack < bf->stack_count; stack++) {
+		if (segment_contains(bf, &bf->stacks[stack], hash)) {
 			return true; // already seen
 		}
-    }
+	}
+
+	if (bf->backend != BF_BACKEND_BLOOM) {
+		cuckoo_set(bf, hash);
+	} else {
+		segment_set(bf, &bf->stacks[bf->stack_count - 1], hash, atomic);
+	}
+
+	return false;
+}
+
+// bytes at the end of the target file checksummed to detect rewrites
+#define BLOOM_TAIL_SIZE 4096
+
+// probes prefetched per key in stacks other than the last
+#define BLOOM_PREFETCH_DEPTH 2
+
+// Prefetch the bitmap bytes a hashed key is about to be tested against.
+void bloom_prefetch(const bloomfilter *bf, const uint64_t *hash) {
+	for (size_t stack = 0; stack < bf->stack_count; stack++) {
+		const bloom_segment *seg = &bf->stacks[stack];
+		size_t               depth = seg->hashcount;
+
+		if (seg->kind == BF_SEGMENT_CUCKOO) {
+			cuckoo_prefetch(bf->bitmap, seg, hash);
+			continue;
+		} else if (seg->kind == BF_SEGMENT_FUSE) {
+			fuse_prefetch(bf->bitmap, seg, hash);
+			continue;
+		}
 
-    // insert into the last stack
-    size_t offset = (bf->stack_count - 1) * bf->base_size;
-    for (size_t i = 0; i < bf->hashcount; i++) {
-        size_t result = hashes[i] % bf->base_size + offset;
-        size_t byte_position = result / 8;
-        uint8_t bit_position = result % 8;
+		if (bf->layout == BF_LAYOUT_BLOCKED) {
+			// every probe shares one cache line
+			__builtin_prefetch(&bf->bitmap[probe_block(seg, hash) / 8], 1);
+			continue;
+		}
 
-        bf->bitmap[byte_position] |= (1 << bit_position);
-    }
+		if (stack + 1 < bf->stack_count && depth > BLOOM_PREFETCH_DEPTH) {
+			// a miss in an older stack usually ends within a couple of
+			// probes. only the last stack may see all of them set.
+			depth = BLOOM_PREFETCH_DEPTH;
+		}
 
-    bf->insert_count++;
+		for (size_t i = 0; i < depth; i++) {
+			__builtin_prefetch(&bf->bitmap[probe_position(seg, hash, i) / 8], 1);
+		}
+	}
+}
+
+static bool lookup_or_add_hashed(bloomfilter *bf, const uint64_t *hash) {
+	if (lookup_or_set(bf, hash, false)) {
+		return true;
+	}
+
+	hll_add(bf->hll, hash[0]);
+	if (bf->sidecar) {
+		sidecar_add(bf->sidecar, hash);
+	}
+	bloom_count_inserts(bf, 1);
+
+	return false;
+}
 
-	if (bf->insert_count >= bf->expected) {
-		if (bf->max_stacks == 0 || bf->stack_count < bf->max_stacks) {
-			//fprintf(stderr, "stacking... stack count: %ld expected: %ld\n", bf->stack_count, bf->expected);
+// Same as lookup_or_add_hashed, but safe to call from several threads at
+// once as long as no thread stacks the filter meanwhile. Bits are set with
+// an atomic OR so concurrent inserts into the same byte are not lost.
+// Inserts are not counted; the caller reports them with bloom_count_inserts
+// once the threads are done.
+bool bloom_lookup_or_set_hashed(bloomfilter *bf, const uint64_t *hash) {
+	if (lookup_or_set(bf, hash, true)) {
+		return true;
+	}
+
+	hll_add_atomic(bf->hll, hash[0]);
+
+	return false;
+}
+
+// Whether the last stack has taken as many keys as it was sized for. The
+// insert count only says when to look: threads may count a key twice, and
+// a filter from an older version may hold more keys than its header says.
+// A Bloom stack is judged by its fill instead. If it can take more, the
+// count is set to the estimate, or BLOOM_FILL_STEP of the stack short of
+// full, so the stack is looked at again after that many more keys.
+static bool last_stack_full(bloomfilter *bf) {
+	size_t         last = bf->stack_count - 1;
+	bloom_segment *seg = &bf->stacks[last];
+	double         estimate;
+	size_t         retry;
+
+	if (seg->kind != BF_SEGMENT_BLOOM) {
+		return true;
+	}
+
+	estimate = bloom_stack_estimate(bf, last);
+	if (estimate >= seg->expected) {
+		return true;
+	}
+
+	retry = seg->expected - (seg->expected + BLOOM_FILL_STEP - 1) / BLOOM_FILL_STEP;
+	bf->insert_count = estimate < retry ? estimate : retry;
+
+	return false;
+}
+
+// account for count new keys, stacking the filter once the last stack has
+// taken as many keys as it was sized for.
+void bloom_count_inserts(bloomfilter *bf, const size_t count) {
+	bf->insert_count += count;
+
+	if (bf->insert_count >= bf->stacks[bf->stack_count - 1].expected && last_stack_full(bf)) {
+		if (bf->stack_count == BLOOM_MAX_STACKS) {
+			bf->needs_rebuild = true;
+		} else if (bf->max_stacks == 0 || bf->stack_count < bf->max_stacks) {
 			if (!bloom_stack(bf)) {
 				fprintf(stderr, "Failed to stack bloom filter\n");
 				// TODO fail or raise error somehow?
@@ -132,138 +424,1148 @@ bool bloom_lookup_or_add(bloomfilter *bf, const void *element, const size_t len)
 	if (bf->max_stacks != 0 && bf->stack_count >= bf->max_stacks) {
 		bf->needs_rebuild = true;
 	}
+}
 
-    return false;
+// number of keys the filter can take before it stacks again
+size_t bloom_capacity(const bloomfilter *bf) {
+	size_t capacity = 0;
+
+	for (size_t stack = 0; stack < bf->stack_count; stack++) {
+		capacity += bf->stacks[stack].expected;
+	}
+
+	return capacity;
+}
+
+bool bloom_lookup_or_add(bloomfilter *bf, const void *element, const size_t len) {
+	uint64_t hash[BLOOM_HASH_WORDS];
+
+	bloom_hash(bf, element, len, hash);
+
+	return lookup_or_add_hashed(bf, hash);
+}
+
+// Look up or add n keys, storing whether each was already present in
+// results. Keys are hashed and their bits prefetched in groups before any
+// of them are tested, so the cache misses of a group overlap instead of
+// stalling one after another. Results are identical to calling
+// bloom_lookup_or_add on each key in order. Returns the number of new keys.
+size_t bloom_lookup_or_add_batch(bloomfilter *bf, const void *const *keys, const size_t *lens, const size_t n, bool *results) {
+	uint64_t hashes[BLOOM_BATCH_SIZE][BLOOM_HASH_WORDS];
+	size_t   added = 0;
+
+	for (size_t start = 0; start < n; start += BLOOM_BATCH_SIZE) {
+		size_t group = (n - start < BLOOM_BATCH_SIZE) ? n - start : BLOOM_BATCH_SIZE;
+
+		bloom_hash_batch(bf, keys + start, lens + start, group, hashes);
+		for (size_t j = 0; j < group; j++) {
+			bloom_prefetch(bf, hashes[j]);
+		}
+
+		// positions are derived from the hash when tested, so keys stay
+		// valid if one of this group causes the filter to stack.
+		for (size_t j = 0; j < group; j++) {
+			results[start + j] = lookup_or_add_hashed(bf, hashes[j]);
+			if (!results[start + j]) {
+				added++;
+			}
+		}
+	}
+
+	return added;
+}
+
+// Test n keys without adding them, storing whether each is present in
+// results. Returns the number of keys present.
+size_t bloom_contains_batch(const bloomfilter *bf, const void *const *keys, const size_t *lens, const size_t n, bool *results) {
+	uint64_t hashes[BLOOM_BATCH_SIZE][BLOOM_HASH_WORDS];
+	size_t   found = 0;
+
+	for (size_t start = 0; start < n; start += BLOOM_BATCH_SIZE) {
+		size_t group = (n - start < BLOOM_BATCH_SIZE) ? n - start : BLOOM_BATCH_SIZE;
+
+		bloom_hash_batch(bf, keys + start, lens + start, group, hashes);
+		for (size_t j = 0; j < group; j++) {
+			bloom_prefetch(bf, hashes[j]);
+		}
+
+		for (size_t j = 0; j < group; j++) {
+			bool present = false;
+
+			for (size_t stack = 0; stack < bf->stack_count && !present; stack++) {
+				present = segment_contains(bf, &bf->stacks[stack], hashes[j]);
+			}
+
+			results[start + j] = present;
+			if (present) {
+				found++;
+			}
+		}
+	}
+
+	return found;
+}
+
+// Add n keys that were hashed earlier, such as the records of a sidecar.
+// Returns the number of keys that were new.
+size_t bloom_add_hashed(bloomfilter *bf, const uint64_t (*hashes)[BLOOM_HASH_WORDS], const size_t n) {
+	size_t added = 0;
+
+	for (size_t start = 0; start < n; start += BLOOM_BATCH_SIZE) {
+		size_t group = (n - start < BLOOM_BATCH_SIZE) ? n - start : BLOOM_BATCH_SIZE;
+
+		for (size_t j = 0; j < group; j++) {
+			bloom_prefetch(bf, hashes[start + j]);
+		}
+
+		for (size_t j = 0; j < group; j++) {
+			if (!lookup_or_add_hashed(bf, hashes[start + j])) {
+				added++;
+			}
+		}
+	}
+
+	return added;
 }
 
 bool bloom_lookup_or_add_string(bloomfilter *bf, const char *element) {
 	return bloom_lookup_or_add(bf, element, strlen(element));
 }
 
+// grow a mapped filter in place by extending its cache file. the new
+// portion reads back as zeros.
+static bool stack_mapped(bloomfilter *bf, const size_t new_size_bytes) {
+	size_t   map_size = BLOOM_HEADER_SIZE + new_size_bytes;
+	uint8_t *base;
+
+	if (ftruncate(bf->map_fd, map_size) == -1) {
+		return false;
+	}
+
+	base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, bf->map_fd, 0);
+	if (base == MAP_FAILED) {
+		return false;
+	}
+
+	madvise(base + BLOOM_HEADER_SIZE, new_size_bytes, MADV_RANDOM);
+	munmap(bf->map_base, bf->map_size);
+
+	bf->map_base = base;
+	bf->map_size = map_size;
+	bf->bitmap   = base + BLOOM_HEADER_SIZE;
+
+	return true;
+}
+
+// Work out the geometry of stack index. Stack i is sized for
+// expected * growth^i keys at an error rate of
+// accuracy * (1 - tightening) * tightening^i; these rates sum to less than
+// accuracy. With a growth and tightening of 1, as in version 1 files, every
+// stack is a copy of the first. Fails if the stack would not fit in memory.
+//
+// Other backends stack cuckoo filters, each sized for growth times the keys
+// of the one before. Their error rate is set by the fingerprint width, so it
+// does not tighten.
+static bool segment_geometry(const bloomfilter *bf, const size_t index, bloom_segment *seg) {
+	const bloom_segment *prev = index > 0 ? &bf->stacks[index - 1] : NULL;
+	double               expected;
+	double               accuracy;
+
+	seg->offset = prev ? prev->offset + prev->size : 0;
+	seg->kind   = BF_SEGMENT_BLOOM;
+	seg->seed   = 0;
+	seg->span   = 0;
+
+	if (bf->backend != BF_BACKEND_BLOOM) {
+		expected = (prev && prev->kind == BF_SEGMENT_CUCKOO) ? prev->expected * bf->growth : bf->expected;
+		if (expected > (double)(SIZE_MAX >> 8)) {
+			return false;
+		}
+
+		seg->kind = BF_SEGMENT_CUCKOO;
+		return cuckoo_geometry(seg, expected);
+	}
+
+	if (prev && bf->growth == 1.0f && bf->tightening == 1.0f) {
+		seg->size      = prev->size;
+		seg->hashcount = prev->hashcount;
+		seg->expected  = prev->expected;
+		return true;
+	}
+
+	expected = bf->expected * pow(bf->growth, index);
+	accuracy = bf->accuracy * pow(bf->tightening, index);
+	if (bf->tightening < 1.0f) {
+		accuracy *= 1.0 - bf->tightening;
+	}
+
+	// a stack this large could not be addressed in bits anyway
+	if (expected < 1 || expected > (double)(SIZE_MAX >> 8)) {
+		return false;
+	}
+
+	seg->expected  = expected;
+	seg->size      = round_size(ideal_size(seg->expected, accuracy), bf->layout);
+	seg->hashcount = round((double)seg->size / seg->expected * log(2));
+	if (seg->hashcount < 1) {
+		seg->hashcount = 1;
+	} else if (seg->hashcount > BLOOM_MAX_HASHES) {
+		seg->hashcount = BLOOM_MAX_HASHES;
+	}
+
+	return true;
+}
+
+// resize the bitmap to new_size_bytes, keeping what fits of its contents.
+// any new portion reads back as zeros.
+static bool resize_bitmap(bloomfilter *bf, const size_t new_size_bytes) {
+	if (bf->mapped) {
+		if (!stack_mapped(bf, new_size_bytes)) {
+			return false;
+		}
+	} else {
+		uint8_t *new_bitmap = bloom_alloc(new_size_bytes);
+		size_t   kept = bf->bitmap_size < new_size_bytes ? bf->bitmap_size : new_size_bytes;
+
+		if (!new_bitmap) {
+			return false;
+		}
+
+		if (bf->bitmap) {
+			memcpy(new_bitmap, bf->bitmap, kept);
+			free(bf->bitmap);
+		}
+		memset(new_bitmap + kept, 0, new_size_bytes - kept);
+
+		bf->bitmap = new_bitmap;
+	}
+
+	bf->bitmap_size = new_size_bytes;
+
+	return true;
+}
+
 bool bloom_stack(bloomfilter *bf) {
-    bf->stack_count++;
-    size_t new_size_bits = bf->base_size * bf->stack_count;
-    size_t new_size_bytes = new_size_bits / 8;
+	bloom_segment seg;
 
-    uint8_t *new_bitmap = realloc(bf->bitmap, new_size_bytes);
-    if (!new_bitmap) {
+	if (bf->stack_count == BLOOM_MAX_STACKS || !segment_geometry(bf, bf->stack_count, &seg)) {
 		return false;
 	}
 
-    // zero the new portion
-    memset(new_bitmap + bf->bitmap_size, 0, new_size_bytes - bf->bitmap_size);
+	size_t new_size_bits = seg.offset + seg.size;
+	size_t new_size_bytes = (new_size_bits + 7) / 8;
 
-    bf->bitmap = new_bitmap;
-    bf->size = new_size_bits;
-    bf->bitmap_size = new_size_bytes;
-    bf->insert_count = 0;
+	if (!resize_bitmap(bf, new_size_bytes)) {
+		return false;
+	}
+
+	probe_select(&seg, bf->layout, bf->reduction);
+	bf->stacks[bf->stack_count++] = seg;
+	bf->size = new_size_bits;
+	bf->insert_count = 0;
 
-    return true;
+	return true;
 }
 
-bloom_error_t bloom_save(const bloomfilter *bf, const char *path) {
-	FILE             *fp;
-	bloomfilter_file  bff = {0};
+static bool same_geometry(const bloom_segment *a, const bloom_segment *b) {
+	return a->offset == b->offset && a->size == b->size && a->hashcount == b->hashcount;
+}
 
-	bff.magic[0] = '!';
-	bff.magic[1] = 'b';
-	bff.magic[2] = 'l';
-	bff.magic[3] = 'o';
-	bff.magic[4] = 'o';
-	bff.magic[5] = 'm';
-	bff.magic[6] = 'z';
-	bff.magic[7] = '!';
-
-	bff.size         = bf->size;
-	bff.hashcount    = bf->hashcount;
-	bff.bitmap_size  = bf->bitmap_size;
-	bff.expected     = bf->expected;
-	bff.accuracy     = bf->accuracy;
-	bff.insert_count = bf->insert_count;
-	bff.base_size    = bf->base_size;
-	bff.stack_count  = bf->stack_count;
-	bff.max_stacks   = bf->max_stacks;
-	bff.ino          = bf->ino;
-	bff.dev          = bf->dev;
-	bff.mtime        = bf->mtime;
-
-	fp = fopen(path, "wb");
-	if (fp == NULL) {
-		return BF_FOPEN;
+// Whether src can be combined into dst with op: both must be Bloom filters
+// hashed, laid out and reduced alike, with stacks in the same places. A
+// union may have src hold more stacks than dst, as long as they are the
+// ones dst would stack next.
+bool bloom_compatible(const bloomfilter *dst, const bloomfilter *src, const bloom_combine_t op) {
+	if (dst->hash != src->hash || dst->layout != src->layout || dst->reduction != src->reduction) {
+		return false;
 	}
 
-	if (fwrite(&bff, sizeof(bloomfilter_file), 1, fp) != 1 ||
-		fwrite(bf->bitmap, bf->bitmap_size, 1, fp) != 1) {
-		fclose(fp);
-		return BF_FWRITE;
+	for (size_t i = 0; i < dst->stack_count; i++) {
+		if (dst->stacks[i].kind != BF_SEGMENT_BLOOM) {
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < src->stack_count; i++) {
+		bloom_segment next;
+
+		if (src->stacks[i].kind != BF_SEGMENT_BLOOM) {
+			return false;
+		}
+
+		if (i < dst->stack_count) {
+			if (!same_geometry(&dst->stacks[i], &src->stacks[i])) {
+				return false;
+			}
+		} else if (!segment_geometry(dst, i, &next) || !same_geometry(&next, &src->stacks[i])) {
+			return false;
+		}
+	}
+
+	if (op == BF_COMBINE_INTERSECTION) {
+		return dst->stack_count == 1 && src->stack_count == 1;
+	}
+
+	return true;
+}
+
+// Merge the bits of src into dst a vector at a time, instead of hashing the
+// keys of src again. dst is stacked as far as src is for a union. The
+// combined filter covers no one target file and has no sidecar; it is
+// meant for lookups, not to be saved over a cache file.
+bloom_error_t bloom_combine(bloomfilter *dst, const bloomfilter *src, const bloom_combine_t op) {
+	if (!bloom_compatible(dst, src, op)) {
+		return BF_INCOMPATIBLE;
 	}
 
-	fclose(fp);
+	if (op == BF_COMBINE_INTERSECTION) {
+		bitops_and(dst->bitmap, src->bitmap, dst->bitmap_size);
+
+		// the keys of both are no more than either has
+		for (size_t i = 0; i < HLL_REGISTERS; i++) {
+			if (src->hll[i] < dst->hll[i]) {
+				dst->hll[i] = src->hll[i];
+			}
+		}
+	} else {
+		while (dst->stack_count < src->stack_count) {
+			if (!bloom_stack(dst)) {
+				return BF_OUTOFMEMORY;
+			}
+		}
+
+		// the last byte of src may hold bits past its end, such as those
+		// set by bloom_load for version 1 files
+		bitops_or(dst->bitmap, src->bitmap, src->size / 8);
+		if (src->size % 8) {
+			dst->bitmap[src->size / 8] |= src->bitmap[src->size / 8] & ((1 << (src->size % 8)) - 1);
+		}
+
+		hll_merge(dst->hll, src->hll);
+	}
+
+	// as in bloom_load, what the last stack holds is in its bits
+	double estimate = bloom_stack_estimate(dst, dst->stack_count - 1);
+
+	dst->insert_count = estimate < SIZE_MAX ? estimate : SIZE_MAX;
+	dst->fingerprints = BLOOM_NO_FINGERPRINTS;
+
 	return BF_SUCCESS;
 }
 
-bloom_error_t bloom_load(bloomfilter *bf, const char *path) {
-	FILE             *fp;
-	struct stat       sb;
-	bloomfilter_file  bff;
+// Replace the empty filter of the fuse backend with a static stack built
+// from n keys at once, followed by an empty cuckoo stack for keys added
+// later. The keys go into the distinct counter but not the sidecar. Fails,
+// leaving the filter as it was, if the filter is not an empty fuse filter or
+// the static stack cannot be built; the caller then adds the keys one by one.
+bool bloom_build_static(bloomfilter *bf, const uint64_t (*hashes)[BLOOM_HASH_WORDS], const size_t n) {
+	bloom_segment  fuse = {0};
+	bloom_segment  tail = {0};
+	size_t         tail_expected = bf->expected > n ? bf->expected - n : 0;
+	uint64_t      *keys;
+	uint8_t       *built;
+
+	if (bf->backend != BF_BACKEND_FUSE || bf->stack_count != 1 || bf->insert_count != 0 ||
+		!fuse_geometry(&fuse, n)) {
+		return false;
+	}
+
+	if (tail_expected < n / BLOOM_STATIC_TAIL) {
+		tail_expected = n / BLOOM_STATIC_TAIL;
+	}
+	if (tail_expected < BLOOM_STATIC_MIN_TAIL) {
+		tail_expected = BLOOM_STATIC_MIN_TAIL;
+	}
+	cuckoo_geometry(&tail, tail_expected);
+	fuse.kind   = BF_SEGMENT_FUSE;
+	tail.kind   = BF_SEGMENT_CUCKOO;
+	tail.offset = fuse.size;
+
+	keys = malloc(n * sizeof(uint64_t));
+	built = bloom_alloc(fuse.size / 8);
+	if (keys == NULL || built == NULL) {
+		free(keys);
+		free(built);
+		return false;
+	}
+
+	// a fuse stack only looks at the first word of a hash
+	for (size_t i = 0; i < n; i++) {
+		keys[i] = hashes[i][0];
+	}
+
+	if (!fuse_build(built, &fuse, keys, n) || !resize_bitmap(bf, (fuse.size + tail.size) / 8)) {
+		free(keys);
+		free(built);
+		return false;
+	}
+	free(keys);
+
+	memcpy(bf->bitmap, built, fuse.size / 8);
+	memset(bf->bitmap + fuse.size / 8, 0, tail.size / 8);
+	free(built);
+
+	probe_select(&fuse, bf->layout, bf->reduction);
+	probe_select(&tail, bf->layout, bf->reduction);
+	bf->stacks[0]    = fuse;
+	bf->stacks[1]    = tail;
+	bf->stack_count  = 2;
+	bf->size         = fuse.size + tail.size;
+	bf->base_size    = fuse.size;
+	bf->hashcount    = fuse.hashcount;
+	bf->insert_count = 0;
 
-	fp = fopen(path, "rb");
-	if (fp == NULL) {
+	for (size_t i = 0; i < n; i++) {
+		hll_add(bf->hll, hashes[i][0]);
+	}
+
+	return true;
+}
+
+// version 1 files carry a shorter, unpadded header with no version or
+// layout. they are told apart from newer files by their size on disk.
+#define BLOOM_V1_HEADER_SIZE offsetof(bloomfilter_file, version)
+
+static void header_from_filter(const bloomfilter *bf, bloomfilter_file *bff) {
+	memcpy(bff->magic, BLOOM_MAGIC, sizeof(bff->magic));
+
+	bff->size         = bf->size;
+	bff->hashcount    = bf->hashcount;
+	bff->bitmap_size  = bf->bitmap_size;
+	bff->expected     = bf->expected;
+	bff->accuracy     = bf->accuracy;
+	bff->insert_count = bf->insert_count;
+	bff->base_size    = bf->base_size;
+	bff->stack_count  = bf->stack_count;
+	bff->max_stacks   = bf->max_stacks;
+	bff->ino          = bf->ino;
+	bff->dev          = bf->dev;
+	bff->mtime        = bf->mtime;
+	bff->target_size  = bf->target_size;
+	bff->tail_hash    = bf->tail_hash;
+	bff->fingerprints = (bf->sidecar && !bf->sidecar->failed) ?
+		sidecar_count(bf->sidecar) : BLOOM_NO_FINGERPRINTS;
+	bff->version      = BLOOM_FILE_VERSION;
+	bff->layout       = bf->layout;
+	bff->growth       = bf->growth;
+	bff->tightening   = bf->tightening;
+	bff->backend      = bf->backend;
+	bff->hash         = bf->hash;
+	bff->reduction    = bf->reduction;
+	memcpy(bff->hll, bf->hll, sizeof(bff->hll));
+
+	for (size_t i = 0; i < bf->stack_count; i++) {
+		bff->stacks[i].offset    = bf->stacks[i].offset;
+		bff->stacks[i].size      = bf->stacks[i].size;
+		bff->stacks[i].hashcount = bf->stacks[i].hashcount;
+		bff->stacks[i].expected  = bf->stacks[i].expected;
+		bff->kinds[i]            = bf->stacks[i].kind;
+		bff->seeds[i]            = bf->stacks[i].seed;
+	}
+}
+
+static void filter_from_header(bloomfilter *bf, const bloomfilter_file *bff) {
+	bf->size         = bff->size;
+	bf->hashcount    = bff->hashcount;
+	bf->bitmap_size  = (bff->size + 7) / 8;
+	bf->expected     = bff->expected;
+	bf->accuracy     = bff->accuracy;
+	bf->insert_count = bff->insert_count;
+	bf->base_size    = bff->base_size;
+	bf->stack_count  = bff->stack_count;
+	bf->max_stacks   = bff->max_stacks;
+	bf->ino          = bff->ino;
+	bf->dev          = bff->dev;
+	bf->mtime        = bff->mtime;
+	bf->target_size  = bff->target_size;
+	bf->tail_hash    = bff->tail_hash;
+	bf->fingerprints = bff->version == 1 ? BLOOM_NO_FINGERPRINTS : bff->fingerprints;
+	bf->sidecar      = NULL;
+	bf->key          = NULL;
+	bf->layout       = bff->layout;
+	bf->backend      = bff->backend;
+	bf->hash         = bff->hash;
+	bf->reduction    = bff->reduction;
+	memcpy(bf->hll, bff->hll, sizeof(bf->hll));
+	memset(bf->stacks, 0, sizeof(bf->stacks));
+
+	if (bff->version == 1) {
+		// version 1 stacks were all copies of the first
+		bf->growth     = 1.0f;
+		bf->tightening = 1.0f;
+		for (size_t i = 0; i < bf->stack_count; i++) {
+			bf->stacks[i].offset    = i * bff->base_size;
+			bf->stacks[i].size      = bff->base_size;
+			bf->stacks[i].hashcount = bff->hashcount;
+			bf->stacks[i].expected  = bff->expected;
+		}
+	} else {
+		bf->growth     = bff->growth;
+		bf->tightening = bff->tightening;
+		for (size_t i = 0; i < bf->stack_count; i++) {
+			bloom_segment *seg = &bf->stacks[i];
+
+			seg->offset    = bff->stacks[i].offset;
+			seg->size      = bff->stacks[i].size;
+			seg->hashcount = bff->stacks[i].hashcount;
+			seg->expected  = bff->stacks[i].expected;
+			seg->kind      = bff->kinds[i];
+
+			// the span of a fuse stack follows from the keys it was built for
+			if (seg->kind == BF_SEGMENT_FUSE) {
+				fuse_geometry(seg, seg->expected);
+			}
+			seg->seed = bff->seeds[i];
+		}
+	}
+
+	for (size_t i = 0; i < bf->stack_count; i++) {
+		probe_select(&bf->stacks[i], bf->layout, bf->reduction);
+	}
+
+	bf->needs_rebuild = false;
+	bf->mapped        = false;
+}
+
+// checksum the BLOOM_TAIL_SIZE bytes of a file that end at offset size, and
+// note whether they end a line.
+static bool tail_hash(const int fd, const uint64_t size, uint64_t *hash, bool *newline) {
+	uint8_t buf[BLOOM_TAIL_SIZE];
+	size_t  len = size < BLOOM_TAIL_SIZE ? size : BLOOM_TAIL_SIZE;
+
+	if (pread(fd, buf, len, size - len) != (ssize_t)len) {
+		return false;
+	}
+
+	*hash = mmh3_64(buf, len, 0);
+	*newline = (len == 0 || buf[len - 1] == '\n');
+
+	return true;
+}
+
+// Compare the recorded state of a target file with the file as it is now.
+// The target must be the same file, no shorter, and end its first size
+// bytes exactly as it did when recorded. If it has grown, the old end must
+// also have been the end of a line, or the first appended line would be
+// the tail of a line already covered.
+bloom_error_t bloom_target_check(const bloom_target *state, const char *target) {
+	struct stat st;
+	uint64_t    hash;
+	bool        newline;
+	int         fd;
+
+	fd = open(target, O_RDONLY);
+	if (fd == -1) {
+		return BF_STALE;
+	}
+
+	if (fstat(fd, &st) == -1 ||
+		state->ino != (uint64_t)st.st_ino ||
+		state->dev != (uint64_t)st.st_dev ||
+		(uint64_t)st.st_size < state->size ||
+		((uint64_t)st.st_size == state->size && state->mtime != (uint64_t)st.st_mtime) ||
+		!tail_hash(fd, state->size, &hash, &newline) ||
+		hash != state->tail_hash) {
+		close(fd);
+		return BF_STALE;
+	}
+	close(fd);
+
+	if ((uint64_t)st.st_size > state->size) {
+		return newline ? BF_GROWN : BF_STALE;
+	}
+
+	return BF_SUCCESS;
+}
+
+// Record the state of a target file as it is now.
+bloom_error_t bloom_target_record(bloom_target *state, const char *target) {
+	struct stat st;
+	bool        newline;
+	int         fd;
+
+	fd = open(target, O_RDONLY);
+	if (fd == -1) {
 		return BF_FOPEN;
 	}
 
-	if (fstat(fileno(fp), &sb) == -1) {
-		fclose(fp);
+	if (fstat(fd, &st) == -1) {
+		close(fd);
 		return BF_FSTAT;
 	}
 
-	if (fread(&bff, sizeof(bloomfilter_file), 1, fp) != 1) {
-		fclose(fp);
+	if (!tail_hash(fd, st.st_size, &state->tail_hash, &newline)) {
+		close(fd);
 		return BF_FREAD;
 	}
+	close(fd);
 
-	bf->size         = bff.size;
-	bf->hashcount    = bff.hashcount;
-	bf->bitmap_size  = bff.bitmap_size;
-	bf->expected     = bff.expected;
-	bf->accuracy     = bff.accuracy;
-	bf->insert_count = bff.insert_count;
-	bf->base_size    = bff.base_size;
-	bf->stack_count  = bff.stack_count;
-	bf->max_stacks   = bff.max_stacks;
-	bf->ino          = bff.ino;
-	bf->dev          = bff.dev;
-	bf->mtime        = bff.mtime;
+	state->ino   = st.st_ino;
+	state->dev   = st.st_dev;
+	state->mtime = st.st_mtime;
+	state->size  = st.st_size;
 
-	bf->needs_rebuild = false;
+	return BF_SUCCESS;
+}
+
+static bloom_error_t check_target(const bloomfilter_file *bff, const char *target) {
+	bloom_target state = {
+		.ino       = bff->ino,
+		.dev       = bff->dev,
+		.mtime     = bff->mtime,
+		.size      = bff->target_size,
+		.tail_hash = bff->tail_hash
+	};
+
+	// version 1 files only recorded the mtime
+	if (bff->version == 1) {
+		struct stat st;
+
+		if (stat(target, &st) == -1 ||
+			bff->ino != (uint64_t)st.st_ino ||
+			bff->dev != (uint64_t)st.st_dev ||
+			bff->mtime != (uint64_t)st.st_mtime) {
+			return BF_STALE;
+		}
+
+		return BF_SUCCESS;
+	}
+
+	return bloom_target_check(&state, target);
+}
+
+// Record the state of the target file a filter now covers, so a later
+// bloom_load can tell whether the file changed since.
+bloom_error_t bloom_set_target(bloomfilter *bf, const char *target) {
+	bloom_target  state;
+	bloom_error_t error;
+
+	error = bloom_target_record(&state, target);
+	if (error != BF_SUCCESS) {
+		return error;
+	}
+
+	bf->ino         = state.ino;
+	bf->dev         = state.dev;
+	bf->mtime       = state.mtime;
+	bf->target_size = state.size;
+	bf->tail_hash   = state.tail_hash;
+
+	return BF_SUCCESS;
+}
 
-	// check if filter has changed on disk. if so, the filter cannot be trusted and must be rebuilt
+// the kinds of stack a backend may hold. only the first stack of a fuse
+// filter can be static.
+static bool kind_valid(const bloomfilter_file *bff, const size_t index) {
+	switch (bff->backend) {
+	case BF_BACKEND_BLOOM:
+		return bff->kinds[index] == BF_SEGMENT_BLOOM;
+	case BF_BACKEND_CUCKOO:
+		return bff->kinds[index] == BF_SEGMENT_CUCKOO;
+	case BF_BACKEND_FUSE:
+		return bff->kinds[index] == BF_SEGMENT_CUCKOO ||
+			(bff->kinds[index] == BF_SEGMENT_FUSE && index == 0);
+	}
+
+	return false;
+}
+
+// stacks must be laid out back to back and cover the whole bitmap
+static bool segments_valid(const bloomfilter_file *bff) {
+	uint64_t offset = 0;
+
+	if (!(bff->growth >= 1.0f) || !(bff->tightening > 0.0f && bff->tightening <= 1.0f)) {
+		return false;
+	}
+
+	for (size_t i = 0; i < bff->stack_count; i++) {
+		const bloom_segment_file *file = &bff->stacks[i];
+		bloom_segment             seg = {
+			.offset    = file->offset,
+			.size      = file->size,
+			.hashcount = file->hashcount,
+			.expected  = file->expected
+		};
+
+		if (seg.offset != offset || seg.size == 0 || seg.expected == 0 || !kind_valid(bff, i)) {
+			return false;
+		}
+
+		if (bff->kinds[i] == BF_SEGMENT_CUCKOO) {
+			if (!cuckoo_valid(&seg)) {
+				return false;
+			}
+		} else if (bff->kinds[i] == BF_SEGMENT_FUSE) {
+			if (!fuse_valid(&seg)) {
+				return false;
+			}
+		} else if (seg.hashcount == 0 || seg.hashcount > BLOOM_MAX_HASHES ||
+			(bff->layout == BF_LAYOUT_BLOCKED && seg.size % BLOOM_BLOCK_BITS != 0)) {
+			return false;
+		}
+
+		offset += seg.size;
+	}
+
+	return offset == bff->size;
+}
+
+// whether a file the size of a version 1 file is a packed one instead
+static bool packed_header(const int fd, const struct stat *sb) {
+	bloomfilter_file bff;
+
+	return (uint64_t)sb->st_size >= sizeof(bloomfilter_file) &&
+		pread(fd, &bff, sizeof(bff), 0) == sizeof(bff) &&
+		bff.version >= 11 && bff.version <= BLOOM_FILE_VERSION &&
+		bff.packing == BF_PACKING_CHUNKED;
+}
+
+// Read and validate a cache file header without touching the bitmap. If
+// target is given, the filter must match that file as it is now or it
+// cannot be trusted and must be rebuilt. A target that has only had lines
+// appended since the filter was saved yields BF_GROWN; the filter is valid
+// for the first target_size bytes, see bloom_populate_from_offset.
+static bloom_error_t read_header(const int fd, const struct stat *sb, const char *target, bloomfilter_file *bff, size_t *header_size) {
+	if (pread(fd, bff, BLOOM_V1_HEADER_SIZE, 0) != BLOOM_V1_HEADER_SIZE) {
+		return BF_FREAD;
+	}
+
+	if (memcmp(bff->magic, BLOOM_MAGIC, sizeof(bff->magic)) != 0) {
+		return BF_INVALIDFILE;
+	}
+
+	// a packed file can be any size, including that of a version 1 file
+	if (BLOOM_V1_HEADER_SIZE + bff->bitmap_size == (uint64_t)sb->st_size && !packed_header(fd, sb)) {
+		// version 1 bitmaps were truncated to whole bytes. see bloom_load
+		*header_size = BLOOM_V1_HEADER_SIZE;
+		bff->version = 1;
+		bff->layout  = BF_LAYOUT_STANDARD;
+		if (bff->size / 8 != bff->bitmap_size) {
+			return BF_INVALIDFILE;
+		}
+	} else {
+		if (pread(fd, bff, sizeof(bloomfilter_file), 0) != sizeof(bloomfilter_file)) {
+			return BF_FREAD;
+		}
+
+		*header_size = BLOOM_HEADER_SIZE;
+		if (bff->version < 11) {
+			bff->packing = BF_PACKING_RAW;
+		}
+
+		if (bff->version < BLOOM_FILE_VERSION_MIN || bff->version > BLOOM_FILE_VERSION ||
+			bff->layout > BF_LAYOUT_BLOCKED || bff->backend > BF_BACKEND_FUSE ||
+			bff->hash > BF_HASH_WYHASH || bff->reduction > BF_REDUCE_MULTIPLY ||
+			bff->packing > BF_PACKING_CHUNKED ||
+			(bff->size + 7) / 8 != bff->bitmap_size) {
+			return BF_INVALIDFILE;
+		}
+
+		// the chunks themselves are checked as they are read. see pack_read
+		if (bff->packing == BF_PACKING_CHUNKED ?
+			bff->chunk_size != PACK_CHUNK_SIZE ||
+			bff->chunk_count != pack_chunk_count(bff->bitmap_size) ||
+			BLOOM_HEADER_SIZE + bff->chunk_count * sizeof(pack_chunk) > (uint64_t)sb->st_size :
+			BLOOM_HEADER_SIZE + bff->bitmap_size != (uint64_t)sb->st_size) {
+			return BF_INVALIDFILE;
+		}
+	}
 
 	// basic sanity check. should fail if filter isn't valid
-	if ((bf->size / 8) != bf->bitmap_size ||
-		sizeof(bloomfilter_file) + bf->bitmap_size != sb.st_size) {
-		fclose(fp);
+	if (bff->expected == 0 || bff->stack_count == 0 || bff->stack_count > BLOOM_MAX_STACKS) {
 		return BF_INVALIDFILE;
 	}
 
-	bf->bitmap = malloc(bf->bitmap_size);
+	if (bff->version == 1) {
+		if (bff->base_size == 0 ||
+			bff->hashcount == 0 || bff->hashcount > BLOOM_MAX_HASHES ||
+			bff->base_size * bff->stack_count != bff->size) {
+			return BF_INVALIDFILE;
+		}
+	} else if (!segments_valid(bff)) {
+		return BF_INVALIDFILE;
+	}
+
+	if (target != NULL) {
+		return check_target(bff, target);
+	}
+
+	return BF_SUCCESS;
+}
+
+// Write a cache file to a temporary file beside path and rename it into
+// place, so a reader sees either the old file or the whole new one. The
+// bitmap is packed unless raw is set.
+static bloom_error_t save_file(const bloomfilter *bf, const char *path, const bool raw) {
+	int               fd;
+	char              temp[PATH_MAX];
+	uint8_t           header[BLOOM_HEADER_SIZE] = {0};
+	bloomfilter_file *bff = (bloomfilter_file *)header;
+	bool              ok;
+
+	header_from_filter(bf, bff);
+
+	if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int)sizeof(temp)) {
+		return BF_FOPEN;
+	}
+
+	fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1) {
+		return BF_FOPEN;
+	}
+
+	if (raw) {
+		// a raw copy is the same filter rewritten, so it still matches its sidecar
+		bff->fingerprints = bf->fingerprints;
+
+		// the bitmap goes out as several large writes in flight at once
+		ok = uring_pwrite_all(fd, bf->bitmap, bf->bitmap_size, sizeof(header));
+	} else {
+		bff->packing     = BF_PACKING_CHUNKED;
+		bff->chunk_size  = PACK_CHUNK_SIZE;
+		bff->chunk_count = pack_chunk_count(bf->bitmap_size);
+		ok = pack_write(fd, sizeof(header), bf->bitmap, bf->bitmap_size, &bff->dir_checksum);
+	}
+
+	// the header goes last, so it only ever describes a complete bitmap
+	ok = ok && uring_pwrite_all(fd, header, sizeof(header), 0);
+	if (close(fd) == -1 || !ok) {
+		unlink(temp);
+		return BF_FWRITE;
+	}
+
+	if (rename(temp, path) == -1) {
+		unlink(temp);
+		return BF_FWRITE;
+	}
+
+	return BF_SUCCESS;
+}
+
+// Save a filter to path. A mapped filter is already backed by its cache
+// file, so only its header is written and the kernel flushes dirty pages.
+bloom_error_t bloom_save(const bloomfilter *bf, const char *path) {
+	uint8_t header[BLOOM_HEADER_SIZE] = {0};
+
+	if (bf->mapped) {
+		header_from_filter(bf, (bloomfilter_file *)header);
+		memcpy(bf->map_base, header, sizeof(bloomfilter_file));
+		if (msync(bf->map_base, BLOOM_HEADER_SIZE, MS_ASYNC) == -1) {
+			return BF_FWRITE;
+		}
+
+		return BF_SUCCESS;
+	}
+
+	return save_file(bf, path, false);
+}
+
+bloom_error_t bloom_load(bloomfilter *bf, const char *path, const char *target) {
+	int               fd;
+	struct stat       sb;
+	bloomfilter_file  bff = {0};
+	size_t            header_size;
+	bloom_error_t     error;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return BF_FOPEN;
+	}
+
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return BF_FSTAT;
+	}
+
+	error = read_header(fd, &sb, target, &bff, &header_size);
+	if (error != BF_SUCCESS && error != BF_GROWN) {
+		close(fd);
+		return error;
+	}
+
+	filter_from_header(bf, &bff);
+
+	bf->bitmap = bloom_alloc(bf->bitmap_size);
 	if (bf->bitmap == NULL) {
-		fclose(fp);
+		close(fd);
 		return BF_OUTOFMEMORY;
 	}
 
-	if (fread(bf->bitmap, bf->bitmap_size, 1, fp) != 1) {
-		fclose(fp);
+	if (bff.packing == BF_PACKING_CHUNKED) {
+		// a torn or damaged file fails its checksums and is rebuilt
+		if (!pack_read(fd, header_size, sb.st_size, bf->bitmap, bf->bitmap_size, bff.dir_checksum)) {
+			close(fd);
+			free(bf->bitmap);
+			bf->bitmap = NULL;
+			return BF_INVALIDFILE;
+		}
+	} else if (!uring_pread_all(fd, bf->bitmap, bff.bitmap_size, header_size)) {
+		close(fd);
 		free(bf->bitmap);
 		bf->bitmap = NULL;
 		return BF_FREAD;
 	}
 
-	fclose(fp);
+	// version 1 filters dropped the last few bits of the final stack. they
+	// are restored as set so keys hashing there are not reported as new forever.
+	if (bf->bitmap_size != bff.bitmap_size) {
+		bf->bitmap[bf->bitmap_size - 1] = 0xff;
+	}
+
+	close(fd);
+
+	// the header's insert count is only as good as the run that wrote it.
+	// what the last stack holds is in its bits. mapped filters keep the
+	// header's count rather than fault the whole stack in
+	if (bf->stacks[bf->stack_count - 1].kind == BF_SEGMENT_BLOOM) {
+		double estimate = bloom_stack_estimate(bf, bf->stack_count - 1);
+
+		bf->insert_count = estimate < SIZE_MAX ? estimate : SIZE_MAX;
+	}
+
+	return error;
+}
+
+// Map a cache file MAP_SHARED instead of reading it. Pages are faulted in as
+// keys touch them and written back by the kernel, so neither loading nor
+// saving has to copy the whole bitmap. Version 1 files have an unaligned
+// header and are read with bloom_load instead. Packed files are unpacked
+// and rewritten raw first.
+bloom_error_t bloom_map(bloomfilter *bf, const char *path, const char *target) {
+	int               fd;
+	struct stat       sb;
+	bloomfilter_file  bff = {0};
+	size_t            header_size;
+	bloom_error_t     error;
+	uint8_t          *base;
+
+	fd = open(path, O_RDWR);
+	if (fd == -1) {
+		return BF_FOPEN;
+	}
+
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return BF_FSTAT;
+	}
+
+	error = read_header(fd, &sb, target, &bff, &header_size);
+	if (error != BF_SUCCESS && error != BF_GROWN) {
+		close(fd);
+		return error;
+	}
+
+	if (header_size != BLOOM_HEADER_SIZE) {
+		close(fd);
+		return bloom_load(bf, path, target);
+	}
+
+	if (bff.packing == BF_PACKING_CHUNKED) {
+		bloomfilter raw;
+
+		close(fd);
+		error = bloom_load(&raw, path, target);
+		if (error != BF_SUCCESS && error != BF_GROWN) {
+			return error;
+		}
+
+		error = save_file(&raw, path, true);
+		bloom_destroy(&raw);
+		if (error != BF_SUCCESS) {
+			return error;
+		}
+
+		return bloom_map(bf, path, target);
+	}
+
+	base = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		close(fd);
+		return BF_MMAP;
+	}
+
+	// lookups are random. readahead would only fault in pages nobody asked for
+	madvise(base + BLOOM_HEADER_SIZE, bff.bitmap_size, MADV_RANDOM);
+
+	filter_from_header(bf, &bff);
+	bf->mapped   = true;
+	bf->map_fd   = fd;
+	bf->map_base = base;
+	bf->map_size = sb.st_size;
+	bf->bitmap   = base + BLOOM_HEADER_SIZE;
+
+	// bits set from here on may not be in the target file yet. record an
+	// impossible target size so the file is rejected as stale until bloom_save.
+	((bloomfilter_file *)base)->mtime = 0;
+	((bloomfilter_file *)base)->target_size = UINT64_MAX;
+
+	return error;
+}
+
+// estimated number of distinct keys inserted since the filter was created
+size_t bloom_distinct(const bloomfilter *bf) {
+	return hll_estimate(bf->hll);
+}
+
+// Share of a stack in use: bits set in a Bloom stack, slots taken in a
+// cuckoo or fuse stack.
+double bloom_stack_fill(const bloomfilter *bf, const size_t stack) {
+	const bloom_segment *seg = &bf->stacks[stack];
+
+	switch (seg->kind) {
+	case BF_SEGMENT_CUCKOO:
+		return cuckoo_fill(bf->bitmap, seg);
+	case BF_SEGMENT_FUSE:
+		return (double)seg->expected / (seg->size / FUSE_FINGERPRINT_BITS);
+	default:
+		return seg->size ? (double)popcount_bytes(bf->bitmap + seg->offset / 8, seg->size / 8) / seg->size : 0.0;
+	}
+}
+
+// Distinct keys in a stack, from how full it is. For a Bloom stack of m
+// bits and k hashes with a share f of its bits set, that is -m/k ln(1 - f)
+// (Swamidass and Baldi, 2007); the other kinds count their slots.
+static double fill_estimate(const bloom_segment *seg, const double fill) {
+	switch (seg->kind) {
+	case BF_SEGMENT_CUCKOO:
+		return fill * (seg->size / 64) * CUCKOO_SLOTS;
+	case BF_SEGMENT_FUSE:
+		return seg->expected;
+	default:
+		if (fill >= 1.0) {
+			return INFINITY;
+		}
+		// an empty stack would give -0
+		if (fill <= 0.0) {
+			return 0.0;
+		}
+		return -(double)seg->size / seg->hashcount * log(1.0 - fill);
+	}
+}
+
+double bloom_stack_estimate(const bloomfilter *bf, const size_t stack) {
+	return fill_estimate(&bf->stacks[stack], bloom_stack_fill(bf, stack));
+}
+
+// Distinct keys in the filter, from how full each stack is. A key is only
+// ever added to one stack, so the stacks add up.
+double bloom_estimate(const bloomfilter *bf) {
+	double estimate = 0.0;
+
+	for (size_t i = 0; i < bf->stack_count; i++) {
+		estimate += bloom_stack_estimate(bf, i);
+	}
+
+	return estimate;
+}
+
+// The chance that a key never added is found anyway, given how full every
+// stack is now rather than how full it was sized to get.
+double bloom_fpr(const bloomfilter *bf) {
+	double miss = 1.0;
+
+	for (size_t i = 0; i < bf->stack_count; i++) {
+		const bloom_segment *seg = &bf->stacks[i];
+		double               fill = bloom_stack_fill(bf, i);
+		double               fpr;
+
+		switch (seg->kind) {
+		case BF_SEGMENT_CUCKOO:
+			// two buckets of CUCKOO_SLOTS fingerprints, none of them 0
+			fpr = 1.0 - pow(1.0 - 1.0 / ((1 << CUCKOO_FINGERPRINT_BITS) - 1), 2 * CUCKOO_SLOTS * fill);
+			break;
+		case BF_SEGMENT_FUSE:
+			fpr = 1.0 / (1 << FUSE_FINGERPRINT_BITS);
+			break;
+		default:
+			fpr = pow(fill, seg->hashcount);
+			break;
+		}
+
+		miss *= 1.0 - fpr;
+	}
+
+	return 1.0 - miss;
+}
+
+// The false positive rate bloom_combine would leave a union of two
+// compatible filters with. Their bits are taken to be independent, so a
+// stack ends up with a share fa + fb - fa fb of its bits set.
+double bloom_union_fpr(const bloomfilter *dst, const bloomfilter *src) {
+	const bloomfilter *longer = src->stack_count > dst->stack_count ? src : dst;
+	double             miss = 1.0;
 
+	for (size_t i = 0; i < longer->stack_count; i++) {
+		double fa = i < dst->stack_count ? bloom_stack_fill(dst, i) : 0.0;
+		double fb = i < src->stack_count ? bloom_stack_fill(src, i) : 0.0;
+
+		miss *= 1.0 - pow(fa + fb - fa * fb, longer->stacks[i].hashcount);
+	}
+
+	return 1.0 - miss;
+}
+
+// Estimate the distinct keys of a cached filter from its header alone,
+// whether or not it is still valid for its target file, along with the size
+// the target file had then. Used to size a rebuild without counting the
+// lines of the target file first.
+bloom_error_t bloom_cached_distinct(const char *path, size_t *distinct, uint64_t *target_size) {
+	struct stat       sb;
+	bloomfilter_file  bff = {0};
+	size_t            header_size;
+	bloom_error_t     error;
+	int               fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return BF_FOPEN;
+	}
+
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return BF_FSTAT;
+	}
+
+	error = read_header(fd, &sb, NULL, &bff, &header_size);
+	close(fd);
+	if (error != BF_SUCCESS) {
+		return error;
+	}
+
+	// version 1 files have no distinct counter
+	if (bff.version == 1) {
+		return BF_INVALIDFILE;
+	}
+
+	*distinct = hll_estimate(bff.hll);
+	*target_size = bff.target_size;
 	return BF_SUCCESS;
 }
 
+// look up a backend by name
+bool bloom_backend_parse(const char *name, bloom_backend_t *backend) {
+	for (size_t i = 0; i < sizeof(bloom_backends) / sizeof(bloom_backends[0]); i++) {
+		if (strcmp(name, bloom_backends[i]) == 0) {
+			*backend = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// look up a hash function by name
+bool bloom_hash_parse(const char *name, bloom_hash_t *hash) {
+	for (size_t i = 0; i < sizeof(bloom_hashes) / sizeof(bloom_hashes[0]); i++) {
+		if (strcmp(name, bloom_hashes[i]) == 0) {
+			*hash = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
 const char *bloom_strerror(bloom_error_t error) {
 	if (error < 0 || error >= BF_ERRORCOUNT) {
 		return "Unknown error";
@@ -4,6 +4,11 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/stat.h>
+
+#include "hll.h"
+#include "sidecar.h"
+#include "key.h"
 
 typedef enum {
 	BF_SUCCESS = 0,
@@ -13,27 +18,173 @@ typedef enum {
 	BF_FWRITE,
 	BF_FSTAT,
 	BF_INVALIDFILE,
+	BF_MMAP,
+	BF_STALE,
+	BF_GROWN,
+	BF_INCOMPATIBLE,
 	// ERRORCOUNT is used as a counter. do not add anything below this line.
 	BF_ERRORCOUNT
 } bloom_error_t;
 
+// BF_LAYOUT_BLOCKED confines all of a key's bits to a single 64-byte
+// block per stack, trading a slightly higher false positive rate for one
+// cache miss per stack instead of one per hash.
+typedef enum {
+	BF_LAYOUT_STANDARD = 0,
+	BF_LAYOUT_BLOCKED
+} bloom_layout_t;
+
+#define BLOOM_BLOCK_BITS 512
+
+// The backend picks what kind of filter stacks are. BF_BACKEND_CUCKOO
+// stacks cuckoo filters, which take no more memory than a Bloom filter at
+// low error rates. BF_BACKEND_FUSE builds the keys of the target file into
+// a static binary fuse filter in one go and stacks cuckoo filters for the
+// keys streamed after it.
+typedef enum {
+	BF_BACKEND_BLOOM = 0,
+	BF_BACKEND_CUCKOO,
+	BF_BACKEND_FUSE
+} bloom_backend_t;
+
+typedef enum {
+	BF_SEGMENT_BLOOM = 0,
+	BF_SEGMENT_CUCKOO,
+	BF_SEGMENT_FUSE
+} bloom_segment_kind;
+
+// The function keys are hashed with. A filter only ever holds keys hashed
+// with one of them, so it is stored in the cache file and sidecar.
+typedef enum {
+	BF_HASH_MMH3 = 0,
+	BF_HASH_WYHASH
+} bloom_hash_t;
+
+// How a probe hash is reduced to a bit of a stack. Filters saved before
+// version 10 take it modulo the stack size. Newer ones take the high bits
+// of its product with the size, which costs a multiply instead of a
+// division.
+typedef enum {
+	BF_REDUCE_MODULO = 0,
+	BF_REDUCE_MULTIPLY
+} bloom_reduction_t;
+
+// How the bitmap follows the header in a cache file. Filters are saved
+// packed. Mapped filters need their bitmap as is, so a packed file is
+// rewritten raw the first time it is mapped.
+typedef enum {
+	BF_PACKING_RAW = 0,
+	BF_PACKING_CHUNKED
+} bloom_packing_t;
+
+// How bloom_combine merges one filter into another. A union holds every
+// key of both. An intersection holds the keys of both, along with keys
+// whose bits happen to be set in both; it is only possible for filters of
+// a single stack, since a key may sit in different stacks of each.
+typedef enum {
+	BF_COMBINE_UNION = 0,
+	BF_COMBINE_INTERSECTION
+} bloom_combine_t;
+
+// state of the target file a filter covers, used to tell whether the file
+// changed since the filter was saved
+typedef struct {
+	uint64_t ino;
+	uint64_t dev;
+	uint64_t mtime;
+	uint64_t size;
+	uint64_t tail_hash;
+} bloom_target;
+
+// number of keys bloom_lookup_or_add_batch hashes and prefetches at a time
+#define BLOOM_BATCH_SIZE 32
+
+// each key is reduced to a 128-bit hash that every stack derives its own
+// bit positions from
+#define BLOOM_HASH_WORDS 2
+
+// Stacks form a scalable Bloom filter: each one is sized for BLOOM_GROWTH
+// times the keys of the one before it, with a false positive rate
+// BLOOM_TIGHTENING times lower, so the overall rate stays below the
+// filter's accuracy however many stacks are added.
+#define BLOOM_MAX_STACKS  32
+#define BLOOM_GROWTH      2.0f
+#define BLOOM_TIGHTENING  0.5f
+
+// probe kernels, picked per stack by probe_select. see probe.h
+struct bloom_segment;
+
+typedef bool (*bloom_contains_fn)(const uint8_t *, const struct bloom_segment *, const uint64_t *);
+typedef void (*bloom_set_fn)(uint8_t *, const struct bloom_segment *, const uint64_t *, const bool);
+
+typedef struct bloom_segment {
+	uint64_t offset;     // first bit of the stack in the bitmap
+	uint64_t size;       // bits
+	uint64_t hashcount;
+	uint64_t expected;   // keys the stack is sized for
+	uint32_t kind;       // bloom_segment_kind
+	uint64_t seed;       // fuse stacks: seed the keys were built with
+	uint64_t span;       // fuse stacks: slots the first position is drawn from
+	uint32_t reduction;  // bloom_reduction_t
+	__uint128_t magic;   // reciprocal of the modulus for BF_REDUCE_MODULO
+	bloom_contains_fn contains;
+	bloom_set_fn      set;
+} bloom_segment;
+
+// how a segment is stored in a cache file. kind and seed follow the rest
+// of the header so older versions keep their layout.
+typedef struct {
+	uint64_t offset;
+	uint64_t size;
+	uint64_t hashcount;
+	uint64_t expected;
+} bloom_segment_file;
+
 typedef struct {
 	size_t   size;
-	size_t   base_size; // size of one stacked segment
-	size_t   hashcount;
+	size_t   base_size; // size of the first stack
+	size_t   hashcount; // hashes of the first stack
 	size_t   bitmap_size;
-	size_t   expected;
+	size_t   expected;  // keys the first stack is sized for
 	float    accuracy;
-	size_t   insert_count;
+	float    growth;
+	float    tightening;
+	size_t   insert_count; // keys in the last stack
 	size_t   max_stacks;
 	size_t   stack_count;  // how many stacks are currently active
 	size_t   needs_rebuild;
+	bloom_segment stacks[BLOOM_MAX_STACKS];
 	uint64_t ino;
 	uint64_t dev;
 	uint64_t mtime;
+	uint64_t target_size; // bytes of the target file the filter covers
+	uint64_t tail_hash;   // checksum of the last bytes of those
+	bloom_layout_t layout;
+	bloom_backend_t backend;
+	bloom_hash_t hash;
+	bloom_reduction_t reduction;
+	uint8_t  hll[HLL_REGISTERS]; // distinct keys inserted, across all stacks
+	uint64_t fingerprints; // records in the sidecar the filter was saved with
+	sidecar *sidecar;      // if set, the hash of every inserted key is added here
+	const key_spec *key;   // if set, what lines of the target file are keyed by
+	bool     mapped;     // bitmap lives in a MAP_SHARED cache file
+	int      map_fd;
+	uint8_t *map_base;
+	size_t   map_size;
 	uint8_t *bitmap;
 } bloomfilter;
 
+#define BLOOM_MAGIC        "!bloomz!"
+#define BLOOM_FILE_VERSION 11
+#define BLOOM_MAX_HASHES   64
+
+// fingerprints value of a filter that has no complete sidecar
+#define BLOOM_NO_FINGERPRINTS UINT64_MAX
+
+// the header is padded to a page so a cache file can be mapped with the
+// bitmap page aligned.
+#define BLOOM_HEADER_SIZE  4096
+
 typedef struct {
 	uint8_t  magic[8];
 	uint64_t size;
@@ -48,16 +199,67 @@ typedef struct {
 	uint64_t ino;
 	uint64_t dev;
 	uint64_t mtime;
+	// fields below were added in version 2. version 1 files end here.
+	uint32_t version;
+	uint32_t layout;
+	uint64_t target_size;
+	uint64_t tail_hash;
+	uint64_t fingerprints;
+	float    growth;
+	float    tightening;
+	bloom_segment_file stacks[BLOOM_MAX_STACKS];
+	uint8_t  hll[HLL_REGISTERS];
+	// fields below were added in version 8. version 7 files are all bloom.
+	uint64_t seeds[BLOOM_MAX_STACKS];
+	uint32_t backend;
+	uint8_t  kinds[BLOOM_MAX_STACKS];
+	// fields below were added in version 9. older files hash with mmh3.
+	uint32_t hash;
+	// fields below were added in version 10. older files reduce by modulo.
+	uint32_t reduction;
+	// fields below were added in version 11. older files store the bitmap raw.
+	uint32_t packing;
+	uint32_t chunk_count;
+	uint64_t chunk_size;
+	uint64_t dir_checksum; // of the chunk directory. see pack.h
 } bloomfilter_file;
 
-bloom_error_t  bloom_init(bloomfilter *, const size_t, const float, const size_t);
+_Static_assert(sizeof(bloomfilter_file) <= BLOOM_HEADER_SIZE, "header does not fit its page");
+
+bloom_error_t  bloom_init(bloomfilter *, const size_t, const float, const size_t, const bloom_layout_t, const bloom_backend_t, const bloom_hash_t);
 void           bloom_destroy(bloomfilter *);
 const char    *bloom_strerror(const bloom_error_t);
+bool           bloom_backend_parse(const char *, bloom_backend_t *);
+bool           bloom_hash_parse(const char *, bloom_hash_t *);
 bloom_error_t  bloom_save(const bloomfilter *, const char *);
-bloom_error_t  bloom_load(bloomfilter *, const char *);
+bloom_error_t  bloom_load(bloomfilter *, const char *, const char *);
+bloom_error_t  bloom_map(bloomfilter *, const char *, const char *);
+bloom_error_t  bloom_set_target(bloomfilter *, const char *);
+bloom_error_t  bloom_target_record(bloom_target *, const char *);
+bloom_error_t  bloom_target_check(const bloom_target *, const char *);
 bool           bloom_populate_from_file(bloomfilter *, const char *);
+bool           bloom_populate_from_offset(bloomfilter *, const char *, const off_t);
 bool           bloom_stack(bloomfilter *);
+bool           bloom_build_static(bloomfilter *, const uint64_t (*)[BLOOM_HASH_WORDS], const size_t);
 bool           bloom_lookup_or_add(bloomfilter *, const void *, const size_t);
 bool           bloom_lookup_or_add_string(bloomfilter *, const char *);
+size_t         bloom_lookup_or_add_batch(bloomfilter *, const void *const *, const size_t *, const size_t, bool *);
+void           bloom_hash(const bloomfilter *, const void *, const size_t, uint64_t *);
+void           bloom_hash_batch(const bloomfilter *, const void *const *, const size_t *, const size_t, uint64_t (*)[BLOOM_HASH_WORDS]);
+size_t         bloom_contains_batch(const bloomfilter *, const void *const *, const size_t *, const size_t, bool *);
+bool           bloom_compatible(const bloomfilter *, const bloomfilter *, const bloom_combine_t);
+bloom_error_t  bloom_combine(bloomfilter *, const bloomfilter *, const bloom_combine_t);
+size_t         bloom_add_hashed(bloomfilter *, const uint64_t (*)[BLOOM_HASH_WORDS], const size_t);
+void           bloom_prefetch(const bloomfilter *, const uint64_t *);
+bool           bloom_lookup_or_set_hashed(bloomfilter *, const uint64_t *);
+void           bloom_count_inserts(bloomfilter *, const size_t);
+size_t         bloom_capacity(const bloomfilter *);
+size_t         bloom_distinct(const bloomfilter *);
+double         bloom_stack_fill(const bloomfilter *, const size_t);
+double         bloom_stack_estimate(const bloomfilter *, const size_t);
+double         bloom_estimate(const bloomfilter *);
+double         bloom_fpr(const bloomfilter *);
+double         bloom_union_fpr(const bloomfilter *, const bloomfilter *);
+bloom_error_t  bloom_cached_distinct(const char *, size_t *, uint64_t *);
 
 #endif /* BLOOM_H */
@@ -0,0 +1,182 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "cuckoo.h"
+
+#define LANES  0x0001000100010001ULL
+#define HIGHS  0x8000800080008000ULL
+
+// buckets are grouped so a stack stays cache line aligned
+#define CUCKOO_ALIGN_BUCKETS (BLOOM_BLOCK_BITS / 64)
+
+static inline uint64_t mulhi(const uint64_t a, const uint64_t b) {
+	return ((__uint128_t)a * b) >> 64;
+}
+
+static inline uint64_t *buckets(const uint8_t *bitmap, const bloom_segment *seg) {
+	return (uint64_t *)(bitmap + seg->offset / 8);
+}
+
+static inline uint64_t bucket_count(const bloom_segment *seg) {
+	return seg->size / 64;
+}
+
+// slot value 0 marks an empty slot, so fingerprints are never 0
+static inline uint16_t fingerprint(const uint64_t *hash) {
+	uint16_t fp = hash[1] >> 48;
+
+	return fp ? fp : 1;
+}
+
+// The two buckets of a key add up to a value derived from its fingerprint
+// alone, so either one can be found from the other and the fingerprint
+// while the number of buckets need not be a power of two.
+static inline uint64_t alternate(const bloom_segment *seg, const uint64_t bucket, const uint16_t fp) {
+	uint64_t n = bucket_count(seg);
+	uint64_t sum = mulhi(fp * 0xc6a4a7935bd1e995ULL, n);
+
+	return sum >= bucket ? sum - bucket : sum + n - bucket;
+}
+
+static inline uint64_t first_bucket(const bloom_segment *seg, const uint64_t *hash) {
+	return mulhi(hash[0], bucket_count(seg));
+}
+
+// true if any 16-bit lane of word is zero
+static inline bool has_zero_lane(const uint64_t word) {
+	return ((word - LANES) & ~word & HIGHS) != 0;
+}
+
+static inline bool bucket_holds(const uint64_t word, const uint16_t fp) {
+	return has_zero_lane(word ^ (fp * LANES));
+}
+
+static inline int empty_slot(const uint64_t word) {
+	for (int slot = 0; slot < CUCKOO_SLOTS; slot++) {
+		if (((word >> (slot * 16)) & 0xffff) == 0) {
+			return slot;
+		}
+	}
+
+	return -1;
+}
+
+static inline uint16_t slot_get(const uint64_t word, const int slot) {
+	return word >> (slot * 16);
+}
+
+static inline uint64_t slot_set(const uint64_t word, const int slot, const uint16_t fp) {
+	return (word & ~(0xffffULL << (slot * 16))) | ((uint64_t)fp << (slot * 16));
+}
+
+// Size a stack for expected keys. hashcount holds the fingerprint width.
+bool cuckoo_geometry(bloom_segment *seg, const size_t expected) {
+	uint64_t n = expected / (CUCKOO_SLOTS * CUCKOO_LOAD) + 1;
+
+	n = (n + CUCKOO_ALIGN_BUCKETS - 1) / CUCKOO_ALIGN_BUCKETS * CUCKOO_ALIGN_BUCKETS;
+
+	seg->size      = n * 64;
+	seg->hashcount = CUCKOO_FINGERPRINT_BITS;
+	seg->expected  = n * CUCKOO_SLOTS * CUCKOO_LOAD;
+	seg->seed      = 0;
+	seg->span      = 0;
+
+	return seg->expected > 0;
+}
+
+bool cuckoo_valid(const bloom_segment *seg) {
+	return seg->hashcount == CUCKOO_FINGERPRINT_BITS &&
+		seg->offset % BLOOM_BLOCK_BITS == 0 &&
+		seg->size % BLOOM_BLOCK_BITS == 0 &&
+		seg->expected <= bucket_count(seg) * CUCKOO_SLOTS;
+}
+
+bool cuckoo_contains(const uint8_t *bitmap, const bloom_segment *seg, const uint64_t *hash) {
+	const uint64_t *b = buckets(bitmap, seg);
+	uint16_t        fp = fingerprint(hash);
+	uint64_t        i1 = first_bucket(seg, hash);
+
+	return bucket_holds(b[i1], fp) || bucket_holds(b[alternate(seg, i1, fp)], fp);
+}
+
+// share of the slots holding a fingerprint
+double cuckoo_fill(const uint8_t *bitmap, const bloom_segment *seg) {
+	const uint64_t *b = buckets(bitmap, seg);
+	uint64_t        n = bucket_count(seg);
+	uint64_t        used = 0;
+
+	for (uint64_t i = 0; i < n; i++) {
+		for (int slot = 0; slot < CUCKOO_SLOTS; slot++) {
+			used += slot_get(b[i], slot) != 0;
+		}
+	}
+
+	return n ? (double)used / (n * CUCKOO_SLOTS) : 0.0;
+}
+
+void cuckoo_prefetch(const uint8_t *bitmap, const bloom_segment *seg, const uint64_t *hash) {
+	const uint64_t *b = buckets(bitmap, seg);
+	uint64_t        i1 = first_bucket(seg, hash);
+
+	__builtin_prefetch(&b[i1], 1);
+	__builtin_prefetch(&b[alternate(seg, i1, fingerprint(hash))], 1);
+}
+
+// Insert a key that is not in the stack yet. When both its buckets are
+// full, fingerprints are kicked to their other bucket up to
+// CUCKOO_MAX_KICKS times. If that does not free a slot every kick is undone
+// and false is returned: the stack is full and the caller stacks again.
+// Not thread safe.
+bool cuckoo_insert(uint8_t *bitmap, const bloom_segment *seg, const uint64_t *hash) {
+	uint64_t *b = buckets(bitmap, seg);
+	uint16_t  fp = fingerprint(hash);
+	uint64_t  i = first_bucket(seg, hash);
+	uint64_t  path[CUCKOO_MAX_KICKS];
+	uint8_t   slots[CUCKOO_MAX_KICKS];
+	uint64_t  x = hash[0] ^ hash[1];
+	int       slot;
+
+	for (int tries = 0; tries < 2; tries++) {
+		slot = empty_slot(b[i]);
+		if (slot >= 0) {
+			b[i] = slot_set(b[i], slot, fp);
+			return true;
+		}
+		i = alternate(seg, i, fp);
+	}
+
+	for (int kick = 0; kick < CUCKOO_MAX_KICKS; kick++) {
+		uint16_t victim;
+
+		// xorshift picks which fingerprint to kick
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		slot = x % CUCKOO_SLOTS;
+
+		victim = slot_get(b[i], slot);
+		b[i] = slot_set(b[i], slot, fp);
+		path[kick] = i;
+		slots[kick] = slot;
+
+		fp = victim;
+		i = alternate(seg, i, fp);
+
+		slot = empty_slot(b[i]);
+		if (slot >= 0) {
+			b[i] = slot_set(b[i], slot, fp);
+			return true;
+		}
+	}
+
+	// put every kicked fingerprint back where it was
+	for (int kick = CUCKOO_MAX_KICKS - 1; kick >= 0; kick--) {
+		uint16_t displaced = slot_get(b[path[kick]], slots[kick]);
+
+		b[path[kick]] = slot_set(b[path[kick]], slots[kick], fp);
+		fp = displaced;
+	}
+
+	return false;
+}
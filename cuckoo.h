@@ -0,0 +1,26 @@
+#ifndef CUCKOO_H
+#define CUCKOO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bloom.h"
+
+// A cuckoo filter stack. Each key keeps a 16-bit fingerprint in one of two
+// buckets of four slots, and a bucket is a single 64-bit word, so a lookup
+// reads at most two words. Buckets are filled to about 95%, for a false
+// positive rate of about 1.2e-4 at 16.8 bits per key.
+#define CUCKOO_SLOTS             4
+#define CUCKOO_FINGERPRINT_BITS  16
+#define CUCKOO_LOAD              0.95
+#define CUCKOO_MAX_KICKS         500
+
+bool    cuckoo_geometry(bloom_segment *, const size_t);
+bool    cuckoo_valid(const bloom_segment *);
+bool    cuckoo_contains(const uint8_t *, const bloom_segment *, const uint64_t *);
+bool    cuckoo_insert(uint8_t *, const bloom_segment *, const uint64_t *);
+double  cuckoo_fill(const uint8_t *, const bloom_segment *);
+void    cuckoo_prefetch(const uint8_t *, const bloom_segment *, const uint64_t *);
+
+#endif /* CUCKOO_H */
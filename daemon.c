@@ -0,0 +1,604 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+#include "reader.h"
+#include "parallel.h"
+
+// lines read from a client per batch
+#define DAEMON_BATCH   1024
+#define DAEMON_BACKLOG 64
+
+typedef struct {
+	const daemon_config  *cfg;
+	daemon_target        *targets;   // only ever prepended to until shutdown
+	pthread_mutex_t       lock;
+	pthread_cond_t        changed;   // a client finished, or the server stops
+	size_t                active;    // clients being served
+	bool                  stopping;
+} server;
+
+typedef struct {
+	server  *srv;
+	int      fd;
+} client;
+
+static volatile sig_atomic_t stop_requested;
+
+static void on_stop(int sig) {
+	(void)sig;
+	stop_requested = 1;
+}
+
+static bool read_full(const int fd, void *buf, size_t len) {
+	uint8_t *p = buf;
+
+	while (len > 0) {
+		ssize_t got = read(fd, p, len);
+
+		if (got == -1 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			return false;
+		}
+		p += got;
+		len -= got;
+	}
+
+	return true;
+}
+
+static bool write_full(const int fd, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+
+	while (len > 0) {
+		ssize_t put = send(fd, p, len, MSG_NOSIGNAL);
+
+		if (put == -1 && errno == EINTR) {
+			continue;
+		}
+		if (put <= 0) {
+			return false;
+		}
+		p += put;
+		len -= put;
+	}
+
+	return true;
+}
+
+static bool set_un_path(struct sockaddr_un *addr, const char *path) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		return false;
+	}
+
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+// Build the filter of a target from the whole file.
+static bool target_build(const daemon_config *cfg, daemon_target *t) {
+	size_t expected = cfg->expected(t->path, t->cache_path, cfg->initial_size);
+
+	if (bloom_init(&t->bf, expected, 0.0001f, cfg->max_stacks, cfg->layout, cfg->backend, cfg->hash) != BF_SUCCESS) {
+		return false;
+	}
+
+	if (!parallel_populate(&t->bf, t->path, cfg->jobs) || bloom_set_target(&t->bf, t->path) != BF_SUCCESS) {
+		bloom_destroy(&t->bf);
+		return false;
+	}
+
+	t->dirty = true;
+	return true;
+}
+
+// Open the target file and its cached filter, catching the filter up with
+// lines appended since it was saved, or build it from scratch.
+static bloom_error_t target_open(const daemon_config *cfg, daemon_target *t) {
+	char          sidecar_path[PATH_MAX + 4];
+	bloom_error_t error;
+
+	if (cfg->cache_path(t->path, t->cache_path, sizeof(t->cache_path)) != 0) {
+		return BF_FOPEN;
+	}
+
+	if (!writer_open(&t->out, t->path, &cfg->durability)) {
+		return BF_FOPEN;
+	}
+
+	// new keys are not fingerprinted here, so a sidecar would go stale
+	snprintf(sidecar_path, sizeof(sidecar_path), "%s.fp", t->cache_path);
+	unlink(sidecar_path);
+
+	error = cfg->map ?
+		bloom_map(&t->bf, t->cache_path, t->path) :
+		bloom_load(&t->bf, t->cache_path, t->path);
+
+	if (error == BF_GROWN) {
+		if (bloom_populate_from_offset(&t->bf, t->path, t->bf.target_size) &&
+			bloom_set_target(&t->bf, t->path) == BF_SUCCESS) {
+			t->dirty = true;
+			error = BF_SUCCESS;
+		} else {
+			bloom_destroy(&t->bf);
+		}
+	}
+
+	if (error != BF_SUCCESS) {
+		if (cfg->verbose && error != BF_FOPEN) {
+			fprintf(stderr, "%s: failed to load cached filter (%s), rebuilding\n", t->path, bloom_strerror(error));
+		}
+
+		if (!target_build(cfg, t)) {
+			writer_close(&t->out);
+			return BF_OUTOFMEMORY;
+		}
+	}
+
+	t->open = true;
+	return BF_SUCCESS;
+}
+
+// The target file may have been written by something other than the
+// server since the last request. Catch up with appended lines, or start
+// over if it was rewritten.
+static bloom_error_t target_sync(const daemon_config *cfg, daemon_target *t) {
+	bloom_target state = {
+		.ino       = t->bf.ino,
+		.dev       = t->bf.dev,
+		.mtime     = t->bf.mtime,
+		.size      = t->bf.target_size,
+		.tail_hash = t->bf.tail_hash
+	};
+
+	switch (bloom_target_check(&state, t->path)) {
+	case BF_SUCCESS:
+		return BF_SUCCESS;
+	case BF_GROWN:
+		if (bloom_populate_from_offset(&t->bf, t->path, t->bf.target_size) &&
+			bloom_set_target(&t->bf, t->path) == BF_SUCCESS) {
+			t->dirty = true;
+			return BF_SUCCESS;
+		}
+		break;
+	default:
+		break;
+	}
+
+	if (cfg->verbose) {
+		fprintf(stderr, "%s: changed outside the server, rebuilding filter\n", t->path);
+	}
+
+	// a replaced file must be appended to under its new inode
+	writer_close(&t->out);
+	bloom_destroy(&t->bf);
+	if (!writer_open(&t->out, t->path, &cfg->durability)) {
+		t->open = false;
+		return BF_FOPEN;
+	}
+
+	if (!target_build(cfg, t)) {
+		writer_close(&t->out);
+		t->open = false;
+		return BF_OUTOFMEMORY;
+	}
+
+	return BF_SUCCESS;
+}
+
+// Replace a filter that outgrew its stacks by a larger one.
+static bool target_rebuild(const daemon_config *cfg, daemon_target *t) {
+	bloomfilter fresh;
+	size_t      distinct = bloom_distinct(&t->bf);
+	size_t      expected = bloom_capacity(&t->bf);
+
+	expected = (distinct > expected ? distinct : expected) * 2;
+
+	if (bloom_init(&fresh, expected, t->bf.accuracy, cfg->max_stacks, t->bf.layout, t->bf.backend, t->bf.hash) != BF_SUCCESS) {
+		return false;
+	}
+
+	// lines written so far must be in the file to be part of the new filter
+	writer_flush(&t->out);
+	if (!parallel_populate(&fresh, t->path, cfg->jobs)) {
+		bloom_destroy(&fresh);
+		return false;
+	}
+
+	bloom_destroy(&t->bf);
+	t->bf = fresh;
+	return true;
+}
+
+// find the target of a path, adding it if the server has not seen it
+static daemon_target *target_get(server *srv, const char *path) {
+	daemon_target *t;
+
+	pthread_mutex_lock(&srv->lock);
+	for (t = srv->targets; t != NULL; t = t->next) {
+		if (strcmp(t->path, path) == 0) {
+			break;
+		}
+	}
+
+	if (t == NULL && (t = calloc(1, sizeof(daemon_target))) != NULL) {
+		snprintf(t->path, sizeof(t->path), "%s", path);
+		pthread_mutex_init(&t->lock, NULL);
+		t->next = srv->targets;
+		srv->targets = t;
+	}
+	pthread_mutex_unlock(&srv->lock);
+
+	return t;
+}
+
+// Deduplicate the lines of one client against its target. The target
+// stays locked for the whole stream, so clients of one file take turns
+// and its lines are never interleaved.
+static bloom_error_t serve_lines(server *srv, const int fd, daemon_target *t, daemon_reply *reply) {
+	const daemon_config *cfg = srv->cfg;
+	const char          *lines[DAEMON_BATCH];
+	size_t               lens[DAEMON_BATCH];
+	bool                 seen[DAEMON_BATCH];
+	reader               input;
+	bloom_error_t        error;
+	size_t               n;
+
+	error = t->open ? target_sync(cfg, t) : target_open(cfg, t);
+	if (error != BF_SUCCESS) {
+		return error;
+	}
+
+	if (!reader_init_fd(&input, fd)) {
+		return BF_OUTOFMEMORY;
+	}
+
+	while ((n = reader_read_lines(&input, lines, lens, DAEMON_BATCH)) > 0) {
+		reply->lines += n;
+		reply->added += bloom_lookup_or_add_batch(&t->bf, (const void *const *)lines, lens, n, seen);
+
+		for (size_t i = 0; i < n; i++) {
+			if (!seen[i]) {
+				writer_add(&t->out, lines[i], lens[i]);
+			}
+		}
+
+		if (t->bf.needs_rebuild && !target_rebuild(cfg, t)) {
+			error = BF_OUTOFMEMORY;
+			break;
+		}
+	}
+	reader_close(&input);
+
+	// the reply promises the lines are in the file
+	if (!writer_flush(&t->out) || !writer_tick(&t->out)) {
+		error = BF_FWRITE;
+	}
+
+	if (reply->added > 0) {
+		bloom_set_target(&t->bf, t->path);
+		t->dirty = true;
+	}
+
+	return error;
+}
+
+static void *serve_client(void *arg) {
+	client          *c = arg;
+	server          *srv = c->srv;
+	daemon_request   req;
+	daemon_reply     reply = {0};
+	char             path[PATH_MAX] = "";
+	daemon_target   *t;
+	bloom_error_t    error = BF_INVALIDFILE;
+
+	if (read_full(c->fd, &req, sizeof(req)) &&
+		memcmp(req.magic, DAEMON_MAGIC, sizeof(req.magic)) == 0 &&
+		req.version == DAEMON_VERSION &&
+		req.path_len > 0 && req.path_len < sizeof(path) &&
+		read_full(c->fd, path, req.path_len)) {
+		path[req.path_len] = '\0';
+
+		// the server does not share the client's working directory
+		if (path[0] == '/' && memchr(path, '\0', req.path_len) == NULL &&
+			(t = target_get(srv, path)) != NULL) {
+			pthread_mutex_lock(&t->lock);
+			error = serve_lines(srv, c->fd, t, &reply);
+			pthread_mutex_unlock(&t->lock);
+		}
+	}
+
+	if (srv->cfg->verbose) {
+		fprintf(stderr, "%s: %llu lines, %llu new (%s)\n", path[0] ? path : "bad request",
+				(unsigned long long)reply.lines, (unsigned long long)reply.added, bloom_strerror(error));
+	}
+
+	reply.status = error;
+	write_full(c->fd, &reply, sizeof(reply));
+	close(c->fd);
+	free(c);
+
+	pthread_mutex_lock(&srv->lock);
+	srv->active--;
+	pthread_cond_broadcast(&srv->changed);
+	pthread_mutex_unlock(&srv->lock);
+
+	return NULL;
+}
+
+// Save every filter that changed since the last checkpoint, after the
+// lines it covers are on disk.
+static void checkpoint(server *srv) {
+	daemon_target *t;
+
+	pthread_mutex_lock(&srv->lock);
+	t = srv->targets;
+	pthread_mutex_unlock(&srv->lock);
+
+	for (; t != NULL; t = t->next) {
+		pthread_mutex_lock(&t->lock);
+		if (t->open && t->dirty) {
+			bool          synced = (t->out.policy.sync == WRITER_SYNC_NONE) ?
+				writer_flush(&t->out) : writer_sync(&t->out);
+			bloom_error_t error = synced ? bloom_save(&t->bf, t->cache_path) : BF_FWRITE;
+
+			if (error != BF_SUCCESS) {
+				fprintf(stderr, "Failed to save cache filter to %s: %s\n", t->cache_path, bloom_strerror(error));
+			} else {
+				t->dirty = false;
+				if (srv->cfg->verbose) {
+					fprintf(stderr, "Saved Bloom filter cache: %s\n", t->cache_path);
+				}
+			}
+		}
+		pthread_mutex_unlock(&t->lock);
+	}
+}
+
+static void *checkpoint_thread(void *arg) {
+	server          *srv = arg;
+	struct timespec  deadline;
+
+	pthread_mutex_lock(&srv->lock);
+	while (!srv->stopping) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += srv->cfg->checkpoint;
+
+		while (!srv->stopping &&
+			pthread_cond_timedwait(&srv->changed, &srv->lock, &deadline) != ETIMEDOUT) {
+			// woken by a finished client. keep waiting out the interval
+		}
+
+		if (!srv->stopping) {
+			pthread_mutex_unlock(&srv->lock);
+			checkpoint(srv);
+			pthread_mutex_lock(&srv->lock);
+		}
+	}
+	pthread_mutex_unlock(&srv->lock);
+
+	return NULL;
+}
+
+// Bind the server socket, replacing one left behind by a server that is
+// no longer running.
+static int listen_on(const char *path) {
+	struct sockaddr_un addr;
+	int                fd;
+
+	if (!set_un_path(&addr, path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+
+	if (daemon_connect(path, &fd)) {
+		fprintf(stderr, "A server is already listening on %s\n", path);
+		close(fd);
+		return -1;
+	}
+	unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, DAEMON_BACKLOG) == -1) {
+		perror("bind");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+// Serve clients on the socket at path until SIGINT or SIGTERM, then save
+// every changed filter.
+int daemon_serve(const char *path, const daemon_config *cfg) {
+	server            srv = {.cfg = cfg};
+	struct sigaction  sa = {0};
+	sigset_t          block, old;
+	pthread_t         saver;
+	pthread_attr_t    attr;
+	int               fd;
+
+	fd = listen_on(path);
+	if (fd == -1) {
+		return EXIT_FAILURE;
+	}
+
+	// no SA_RESTART, so the signal cuts the wait for a client short
+	sa.sa_handler = on_stop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	pthread_mutex_init(&srv.lock, NULL);
+	pthread_cond_init(&srv.changed, NULL);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	// only this thread takes the signals
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	if (pthread_create(&saver, NULL, checkpoint_thread, &srv) != 0) {
+		perror("pthread_create");
+		close(fd);
+		unlink(path);
+		return EXIT_FAILURE;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (cfg->verbose) {
+		fprintf(stderr, "Listening on %s\n", path);
+	}
+
+	while (!stop_requested) {
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		client       *c;
+		pthread_t     thread;
+		int           conn;
+
+		// wake up now and then in case the signal came just before the wait
+		if (poll(&pfd, 1, 1000) <= 0) {
+			continue;
+		}
+
+		conn = accept(fd, NULL, NULL);
+		if (conn == -1) {
+			continue;
+		}
+
+		c = malloc(sizeof(client));
+		if (c == NULL) {
+			close(conn);
+			continue;
+		}
+		c->srv = &srv;
+		c->fd  = conn;
+
+		pthread_mutex_lock(&srv.lock);
+		srv.active++;
+		pthread_mutex_unlock(&srv.lock);
+
+		pthread_sigmask(SIG_BLOCK, &block, &old);
+		if (pthread_create(&thread, &attr, serve_client, c) != 0) {
+			close(conn);
+			free(c);
+			pthread_mutex_lock(&srv.lock);
+			srv.active--;
+			pthread_mutex_unlock(&srv.lock);
+		}
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+	}
+
+	close(fd);
+	unlink(path);
+
+	if (cfg->verbose) {
+		fprintf(stderr, "Stopping: waiting for clients and saving filters\n");
+	}
+
+	pthread_mutex_lock(&srv.lock);
+	while (srv.active > 0) {
+		pthread_cond_wait(&srv.changed, &srv.lock);
+	}
+	srv.stopping = true;
+	pthread_cond_broadcast(&srv.changed);
+	pthread_mutex_unlock(&srv.lock);
+	pthread_join(saver, NULL);
+
+	checkpoint(&srv);
+
+	while (srv.targets != NULL) {
+		daemon_target *t = srv.targets;
+
+		srv.targets = t->next;
+		if (t->open) {
+			writer_close(&t->out);
+			bloom_destroy(&t->bf);
+		}
+		pthread_mutex_destroy(&t->lock);
+		free(t);
+	}
+
+	pthread_attr_destroy(&attr);
+	pthread_cond_destroy(&srv.changed);
+	pthread_mutex_destroy(&srv.lock);
+
+	return EXIT_SUCCESS;
+}
+
+bool daemon_connect(const char *path, int *fd) {
+	struct sockaddr_un addr;
+
+	if (!set_un_path(&addr, path)) {
+		return false;
+	}
+
+	*fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (*fd == -1) {
+		return false;
+	}
+
+	if (connect(*fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(*fd);
+		return false;
+	}
+
+	return true;
+}
+
+// Send the lines of in for target over a connected socket and wait for the
+// server to have appended the new ones.
+bloom_error_t daemon_send(const int fd, const char *target, const int in, daemon_reply *reply) {
+	daemon_request  req = {.version = DAEMON_VERSION, .path_len = strlen(target)};
+	char            buf[64 * 1024];
+	ssize_t         got;
+
+	memcpy(req.magic, DAEMON_MAGIC, sizeof(req.magic));
+	if (!write_full(fd, &req, sizeof(req)) || !write_full(fd, target, req.path_len)) {
+		return BF_FWRITE;
+	}
+
+	for (;;) {
+		got = read(in, buf, sizeof(buf));
+		if (got == -1 && errno == EINTR) {
+			continue;
+		}
+		if (got == -1) {
+			return BF_FREAD;
+		}
+		if (got == 0) {
+			break;
+		}
+		if (!write_full(fd, buf, got)) {
+			return BF_FWRITE;
+		}
+	}
+
+	if (shutdown(fd, SHUT_WR) == -1 || !read_full(fd, reply, sizeof(*reply))) {
+		return BF_FREAD;
+	}
+
+	return reply->status < BF_ERRORCOUNT ? (bloom_error_t)reply->status : BF_INVALIDFILE;
+}
@@ -0,0 +1,72 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "bloom.h"
+#include "writer.h"
+
+// A resident server keeps the filters of many target files in memory and
+// deduplicates line streams sent to it over a Unix domain socket. A client
+// sends a request header and the absolute path of its target file, then
+// its lines until it shuts down its end of the socket. The server appends
+// the new lines to the target file and answers with a daemon_reply once
+// they have been written. Changed filters are saved every checkpoint
+// seconds and when the server stops, each after the lines it covers were
+// synced.
+#define DAEMON_MAGIC       "!bloomd!"
+#define DAEMON_VERSION     1
+#define DAEMON_SOCKET      "sock"
+#define DAEMON_CHECKPOINT  30
+
+typedef struct {
+	uint8_t   magic[8];
+	uint32_t  version;
+	uint32_t  path_len;
+} daemon_request;
+
+typedef struct {
+	uint32_t  status;     // bloom_error_t
+	uint32_t  reserved;
+	uint64_t  lines;
+	uint64_t  added;
+} daemon_reply;
+
+// Filters are set up like those of a single run, so the server borrows
+// how new.c names cache files and sizes filters.
+typedef struct {
+	size_t           initial_size;
+	size_t           max_stacks;
+	bloom_layout_t   layout;
+	bloom_backend_t  backend;
+	bloom_hash_t     hash;
+	bool             map;         // map cache files instead of reading them
+	size_t           jobs;        // threads to populate filters with
+	unsigned         checkpoint;  // seconds between saves of changed filters
+	writer_policy    durability;  // when appended lines are synced
+	bool             verbose;
+	int            (*cache_path)(const char *, char *, size_t);
+	size_t         (*expected)(const char *, const char *, const size_t);
+} daemon_config;
+
+// one target file and its filter
+typedef struct daemon_target {
+	char                   path[PATH_MAX];
+	char                   cache_path[PATH_MAX];
+	bloomfilter            bf;
+	writer                 out;
+	bool                   open;
+	bool                   dirty;      // changed since the last checkpoint
+	pthread_mutex_t        lock;
+	struct daemon_target  *next;
+} daemon_target;
+
+int            daemon_serve(const char *, const daemon_config *);
+bool           daemon_connect(const char *, int *);
+bloom_error_t  daemon_send(const int, const char *, const int, daemon_reply *);
+
+#endif /* DAEMON_H */
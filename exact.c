@@ -0,0 +1,428 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "mmh3.h"
+#include "exact.h"
+#include "reader.h"
+
+// keys hashed and prefetched at a time by exact_lookup_or_add_batch
+#define EXACT_BATCH 16
+
+// lines read from the target file per batch while populating
+#define EXACT_POPULATE_BATCH 1024
+
+static bool table_alloc(exact_table *t, const size_t capacity) {
+	void *ctrl;
+	void *slots;
+
+	// groups are loaded with aligned SIMD loads
+	if (posix_memalign(&ctrl, 64, capacity) != 0) {
+		return false;
+	}
+
+	if (posix_memalign(&slots, 64, capacity * sizeof(*t->slots)) != 0) {
+		free(ctrl);
+		return false;
+	}
+
+	t->ctrl     = ctrl;
+	t->slots    = slots;
+	t->capacity = capacity;
+
+	return true;
+}
+
+static void table_free(exact_table *t) {
+	free(t->ctrl);
+	free(t->slots);
+	t->ctrl     = NULL;
+	t->slots    = NULL;
+	t->capacity = 0;
+}
+
+// slots needed to hold expected keys below the load limit
+static size_t table_capacity(const size_t expected) {
+	size_t capacity = EXACT_MIN_CAPACITY;
+
+	while (capacity / EXACT_LOAD_DEN * EXACT_LOAD_NUM < expected) {
+		capacity *= 2;
+	}
+
+	return capacity;
+}
+
+static inline uint8_t key_tag(const uint64_t *hash) {
+	return hash[1] >> 57;
+}
+
+// bit i is set if control byte i of the group matches tag
+static inline uint32_t group_match(const uint8_t *ctrl, const uint8_t tag) {
+#ifdef __SSE2__
+	__m128i group = _mm_load_si128((const __m128i *)ctrl);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+#else
+	uint32_t mask = 0;
+
+	for (size_t i = 0; i < EXACT_GROUP; i++) {
+		mask |= (uint32_t)(ctrl[i] == tag) << i;
+	}
+
+	return mask;
+#endif
+}
+
+// bit i is set if slot i of the group is empty
+static inline uint32_t group_empty(const uint8_t *ctrl) {
+#ifdef __SSE2__
+	return _mm_movemask_epi8(_mm_load_si128((const __m128i *)ctrl));
+#else
+	return group_match(ctrl, EXACT_EMPTY);
+#endif
+}
+
+// groups are probed triangularly, which visits every group of a power of
+// two table. the load limit guarantees an empty slot ends every probe.
+static inline size_t first_group(const exact_table *t, const uint64_t *hash) {
+	return hash[0] & (t->capacity / EXACT_GROUP - 1);
+}
+
+static inline size_t next_group(const exact_table *t, const size_t group, const size_t step) {
+	return (group + step) & (t->capacity / EXACT_GROUP - 1);
+}
+
+static inline bool slot_matches(const exact_table *t, const size_t slot, const uint64_t *hash) {
+	return t->slots[slot][0] == hash[0] && t->slots[slot][1] == hash[1];
+}
+
+static bool table_find(const exact_table *t, const uint64_t *hash) {
+	uint8_t tag = key_tag(hash);
+	size_t  group = first_group(t, hash);
+
+	for (size_t step = 1;; step++) {
+		const uint8_t *ctrl = t->ctrl + group * EXACT_GROUP;
+		uint32_t       match = group_match(ctrl, tag);
+
+		while (match) {
+			if (slot_matches(t, group * EXACT_GROUP + __builtin_ctz(match), hash)) {
+				return true;
+			}
+			match &= match - 1;
+		}
+
+		if (group_empty(ctrl)) {
+			return false;
+		}
+
+		group = next_group(t, group, step);
+	}
+}
+
+// Find a key, or insert it into the first empty slot on its probe path.
+// There are no deletions, so that is where a search for it would stop.
+static bool table_find_or_insert(exact_table *t, const uint64_t *hash) {
+	uint8_t tag = key_tag(hash);
+	size_t  group = first_group(t, hash);
+
+	for (size_t step = 1;; step++) {
+		uint8_t  *ctrl = t->ctrl + group * EXACT_GROUP;
+		uint32_t  match = group_match(ctrl, tag);
+		uint32_t  empty;
+
+		while (match) {
+			if (slot_matches(t, group * EXACT_GROUP + __builtin_ctz(match), hash)) {
+				return true;
+			}
+			match &= match - 1;
+		}
+
+		empty = group_empty(ctrl);
+		if (empty) {
+			size_t slot = __builtin_ctz(empty);
+
+			ctrl[slot] = tag;
+			memcpy(t->slots[group * EXACT_GROUP + slot], hash, sizeof(*t->slots));
+			return false;
+		}
+
+		group = next_group(t, group, step);
+	}
+}
+
+// move groups of the old table into the new one. keys in old were never
+// inserted into the new table, so they can go straight to an empty slot.
+static void migrate(exact *ex, size_t groups) {
+	size_t total = ex->old.capacity / EXACT_GROUP;
+
+	for (; groups > 0 && ex->migrated < total; groups--, ex->migrated++) {
+		const uint8_t *ctrl = ex->old.ctrl + ex->migrated * EXACT_GROUP;
+		uint32_t       full = ~group_empty(ctrl) & 0xffff;
+
+		while (full) {
+			table_find_or_insert(&ex->table, ex->old.slots[ex->migrated * EXACT_GROUP + __builtin_ctz(full)]);
+			full &= full - 1;
+		}
+	}
+
+	if (ex->migrated == total) {
+		table_free(&ex->old);
+		ex->migrated = 0;
+	}
+}
+
+// start moving into a table twice the size. a resize still in progress is
+// finished first, though EXACT_MIGRATE makes sure that never happens.
+static bool grow(exact *ex) {
+	exact_table bigger;
+
+	if (ex->old.capacity) {
+		migrate(ex, SIZE_MAX);
+	}
+
+	if (!table_alloc(&bigger, ex->table.capacity * 2)) {
+		return false;
+	}
+
+	memset(bigger.ctrl, EXACT_EMPTY, bigger.capacity);
+	ex->old      = ex->table;
+	ex->table    = bigger;
+	ex->migrated = 0;
+
+	return true;
+}
+
+bloom_error_t exact_init(exact *ex, const size_t expected) {
+	memset(ex, 0, sizeof(exact));
+
+	if (!table_alloc(&ex->table, table_capacity(expected))) {
+		return BF_OUTOFMEMORY;
+	}
+
+	memset(ex->table.ctrl, EXACT_EMPTY, ex->table.capacity);
+
+	return BF_SUCCESS;
+}
+
+void exact_destroy(exact *ex) {
+	table_free(&ex->table);
+	table_free(&ex->old);
+}
+
+static bool lookup_or_add_hashed(exact *ex, const uint64_t *hash) {
+	if (ex->old.capacity) {
+		if (table_find(&ex->old, hash)) {
+			return true;
+		}
+		migrate(ex, EXACT_MIGRATE);
+	}
+
+	if (ex->count + EXACT_GROUP >= ex->table.capacity) {
+		// the table could not grow and is nearly full. keys are still
+		// reported as new rather than ever dropping one.
+		return table_find(&ex->table, hash);
+	}
+
+	if (table_find_or_insert(&ex->table, hash)) {
+		return true;
+	}
+
+	ex->count++;
+	if (ex->count >= ex->table.capacity / EXACT_LOAD_DEN * EXACT_LOAD_NUM && !grow(ex)) {
+		fprintf(stderr, "Failed to grow exact table\n");
+	}
+
+	return false;
+}
+
+bool exact_lookup_or_add(exact *ex, const void *element, const size_t len) {
+	uint64_t hash[EXACT_WORDS];
+
+	mmh3_128(element, len, 0, hash);
+
+	return lookup_or_add_hashed(ex, hash);
+}
+
+// Look up or add n keys, like bloom_lookup_or_add_batch: keys are hashed
+// and their first group prefetched in small batches, then looked up in
+// order. Returns the number of new keys.
+size_t exact_lookup_or_add_batch(exact *ex, const void *const *keys, const size_t *lens, const size_t n, bool *results) {
+	uint64_t hashes[EXACT_BATCH][EXACT_WORDS];
+	size_t   added = 0;
+
+	for (size_t start = 0; start < n; start += EXACT_BATCH) {
+		size_t group = (n - start < EXACT_BATCH) ? n - start : EXACT_BATCH;
+
+		// always mmh3: every bit of the hash is part of the key here
+		mmh3_128_batch(keys + start, lens + start, group, 0, hashes);
+		for (size_t j = 0; j < group; j++) {
+			size_t first = first_group(&ex->table, hashes[j]) * EXACT_GROUP;
+
+			__builtin_prefetch(&ex->table.ctrl[first]);
+			__builtin_prefetch(&ex->table.slots[first]);
+		}
+
+		for (size_t j = 0; j < group; j++) {
+			results[start + j] = lookup_or_add_hashed(ex, hashes[j]);
+			if (!results[start + j]) {
+				added++;
+			}
+		}
+	}
+
+	return added;
+}
+
+// Add the lines of a file starting at byte offset, which must be the start
+// of a line. See bloom_populate_from_offset.
+bool exact_populate_from_offset(exact *ex, const char *filepath, const off_t offset) {
+	reader       r;
+	const char  *lines[EXACT_POPULATE_BATCH];
+	size_t       lens[EXACT_POPULATE_BATCH];
+	bool         seen[EXACT_POPULATE_BATCH];
+	size_t       n;
+	int          fd;
+
+	fd = open(filepath, O_RDONLY);
+	if (fd == -1) {
+		perror("open");
+		return false;
+	}
+
+	if (lseek(fd, offset, SEEK_SET) == -1 || !reader_init_fd(&r, fd)) {
+		close(fd);
+		return false;
+	}
+	r.owns_fd = true;
+	r.key = ex->key;
+
+	while ((n = reader_read_lines(&r, lines, lens, EXACT_POPULATE_BATCH)) > 0) {
+		exact_lookup_or_add_batch(ex, (const void *const *)lines, lens, n, seen);
+	}
+
+	reader_close(&r);
+	return true;
+}
+
+bloom_error_t exact_set_target(exact *ex, const char *target) {
+	return bloom_target_record(&ex->target, target);
+}
+
+// bytes of memory the table uses, including an old table still being moved
+size_t exact_memory(const exact *ex) {
+	return (ex->table.capacity + ex->old.capacity) * (1 + sizeof(*ex->table.slots));
+}
+
+// Save the table to path. A resize in progress is finished first, so only
+// one table is written: the header, then the control bytes, then the slots.
+bloom_error_t exact_save(exact *ex, const char *path) {
+	uint8_t     header[EXACT_HEADER_SIZE] = {0};
+	exact_file *ef = (exact_file *)header;
+	char        temp[PATH_MAX];
+	FILE       *fp;
+	bool        ok;
+
+	if (ex->old.capacity) {
+		migrate(ex, SIZE_MAX);
+	}
+
+	memcpy(ef->magic, EXACT_MAGIC, sizeof(ef->magic));
+	ef->version  = EXACT_FILE_VERSION;
+	ef->capacity = ex->table.capacity;
+	ef->count    = ex->count;
+	ef->target   = ex->target;
+
+	// written beside path and renamed over it, as in bloom_save, so a
+	// crash leaves either the old table or the whole new one
+	if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int)sizeof(temp)) {
+		return BF_FOPEN;
+	}
+
+	fp = fopen(temp, "wb");
+	if (fp == NULL) {
+		return BF_FOPEN;
+	}
+
+	ok = fwrite(header, sizeof(header), 1, fp) == 1 &&
+		fwrite(ex->table.ctrl, ex->table.capacity, 1, fp) == 1 &&
+		fwrite(ex->table.slots, sizeof(*ex->table.slots), ex->table.capacity, fp) == ex->table.capacity;
+
+	if (fclose(fp) != 0 || !ok || rename(temp, path) == -1) {
+		unlink(temp);
+		return BF_FWRITE;
+	}
+
+	return BF_SUCCESS;
+}
+
+// Load a table saved by exact_save. As with bloom_load, the table must
+// match target as it is now, and BF_GROWN means lines were appended since.
+bloom_error_t exact_load(exact *ex, const char *path, const char *target) {
+	exact_file     ef;
+	struct stat    sb;
+	bloom_error_t  error = BF_SUCCESS;
+	int            fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return BF_FOPEN;
+	}
+
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return BF_FSTAT;
+	}
+
+	if (pread(fd, &ef, sizeof(ef), 0) != sizeof(ef)) {
+		close(fd);
+		return BF_FREAD;
+	}
+
+	if (memcmp(ef.magic, EXACT_MAGIC, sizeof(ef.magic)) != 0 ||
+		ef.version != EXACT_FILE_VERSION ||
+		ef.capacity < EXACT_MIN_CAPACITY ||
+		(ef.capacity & (ef.capacity - 1)) != 0 ||
+		ef.count >= ef.capacity / EXACT_LOAD_DEN * EXACT_LOAD_NUM ||
+		EXACT_HEADER_SIZE + ef.capacity * (1 + sizeof(*ex->table.slots)) != (uint64_t)sb.st_size) {
+		close(fd);
+		return BF_INVALIDFILE;
+	}
+
+	if (target != NULL) {
+		error = bloom_target_check(&ef.target, target);
+		if (error != BF_SUCCESS && error != BF_GROWN) {
+			close(fd);
+			return error;
+		}
+	}
+
+	memset(ex, 0, sizeof(exact));
+	if (!table_alloc(&ex->table, ef.capacity)) {
+		close(fd);
+		return BF_OUTOFMEMORY;
+	}
+
+	if (pread(fd, ex->table.ctrl, ef.capacity, EXACT_HEADER_SIZE) != (ssize_t)ef.capacity ||
+		pread(fd, ex->table.slots, ef.capacity * sizeof(*ex->table.slots), EXACT_HEADER_SIZE + ef.capacity) !=
+		(ssize_t)(ef.capacity * sizeof(*ex->table.slots))) {
+		close(fd);
+		exact_destroy(ex);
+		return BF_FREAD;
+	}
+	close(fd);
+
+	ex->count  = ef.count;
+	ex->target = ef.target;
+
+	return error;
+}
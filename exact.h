@@ -0,0 +1,69 @@
+#ifndef EXACT_H
+#define EXACT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "bloom.h"
+
+// An open addressing table of 128-bit key hashes, used instead of a Bloom
+// filter when no line may ever be dropped. Slots are grouped sixteen at a
+// time behind one control byte each, holding seven bits of the hash or
+// EXACT_EMPTY, so a whole group is searched with one SIMD compare.
+#define EXACT_GROUP         16
+#define EXACT_EMPTY         0x80
+#define EXACT_WORDS         2
+#define EXACT_MIN_CAPACITY  1024
+
+// a table grows once it is 7/8 full
+#define EXACT_LOAD_NUM      7
+#define EXACT_LOAD_DEN      8
+
+// Growing does not stop the world: the old table is kept and this many of
+// its groups are moved to the new one on every insert until it is empty.
+// Lookups check both tables meanwhile.
+#define EXACT_MIGRATE       4
+
+#define EXACT_MAGIC         "!bloomex"
+#define EXACT_FILE_VERSION  1
+#define EXACT_HEADER_SIZE   4096
+
+typedef struct {
+	uint8_t   *ctrl;
+	uint64_t (*slots)[EXACT_WORDS];
+	size_t     capacity;     // slots, a power of two
+} exact_table;
+
+typedef struct {
+	exact_table   table;
+	exact_table   old;       // being moved into table. capacity 0 when not growing
+	size_t        migrated;  // groups of old already moved
+	size_t        count;     // keys in the table
+	bloom_target  target;
+	const key_spec *key;     // if set, what lines of the target file are keyed by
+} exact;
+
+typedef struct {
+	uint8_t       magic[8];
+	uint32_t      version;
+	uint32_t      reserved;
+	uint64_t      capacity;
+	uint64_t      count;
+	bloom_target  target;
+} exact_file;
+
+_Static_assert(sizeof(exact_file) <= EXACT_HEADER_SIZE, "header does not fit its page");
+
+bloom_error_t  exact_init(exact *, const size_t);
+void           exact_destroy(exact *);
+bool           exact_lookup_or_add(exact *, const void *, const size_t);
+size_t         exact_lookup_or_add_batch(exact *, const void *const *, const size_t *, const size_t, bool *);
+bool           exact_populate_from_offset(exact *, const char *, const off_t);
+bloom_error_t  exact_set_target(exact *, const char *);
+bloom_error_t  exact_save(exact *, const char *);
+bloom_error_t  exact_load(exact *, const char *, const char *);
+size_t         exact_memory(const exact *);
+
+#endif /* EXACT_H */
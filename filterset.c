@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "filterset.h"
+
+void filterset_init(filterset *set, const bloom_combine_t op) {
+	memset(set, 0, sizeof(filterset));
+	set->op = op;
+}
+
+// Whether bf is worth merging into held. An intersection tests the same
+// bits either way. A union fills its stacks with the keys of both, so it is
+// only merged while that keeps the false positive rate within the one the
+// filter was built for, or the two would have had tested apart.
+static bool worth_merging(const filterset *set, const bloomfilter *held, const bloomfilter *bf) {
+	double limit;
+
+	if (!bloom_compatible(held, bf, set->op)) {
+		return false;
+	}
+
+	if (set->op == BF_COMBINE_INTERSECTION) {
+		return true;
+	}
+
+	limit = bloom_fpr(held) + bloom_fpr(bf);
+	if (limit < held->accuracy) {
+		limit = held->accuracy;
+	}
+
+	return bloom_union_fpr(held, bf) <= limit;
+}
+
+// Take over bf, merging it into a filter already held if it can be.
+bool filterset_add(filterset *set, bloomfilter *bf) {
+	bloomfilter *grown;
+
+	for (size_t i = 0; i < set->count; i++) {
+		if (!worth_merging(set, &set->filters[i], bf)) {
+			continue;
+		}
+
+		if (bloom_combine(&set->filters[i], bf, set->op) != BF_SUCCESS) {
+			return false;
+		}
+
+		bloom_destroy(bf);
+		set->files++;
+		return true;
+	}
+
+	grown = realloc(set->filters, (set->count + 1) * sizeof(bloomfilter));
+	if (grown == NULL) {
+		return false;
+	}
+
+	set->filters = grown;
+	set->filters[set->count++] = *bf;
+	set->files++;
+
+	return true;
+}
+
+// Store in match whether each of n lines is in any filter of a union set,
+// or in every filter of an intersection set.
+bool filterset_match_batch(filterset *set, const char **lines, const size_t *lens, const size_t n, bool *match) {
+	bool all = set->op == BF_COMBINE_INTERSECTION;
+
+	if (n > set->capacity) {
+		bool *found = realloc(set->found, n * sizeof(bool));
+
+		if (found == NULL) {
+			return false;
+		}
+
+		set->found    = found;
+		set->capacity = n;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		match[i] = all;
+	}
+
+	for (size_t f = 0; f < set->count; f++) {
+		bloom_contains_batch(&set->filters[f], (const void *const *)lines, lens, n, set->found);
+		for (size_t i = 0; i < n; i++) {
+			match[i] = all ? match[i] && set->found[i] : match[i] || set->found[i];
+		}
+	}
+
+	return true;
+}
+
+void filterset_destroy(filterset *set) {
+	for (size_t i = 0; i < set->count; i++) {
+		bloom_destroy(&set->filters[i]);
+	}
+
+	free(set->filters);
+	free(set->found);
+	memset(set, 0, sizeof(filterset));
+}
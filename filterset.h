@@ -0,0 +1,30 @@
+#ifndef FILTERSET_H
+#define FILTERSET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bloom.h"
+
+// The filters of other files that lines are held against before they
+// reach the target's own. A union set matches lines in any of them, as -x
+// does to drop them; an intersection set matches lines in all of them, as
+// -i needs. Each filter added is merged into one already held when
+// bloom_combine allows, so a line is tested once per group of compatible
+// filters rather than once per file.
+typedef struct {
+	bloom_combine_t  op;
+	bloomfilter     *filters;
+	size_t           count;     // filters after merging
+	size_t           files;     // filters added
+	bool            *found;     // per line of a batch
+	size_t           capacity;  // lines found has room for
+} filterset;
+
+void    filterset_init(filterset *, const bloom_combine_t);
+bool    filterset_add(filterset *, bloomfilter *);
+bool    filterset_match_batch(filterset *, const char **, const size_t *, const size_t, bool *);
+void    filterset_destroy(filterset *);
+
+#endif /* FILTERSET_H */
@@ -0,0 +1,293 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "fuse.h"
+
+// slots are 16 bits wide
+static inline uint16_t *slots(const uint8_t *bitmap, const bloom_segment *seg) {
+	return (uint16_t *)(bitmap + seg->offset / 8);
+}
+
+static inline uint64_t mulhi(const uint64_t a, const uint64_t b) {
+	return ((__uint128_t)a * b) >> 64;
+}
+
+static inline uint64_t murmur64(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline uint64_t splitmix64(uint64_t *state) {
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static inline uint16_t fingerprint(const uint64_t h) {
+	return h ^ (h >> 32);
+}
+
+// the three slots of a key: one in each of three consecutive segments
+static inline void positions(const bloom_segment *seg, const uint64_t h, uint32_t *p) {
+	uint64_t mask = seg->hashcount - 1;
+
+	p[0] = mulhi(h, seg->span);
+	p[1] = (p[0] + seg->hashcount) ^ ((h >> 18) & mask);
+	p[2] = (p[0] + 2 * seg->hashcount) ^ (h & mask);
+}
+
+static inline uint64_t key_hash(const bloom_segment *seg, const uint64_t *hash) {
+	return murmur64(hash[0] + seg->seed);
+}
+
+// Size a stack for n keys: hashcount holds the segment length and span the
+// number of slots the first position is drawn from. Follows the reference
+// implementation's parameters for three-wise binary fuse filters.
+bool fuse_geometry(bloom_segment *seg, const size_t n) {
+	uint64_t length;
+	uint64_t capacity = 0;
+	uint64_t segments;
+	uint64_t count;
+
+	if (n == 0 || n > FUSE_MAX_KEYS) {
+		return false;
+	}
+
+	length = 1ULL << (int)floor(log((double)n) / log(3.33) + 2.25);
+	if (length > 262144) {
+		length = 262144;
+	}
+
+	if (n > 1) {
+		double factor = 0.875 + 0.25 * log(1000000.0) / log((double)n);
+
+		capacity = round(n * (factor < 1.125 ? 1.125 : factor));
+	}
+
+	segments = (capacity + length - 1) / length;
+	count = segments <= 2 ? 1 : segments - 2;
+
+	seg->hashcount = length;
+	seg->span      = count * length;
+	seg->size      = ((count + 2) * length * FUSE_FINGERPRINT_BITS + BLOOM_BLOCK_BITS - 1) /
+		BLOOM_BLOCK_BITS * BLOOM_BLOCK_BITS;
+	seg->expected  = n;
+	seg->seed      = 0;
+
+	return true;
+}
+
+bool fuse_valid(const bloom_segment *seg) {
+	bloom_segment check;
+
+	return seg->offset % BLOOM_BLOCK_BITS == 0 &&
+		fuse_geometry(&check, seg->expected) &&
+		check.size == seg->size &&
+		check.hashcount == seg->hashcount;
+}
+
+bool fuse_contains(const uint8_t *bitmap, const bloom_segment *seg, const uint64_t *hash) {
+	const uint16_t *f = slots(bitmap, seg);
+	uint64_t        h = key_hash(seg, hash);
+	uint32_t        p[3];
+
+	positions(seg, h, p);
+
+	return (fingerprint(h) ^ f[p[0]] ^ f[p[1]] ^ f[p[2]]) == 0;
+}
+
+void fuse_prefetch(const uint8_t *bitmap, const bloom_segment *seg, const uint64_t *hash) {
+	const uint16_t *f = slots(bitmap, seg);
+	uint32_t        p[3];
+
+	positions(seg, key_hash(seg, hash), p);
+
+	__builtin_prefetch(&f[p[0]]);
+	__builtin_prefetch(&f[p[1]]);
+	__builtin_prefetch(&f[p[2]]);
+}
+
+static int compare_keys(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static size_t remove_duplicates(uint64_t *keys, const size_t n) {
+	size_t kept = 0;
+
+	qsort(keys, n, sizeof(uint64_t), compare_keys);
+	for (size_t i = 0; i < n; i++) {
+		if (kept == 0 || keys[i] != keys[kept - 1]) {
+			keys[kept++] = keys[i];
+		}
+	}
+
+	return kept;
+}
+
+// Peel the slots counted for a build: a slot only one key still maps to
+// gives up that key, which is taken out of its other two slots. Keys are
+// written to order in the order they were peeled, with which of their
+// slots freed them in found. Returns how many keys were peeled.
+static size_t peel(const bloom_segment *seg, uint8_t *count, uint64_t *xor, uint32_t *alone,
+                   uint64_t *order, uint8_t *found, const uint64_t length) {
+	size_t queued = 0;
+	size_t stacked = 0;
+
+	for (size_t i = 0; i < length; i++) {
+		alone[queued] = i;
+		queued += (count[i] >> 2) == 1;
+	}
+
+	while (queued > 0) {
+		uint32_t index = alone[--queued];
+		uint32_t p[3];
+		uint64_t h;
+		int      which;
+
+		if ((count[index] >> 2) != 1) {
+			continue;
+		}
+
+		h = xor[index];
+		which = count[index] & 3;
+		positions(seg, h, p);
+
+		found[stacked] = which;
+		order[stacked++] = h;
+
+		for (int j = 1; j <= 2; j++) {
+			int      other = (which + j) % 3;
+			uint32_t slot = p[other];
+
+			alone[queued] = slot;
+			queued += (count[slot] >> 2) == 2;
+			count[slot] -= 4;
+			count[slot] ^= other;
+			xor[slot] ^= h;
+		}
+	}
+
+	return stacked;
+}
+
+// Build the stack from n keys, the first words of their 128-bit hashes.
+// The stack must have been sized by fuse_geometry for at least n keys.
+// Keys are hashed with a seed and peeled: a slot only one key still maps
+// to is assigned last, so it can be set to make that key's XOR come out
+// right. If peeling gets stuck, the build is retried with another seed.
+// Duplicate keys are removed once a build fails. keys is reordered.
+bool fuse_build(uint8_t *bitmap, bloom_segment *seg, uint64_t *keys, size_t n) {
+	uint64_t   length = (seg->span / seg->hashcount + 2) * seg->hashcount;
+	uint64_t   state = 0x726b2b9d438b9d4dULL;
+	uint64_t  *order = calloc(n + 1, sizeof(uint64_t));
+	uint8_t   *found = malloc(n ? n : 1);
+	uint32_t  *alone = malloc(length * sizeof(uint32_t));
+	uint8_t   *count = calloc(length, 1);
+	uint64_t  *xor = calloc(length, sizeof(uint64_t));
+	size_t    *start;
+	uint16_t  *f = slots(bitmap, seg);
+	uint32_t   block_bits = 1;
+	size_t     stacked = 0;
+	bool       deduplicated = false;
+	bool       built = false;
+
+	while ((1ULL << block_bits) < seg->span / seg->hashcount) {
+		block_bits++;
+	}
+	start = malloc((1ULL << block_bits) * sizeof(size_t));
+
+	if (order == NULL || found == NULL || alone == NULL || count == NULL || xor == NULL || start == NULL) {
+		goto done;
+	}
+
+	for (int attempt = 0; attempt < FUSE_MAX_ATTEMPTS; attempt++) {
+		size_t   block = 1ULL << block_bits;
+		bool     overflow = false;
+
+		seg->seed = splitmix64(&state);
+		memset(order, 0, (n + 1) * sizeof(uint64_t));
+		memset(count, 0, length);
+		memset(xor, 0, length * sizeof(uint64_t));
+		order[n] = 1;
+
+		// sort hashes roughly by segment so the counting below walks memory
+		// in order
+		for (size_t i = 0; i < block; i++) {
+			start[i] = ((uint64_t)i * n) >> block_bits;
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			uint64_t h = murmur64(keys[i] + seg->seed);
+			size_t   b = h >> (64 - block_bits);
+
+			while (order[start[b]] != 0) {
+				b = (b + 1) & (block - 1);
+			}
+			order[start[b]++] = h;
+		}
+
+		// count the keys of every slot and XOR their hashes together. the
+		// low two bits of count record which of its three slots this is
+		for (size_t i = 0; i < n; i++) {
+			uint64_t h = order[i];
+			uint32_t p[3];
+
+			positions(seg, h, p);
+			for (int j = 0; j < 3; j++) {
+				count[p[j]] += 4;
+				count[p[j]] ^= j;
+				xor[p[j]] ^= h;
+				overflow |= count[p[j]] < 4;
+			}
+		}
+
+		stacked = overflow ? 0 : peel(seg, count, xor, alone, order, found, length);
+		if (stacked == n) {
+			built = true;
+			break;
+		}
+
+		// duplicate keys can never be peeled, and a key repeated often
+		// enough overflows the counts of its slots
+		if (!deduplicated) {
+			n = remove_duplicates(keys, n);
+			deduplicated = true;
+		}
+	}
+
+	if (!built) {
+		goto done;
+	}
+
+	memset(f, 0, seg->size / 8);
+	for (size_t i = stacked; i-- > 0;) {
+		uint64_t h = order[i];
+		uint32_t p[3];
+		int      which = found[i];
+
+		positions(seg, h, p);
+		f[p[which]] = fingerprint(h) ^ f[p[(which + 1) % 3]] ^ f[p[(which + 2) % 3]];
+	}
+
+done:
+	free(order);
+	free(found);
+	free(alone);
+	free(count);
+	free(xor);
+	free(start);
+
+	return built;
+}
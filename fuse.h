@@ -0,0 +1,25 @@
+#ifndef FUSE_H
+#define FUSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bloom.h"
+
+// A static binary fuse filter stack (Graf and Lemire, 2022). It is built
+// once from every key of the target file and cannot take more. A key is
+// present if the XOR of three 16-bit slots matches its fingerprint: three
+// reads close together, a false positive rate of 2^-16, and about 18 bits
+// per key.
+#define FUSE_FINGERPRINT_BITS  16
+#define FUSE_MAX_KEYS          (UINT32_MAX / 2)
+#define FUSE_MAX_ATTEMPTS      100
+
+bool  fuse_geometry(bloom_segment *, const size_t);
+bool  fuse_valid(const bloom_segment *);
+bool  fuse_build(uint8_t *, bloom_segment *, uint64_t *, size_t);
+bool  fuse_contains(const uint8_t *, const bloom_segment *, const uint64_t *);
+void  fuse_prefetch(const uint8_t *, const bloom_segment *, const uint64_t *);
+
+#endif /* FUSE_H */
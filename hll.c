@@ -0,0 +1,70 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "hll.h"
+
+// the top bits of a hash pick a register, the rest give the rank: the
+// position of their first set bit. the guard bit caps the rank.
+static inline void hll_register(const uint64_t hash, size_t *index, uint8_t *rank) {
+	*index = hash >> (64 - HLL_PRECISION);
+	*rank  = __builtin_clzll((hash << HLL_PRECISION) | (1ULL << (HLL_PRECISION - 1))) + 1;
+}
+
+void hll_add(uint8_t *registers, const uint64_t hash) {
+	size_t  index;
+	uint8_t rank;
+
+	hll_register(hash, &index, &rank);
+	if (rank > registers[index]) {
+		registers[index] = rank;
+	}
+}
+
+// same as hll_add, but safe against other threads updating the same register
+void hll_add_atomic(uint8_t *registers, const uint64_t hash) {
+	size_t  index;
+	uint8_t rank;
+	uint8_t current;
+
+	hll_register(hash, &index, &rank);
+	current = __atomic_load_n(&registers[index], __ATOMIC_RELAXED);
+	while (rank > current) {
+		if (__atomic_compare_exchange_n(&registers[index], &current, rank, true,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+}
+
+// fold the registers of src into dst, which then counts the union of both
+void hll_merge(uint8_t *dst, const uint8_t *src) {
+	for (size_t i = 0; i < HLL_REGISTERS; i++) {
+		if (src[i] > dst[i]) {
+			dst[i] = src[i];
+		}
+	}
+}
+
+double hll_estimate(const uint8_t *registers) {
+	const double m = HLL_REGISTERS;
+	double       sum = 0.0;
+	size_t       zeros = 0;
+	double       estimate;
+
+	for (size_t i = 0; i < HLL_REGISTERS; i++) {
+		sum += ldexp(1.0, -registers[i]);
+		if (registers[i] == 0) {
+			zeros++;
+		}
+	}
+
+	estimate = (0.7213 / (1.0 + 1.079 / m)) * m * m / sum;
+
+	// linear counting is more accurate while many registers are still empty
+	if (estimate <= 2.5 * m && zeros > 0) {
+		estimate = m * log(m / zeros);
+	}
+
+	return estimate;
+}
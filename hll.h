@@ -0,0 +1,17 @@
+#ifndef HLL_H
+#define HLL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// HyperLogLog distinct counter. 2^11 one-byte registers give a standard
+// error of about 2.3%, small enough to live in a cache file header.
+#define HLL_PRECISION  11
+#define HLL_REGISTERS  (1 << HLL_PRECISION)
+
+void    hll_add(uint8_t *, const uint64_t);
+void    hll_add_atomic(uint8_t *, const uint64_t);
+void    hll_merge(uint8_t *, const uint8_t *);
+double  hll_estimate(const uint8_t *);
+
+#endif /* HLL_H */
@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KEY_X86
+#endif
+
+#include "key.h"
+
+// Find the nth delimiter (counting from 1) in p[from..len). Returns len if
+// there are fewer.
+typedef size_t (*find_fn)(const char *, const size_t, size_t, size_t, const char);
+
+static size_t find_scalar(const char *p, const size_t len, size_t from, size_t nth, const char delim) {
+	for (; from < len; from++) {
+		if (p[from] == delim && --nth == 0) {
+			return from;
+		}
+	}
+
+	return len;
+}
+
+#ifdef KEY_X86
+// compare a whole vector against the delimiter and count the matches, so
+// fields are skipped a vector at a time. the last vector is walked bit by
+// bit to the one wanted.
+#define FIND_VECTOR(WIDTH, MASK)											\
+	for (; from + WIDTH <= len; from += WIDTH) {							\
+		uint32_t mask = (MASK);												\
+		size_t   count = __builtin_popcount(mask);							\
+																			\
+		if (count < nth) {													\
+			nth -= count;													\
+			continue;														\
+		}																	\
+																			\
+		while (--nth > 0) {													\
+			mask &= mask - 1;												\
+		}																	\
+		return from + __builtin_ctz(mask);									\
+	}																		\
+																			\
+	return find_scalar(p, len, from, nth, delim);
+
+__attribute__((target("popcnt")))
+static size_t find_sse2(const char *p, const size_t len, size_t from, size_t nth, const char delim) {
+	const __m128i d = _mm_set1_epi8(delim);
+
+	FIND_VECTOR(16, _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + from)), d)))
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t find_avx2(const char *p, const size_t len, size_t from, size_t nth, const char delim) {
+	const __m256i d = _mm256_set1_epi8(delim);
+
+	FIND_VECTOR(32, (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + from)), d)))
+}
+#endif
+
+static find_fn select_find(void) {
+#ifdef KEY_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+		return find_avx2;
+	}
+	if (__builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt")) {
+		return find_sse2;
+	}
+#endif
+	return find_scalar;
+}
+
+static find_fn find_delim;
+
+static bool parse_size(const char *s, char **end, size_t *value) {
+	unsigned long long n;
+
+	errno = 0;
+	n = strtoull(s, end, 10);
+	if (errno != 0 || *end == s || n == 0 || *s == '-') {
+		return false;
+	}
+
+	*value = n;
+	return true;
+}
+
+// a field number, counting from 1. the delimiter is set apart with -d
+bool key_field_parse(const char *s, key_spec *key) {
+	char *end;
+
+	if (!parse_size(s, &end, &key->field) || *end != '\0') {
+		return false;
+	}
+
+	key->kind = KEY_FIELD;
+	return true;
+}
+
+// bytes N-M, N- or N, counting from 1 as cut -b does
+bool key_range_parse(const char *s, key_spec *key) {
+	char   *end;
+	size_t  first;
+	size_t  last = SIZE_MAX;
+
+	if (!parse_size(s, &end, &first)) {
+		return false;
+	}
+
+	if (*end == '\0') {
+		last = first;
+	} else if (*end != '-') {
+		return false;
+	} else if (end[1] != '\0' && (!parse_size(end + 1, &end, &last) || *end != '\0' || last < first)) {
+		return false;
+	}
+
+	key->kind  = KEY_RANGE;
+	key->start = first - 1;
+	key->end   = last;
+	return true;
+}
+
+// a single character, or \t
+bool key_delim_parse(const char *s, key_spec *key) {
+	if (strcmp(s, "\\t") == 0) {
+		key->delim = '\t';
+		return true;
+	}
+
+	if (s[0] == '\0' || s[1] != '\0' || s[0] == '\n') {
+		return false;
+	}
+
+	key->delim = s[0];
+	return true;
+}
+
+// Describe a key spec in a way that tells apart any two that pick out
+// different keys. Cache files are named after it.
+int key_name(const key_spec *key, char *out, const size_t size) {
+	switch (key->kind) {
+	case KEY_FIELD:
+		return snprintf(out, size, "field %zu of 0x%02x", key->field, (unsigned char)key->delim);
+	case KEY_RANGE:
+		return snprintf(out, size, "bytes %zu-%zu", key->start, key->end);
+	default:
+		return snprintf(out, size, "line");
+	}
+}
+
+// Replace each of n lines with its key, a slice of the line itself.
+void key_extract_batch(const key_spec *key, const char **lines, size_t *lens, const size_t n) {
+	find_fn find;
+
+	if (key->kind == KEY_RANGE) {
+		for (size_t i = 0; i < n; i++) {
+			size_t start = key->start < lens[i] ? key->start : lens[i];
+			size_t end = key->end < lens[i] ? key->end : lens[i];
+
+			lines[i] += start;
+			lens[i]   = end - start;
+		}
+		return;
+	}
+
+	if (key->kind != KEY_FIELD) {
+		return;
+	}
+
+	find = __atomic_load_n(&find_delim, __ATOMIC_RELAXED);
+	if (find == NULL) {
+		find = select_find();
+		__atomic_store_n(&find_delim, find, __ATOMIC_RELAXED);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		const char *p = lines[i];
+		size_t      len = lens[i];
+		size_t      start = 0;
+		size_t      end;
+
+		if (key->field > 1) {
+			start = find(p, len, 0, key->field - 1, key->delim);
+			start = start < len ? start + 1 : len;
+		}
+
+		end = find(p, len, start, 1, key->delim);
+
+		lines[i] = p + start;
+		lens[i]  = end - start;
+	}
+}
@@ -0,0 +1,33 @@
+#ifndef KEY_H
+#define KEY_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// What part of a line it is deduplicated on. The whole line is still what
+// gets written; only the key is hashed. A field is what lies between two
+// delimiters, with no quoting, as cut(1) sees it; a line with fewer fields
+// has an empty key. A byte range is cut to the line it falls on.
+typedef enum {
+	KEY_LINE = 0,
+	KEY_FIELD,
+	KEY_RANGE
+} key_kind;
+
+#define KEY_DEFAULT_DELIM '\t'
+
+typedef struct {
+	key_kind  kind;
+	char      delim;
+	size_t    field;   // counting from 1
+	size_t    start;   // first byte of a range, counting from 0
+	size_t    end;     // one past its last byte, or SIZE_MAX
+} key_spec;
+
+bool  key_field_parse(const char *, key_spec *);
+bool  key_range_parse(const char *, key_spec *);
+bool  key_delim_parse(const char *, key_spec *);
+int   key_name(const key_spec *, char *, const size_t);
+void  key_extract_batch(const key_spec *, const char **, size_t *, const size_t);
+
+#endif /* KEY_H */
@@ -10,7 +10,7 @@ void mmh3_64_make_hashes(const void *data, size_t len, size_t count, uint64_t *h
     mmh3_128(data, len, 0, hash);
 
     for (size_t i = 0; i < count; i++) {
-        hash_output[i] = (hash[0] + i * hash[1]) % UINT64_MAX;
+        hash_output[i] = hash[0] + i * hash[1];
     }
 }
 
@@ -187,3 +187,180 @@ void mmh3_128(const void *key, const size_t len, const uint64_t seed, uint64_t *
     out[1] = h2;
 }
 
+// Hash several keys at once, one per vector lane. Most lines are a block or
+// two long, so hashing them one at a time spends more time in the
+// dependency chain of the finalizer than in loading bytes; side by side,
+// the lanes fill each other's latency. Results are identical to mmh3_128.
+#define MMH3_LANES 8
+
+typedef uint64_t mmh3_vec __attribute__((vector_size(MMH3_LANES * sizeof(uint64_t))));
+
+#define MMH3_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+#define MMH3_FMIX(h) do { \
+	(h) ^= (h) >> 33; \
+	(h) *= 0xff51afd7ed558ccdULL; \
+	(h) ^= (h) >> 33; \
+	(h) *= 0xc4ceb9fe1a85ec53ULL; \
+	(h) ^= (h) >> 33; \
+} while (0)
+
+// Load the last len & 15 bytes of a key zero padded, as the tail of
+// mmh3_128 reads them. Reading 16 bytes and masking avoids a branch per
+// byte count, which random line lengths mispredict; the read never leaves
+// the page the tail starts in, so it cannot fault.
+#define MMH3_PAGE 4096
+
+static inline __attribute__((always_inline))
+void load_tail(const uint8_t *tail, const size_t rem, uint64_t *lo, uint64_t *hi) {
+	__uint128_t v = 0;
+
+	if (((uintptr_t)tail & (MMH3_PAGE - 1)) <= MMH3_PAGE - 16) {
+		__uint128_t keep = ~(__uint128_t)0 >> (8 * (16 - rem) & 127);
+
+		memcpy(&v, tail, 16);
+		v &= rem ? keep : 0;
+	} else {
+		memcpy(&v, tail, rem);
+	}
+
+	*lo = v;
+	*hi = v >> 64;
+}
+
+// The body of every lane kernel. A lane whose key has no block left keeps
+// its state; the tail is loaded zero padded, and mixing a zero word changes
+// nothing, so all lanes can run the same instructions.
+static inline __attribute__((always_inline))
+void lanes_kernel(const void *const *keys, const size_t *lens, const uint64_t seed, uint64_t (*out)[2]) {
+	const uint64_t  c1 = 0x87c37b91114253d5ULL;
+	const uint64_t  c2 = 0x4cf5ad432745937fULL;
+	static const uint8_t zeros[16];
+	uint64_t        w1[MMH3_LANES] __attribute__((aligned(64)));
+	uint64_t        w2[MMH3_LANES] __attribute__((aligned(64)));
+	uint64_t        nblocks[MMH3_LANES] __attribute__((aligned(64)));
+	mmh3_vec        h1, h2, k1, k2, len, blocks, mask;
+	size_t          most = 0;
+
+	for (int lane = 0; lane < MMH3_LANES; lane++) {
+		w1[lane] = lens[lane];
+		nblocks[lane] = lens[lane] / 16;
+		if (nblocks[lane] > most) {
+			most = nblocks[lane];
+		}
+	}
+	memcpy(&len, w1, sizeof(len));
+	memcpy(&blocks, nblocks, sizeof(blocks));
+	h1 = seed + (mmh3_vec){0};
+	h2 = h1;
+
+	for (size_t i = 0; i < most; i++) {
+		mmh3_vec n1 = h1, n2 = h2;
+
+		// lanes that are out of blocks read zeros, without a branch
+		for (int lane = 0; lane < MMH3_LANES; lane++) {
+			const uint8_t *block = (const uint8_t *)keys[lane] + i * 16;
+
+			block = i < nblocks[lane] ? block : zeros;
+			memcpy(&w1[lane], block, 8);
+			memcpy(&w2[lane], block + 8, 8);
+		}
+		memcpy(&k1, w1, sizeof(k1));
+		memcpy(&k2, w2, sizeof(k2));
+
+		k1 *= c1; k1 = MMH3_ROTL(k1, 31); k1 *= c2; n1 ^= k1;
+		n1 = MMH3_ROTL(n1, 27); n1 += n2; n1 = n1 * 5 + 0x52dce729;
+
+		k2 *= c2; k2 = MMH3_ROTL(k2, 33); k2 *= c1; n2 ^= k2;
+		n2 = MMH3_ROTL(n2, 31); n2 += n1; n2 = n2 * 5 + 0x38495ab5;
+
+		mask = (mmh3_vec)(i < blocks);
+		h1 = (n1 & mask) | (h1 & ~mask);
+		h2 = (n2 & mask) | (h2 & ~mask);
+	}
+
+	for (int lane = 0; lane < MMH3_LANES; lane++) {
+		load_tail((const uint8_t *)keys[lane] + nblocks[lane] * 16, lens[lane] & 15, &w1[lane], &w2[lane]);
+	}
+	memcpy(&k1, w1, sizeof(k1));
+	memcpy(&k2, w2, sizeof(k2));
+
+	k2 *= c2; k2 = MMH3_ROTL(k2, 33); k2 *= c1; h2 ^= k2;
+	k1 *= c1; k1 = MMH3_ROTL(k1, 31); k1 *= c2; h1 ^= k1;
+
+	h1 ^= len;
+	h2 ^= len;
+
+	h1 += h2;
+	h2 += h1;
+
+	MMH3_FMIX(h1);
+	MMH3_FMIX(h2);
+
+	h1 += h2;
+	h2 += h1;
+
+	memcpy(w1, &h1, sizeof(h1));
+	memcpy(w2, &h2, sizeof(h2));
+	for (int lane = 0; lane < MMH3_LANES; lane++) {
+		out[lane][0] = w1[lane];
+		out[lane][1] = w2[lane];
+	}
+}
+
+typedef void (*lanes_fn)(const void *const *, const size_t *, const uint64_t, uint64_t (*)[2]);
+
+// without wide vectors, emulated 64-bit multiplies cost more than they save
+static void lanes_scalar(const void *const *keys, const size_t *lens, const uint64_t seed, uint64_t (*out)[2]) {
+	for (int lane = 0; lane < MMH3_LANES; lane++) {
+		mmh3_128(keys[lane], lens[lane], seed, out[lane]);
+	}
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx2")))
+static void lanes_avx2(const void *const *keys, const size_t *lens, const uint64_t seed, uint64_t (*out)[2]) {
+	lanes_kernel(keys, lens, seed, out);
+}
+
+// AVX-512DQ has a 64-bit vector multiply; AVX2 has to build one from three
+// 32-bit ones
+__attribute__((target("avx512f,avx512dq")))
+static void lanes_avx512(const void *const *keys, const size_t *lens, const uint64_t seed, uint64_t (*out)[2]) {
+	lanes_kernel(keys, lens, seed, out);
+}
+#endif
+
+// pick the widest kernel the CPU runs, once
+static lanes_fn lanes_select(void) {
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512dq")) {
+		return lanes_avx512;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return lanes_avx2;
+	}
+#endif
+	return lanes_scalar;
+}
+
+// Hash n keys with mmh3_128, MMH3_LANES at a time. out must hold n hashes.
+void mmh3_128_batch(const void *const *keys, const size_t *lens, const size_t n, const uint64_t seed, uint64_t (*out)[2]) {
+	static lanes_fn  selected;
+	lanes_fn         lanes = __atomic_load_n(&selected, __ATOMIC_RELAXED);
+	size_t           i = 0;
+
+	if (lanes == NULL) {
+		lanes = lanes_select();
+		__atomic_store_n(&selected, lanes, __ATOMIC_RELAXED);
+	}
+
+	for (; i + MMH3_LANES <= n; i += MMH3_LANES) {
+		lanes(keys + i, lens + i, seed, out + i);
+	}
+
+	for (; i < n; i++) {
+		mmh3_128(keys[i], lens[i], seed, out[i]);
+	}
+}
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <libgen.h>
 #include <sys/types.h>
@@ -13,24 +14,76 @@
 
 #include "bloom.h"
 #include "mmh3.h"
+#include "reader.h"
+#include "parallel.h"
+#include "sidecar.h"
+#include "exact.h"
+#include "stats.h"
+#include "shard.h"
+#include "daemon.h"
+#include "uring.h"
+#include "writer.h"
+#include "filterset.h"
+#include "key.h"
+#include "sketch.h"
 
 #define DEFAULT_INITIAL_SIZE        10000
-#define DEFAULT_MAX_STACKS              5
+#define DEFAULT_MAX_STACKS              0
 #define LARGE_FILE_THRESHOLD (100 * 1024) // 100 Kb
+#define LINE_BATCH                   1024
+#define PARALLEL_BATCH              65536
+#define SAMPLE_SIZE           (64 * 1024)
+#define SAMPLE_SLICES                  16
+#define SAMPLE_MARGIN                1.25
 
 void usage(const char *progname) {
 	fprintf(stderr,
 			"usage: %s [options] [file]\n"
 			"options:\n"
 			"  -s SIZE    Initial filter capacity (default %d)\n"
-			"  -m COUNT   Maximum number of filter stacks (default %d)\n"
+			"  -m COUNT   Rebuild the filter once it has COUNT stacks (default %d, 0 = never)\n"
+			"  -B         Use cache-line blocked filter layout\n"
+			"  -b TYPE    Filter backend: bloom (default), cuckoo, or fuse. fuse builds\n"
+			"             the lines of the file into a static filter\n"
+			"  -H HASH    Hash function: mmh3 (default) or wyhash, which is faster\n"
 			"  -f         Force filter rebuild\n"
+			"  -j JOBS    Hash and probe lines on JOBS threads (default 1, 0 = all CPUs).\n"
+			"             Rebuilding a filter from file uses all CPUs unless -j is given\n"
+			"  -M         Memory-map the cache file instead of reading it\n"
+			"  -y SYNC    When new lines are synced to disk: none, exit (default), every\n"
+			"             SIZE written such as 64M, or every TIME such as 500ms or 2s\n"
+			"  -U         Use plain reads and writes instead of io_uring\n"
+			"  -F         Do not keep a sidecar of line fingerprints for rebuilds\n"
+			"  -e         Exact mode: never drop a new line, at about 20-40 bytes per line\n"
+			"  -P SHARDS  Split the cached filter into SHARDS filters (at most %d), each\n"
+			"             loaded only once a line lands in it. Not with -e or -b fuse\n"
+			"  -t K       Only take lines once they have been seen K times (1 to 15),\n"
+			"             counted in a sketch kept in ~/.new\n"
+			"  -C SIZE    Memory for the -t sketch, such as 512M (default 128M). It\n"
+			"             counts about one distinct line per 7 bytes accurately\n"
+			"  -d DELIM   Field delimiter for -k (default tab)\n"
+			"  -k FIELD   Deduplicate on field FIELD of each line, counting from 1,\n"
+			"             and write the whole line\n"
+			"  -R N-M     Deduplicate on bytes N to M of each line, counting from 1\n"
+			"  -x FILE    Drop lines already in FILE, using its cached filter. Repeatable\n"
+			"  -i FILE    Only take lines already in FILE, using its cached filter.\n"
+			"             Repeatable: lines must be in every FILE\n"
+			"  -w OUT     Write the union of the -x filters, or the intersection of\n"
+			"             the -i filters, to OUT as one filter and exit. -x and -i\n"
+			"             take such a file like any other\n"
+			"  -D         Keep filters in memory and serve runs over ~/.new/%s until\n"
+			"             SIGINT or SIGTERM. Runs given only a file use the server\n"
+			"  -c         Print the distinct lines of file estimated from its cached\n"
+			"             filter, without reading the file, and exit\n"
+			"  -S         Print timings and counters to stderr at exit\n"
+			"  -J         Like -S, as one line of JSON\n"
 			"  -v         Verbose output\n"
 			"  -n         Do not save cache files in ~/.new\n"
 			"  -h         Help\n"
 			"\n"
-			"If no file is specified, deduplicate stdin stream to stdout\n",
-			progname, DEFAULT_INITIAL_SIZE, DEFAULT_MAX_STACKS);
+			"If no file is specified, deduplicate stdin stream to stdout.\n"
+			"SIGUSR1 prints a progress line to stderr.\n",
+			progname, DEFAULT_INITIAL_SIZE, DEFAULT_MAX_STACKS, SHARD_MAX, DAEMON_SOCKET);
 }
 
 const char *get_home_dir(void) {
@@ -85,23 +138,44 @@ int get_cache_path(const char *filepath, char *out_path, size_t out_size) {
     return 0;
 }
 
-size_t count_lines(const char *path) {
-    FILE *fp = fopen(path, "r");
-    if (!fp) {
-		return 0;
+// Name the cache of a file deduplicated on part of each line after the key
+// as well, so filters of the same file on different keys never collide.
+int get_key_cache_path(const char *filepath, const key_spec *key, char *out_path, size_t out_size) {
+	char        keyed[PATH_MAX * 2 + 64];
+	char        name[64];
+	const char *home = get_home_dir();
+
+	if (key == NULL) {
+		return get_cache_path(filepath, out_path, out_size);
 	}
 
-    size_t count = 0;
-    int c;
-    while ((c = fgetc(fp)) != EOF) {
-        if (c == '\n') {
-			count++;
-		}
-    }
+	if (!home) {
+		return -1;
+	}
+
+	key_name(key, name, sizeof(name));
+	snprintf(keyed, sizeof(keyed), "%s\n%s", filepath, name);
+	snprintf(out_path, out_size, "%s/.new/%016llx", home, (unsigned long long)mmh3_64_string(keyed, 0));
+
+	return 0;
+}
+
+int get_socket_path(char *out_path, size_t out_size) {
+	const char *home = get_home_dir();
+
+	if (!home) {
+		return -1;
+	}
+
+	snprintf(out_path, out_size, "%s/.new/%s", home, DAEMON_SOCKET);
 
-    fclose(fp);
+	return 0;
+}
+
+uint64_t file_size(const char *path) {
+	struct stat st;
 
-    return count ? count : DEFAULT_INITIAL_SIZE;
+	return stat(path, &st) == 0 ? (uint64_t)st.st_size : 0;
 }
 
 bool is_large_file(const char *path) {
@@ -114,24 +188,670 @@ bool is_large_file(const char *path) {
     return st.st_size > LARGE_FILE_THRESHOLD;
 }
 
-bool stat_mismatch(const bloomfilter *bf, const char *filepath) {
+// Make a file argument absolute without requiring the file to exist, as
+// cache files are named after the path.
+bool resolve_path(const char *arg, char *out_path, size_t out_size) {
+	char dirbuf[PATH_MAX];
+	char filebuf[PATH_MAX];
+	char resolved_dir[PATH_MAX];
+
+	snprintf(dirbuf, sizeof(dirbuf), "%s", arg);
+	snprintf(filebuf, sizeof(filebuf), "%s", arg);
+
+	char *dir = dirname(dirbuf);
+	char *file = basename(filebuf);
+
+	if (!realpath(dir, resolved_dir)) {
+		return false;
+	}
+
+	snprintf(out_path, out_size, "%s/%s", resolved_dir, file);
+
+	return true;
+}
+
+// Estimate the number of lines in a file from SAMPLE_SIZE bytes of it,
+// read as SAMPLE_SLICES slices spread evenly over the whole file, so a
+// file whose lines get longer or shorter part way through is not judged
+// by its start alone. Files no larger than the sample are counted exactly.
+size_t estimate_lines(const char *path) {
+	char        buf[SAMPLE_SIZE];
 	struct stat st;
+	size_t      slice;
+	size_t      got = 0;
+	size_t      count = 0;
+	int         fd;
 
-	if (stat(filepath, &st) == -1) {
-		return true;
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return 0;
+	}
+
+	if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+		close(fd);
+		return 0;
+	}
+
+	slice = (size_t)st.st_size <= sizeof(buf) ? (size_t)st.st_size : sizeof(buf) / SAMPLE_SLICES;
+	for (size_t i = 0; got + slice <= sizeof(buf) && got < (size_t)st.st_size; i++) {
+		off_t   offset = (size_t)st.st_size <= sizeof(buf) ? 0 : (off_t)((st.st_size - slice) * i / (SAMPLE_SLICES - 1));
+		ssize_t n = pread(fd, buf + got, slice, offset);
+
+		if (n <= 0) {
+			break;
+		}
+		got += n;
+	}
+	close(fd);
+
+	if (got == 0) {
+		return 0;
+	}
+
+	for (char *p = buf; (p = memchr(p, '\n', buf + got - p)) != NULL; p++) {
+		count++;
+	}
+
+	if (count == 0) {
+		// lines longer than the slices
+		return 1;
 	}
 
-	return bf->ino != st.st_ino || bf->dev != st.st_dev || bf->mtime != st.st_mtime;
+	return (double)count * st.st_size / got;
 }
 
-void update_stat_metadata(bloomfilter *bf, const char *filepath) {
+// Size a filter that is about to be populated from the target file. A
+// cached filter, even a stale one, knows how many distinct lines it held
+// from its HLL registers. Otherwise the line count is extrapolated from
+// samples of the file, with SAMPLE_MARGIN on top for lines the samples
+// missed. Both leave room for the file to double before stacking, and a
+// filter that still runs out stacks while it is populated.
+size_t rebuild_expected(const char *filepath, const char *cache_path, const size_t initial_size) {
+	size_t      expected;
+	uint64_t    cached_size;
 	struct stat st;
 
-	if (stat(filepath, &st) == 0) {
-		bf->ino = st.st_ino;
-		bf->dev = st.st_dev;
-		bf->mtime = st.st_mtime;
+	if (!is_large_file(filepath)) {
+		return initial_size;
+	}
+
+	if (cache_path[0] != '\0' &&
+		bloom_cached_distinct(cache_path, &expected, &cached_size) == BF_SUCCESS &&
+		expected > 0) {
+		// assume lines added since have the same share of duplicates
+		if (stat(filepath, &st) == 0 && cached_size > 0 && (uint64_t)st.st_size > cached_size) {
+			expected = (double)expected * st.st_size / cached_size;
+		}
+	} else {
+		expected = estimate_lines(filepath) * SAMPLE_MARGIN;
+	}
+
+	expected *= 2;
+	return expected > (size_t)initial_size ? expected : initial_size;
+}
+
+// Start an empty sidecar for a filter that is about to be populated from
+// its target file. Without one, rebuilds read the target file instead.
+void start_sidecar(bloomfilter *bf, sidecar *sc, const char *path) {
+	if (sidecar_create(sc, path, bf->hash)) {
+		bf->sidecar = sc;
+	} else {
+		unlink(path);
+	}
+}
+
+void close_sidecar(bloomfilter *bf) {
+	if (bf->sidecar) {
+		sidecar_close(bf->sidecar);
+		bf->sidecar = NULL;
+	}
+}
+
+// Load the count sketch kept for -t, or start an empty one of size bytes,
+// SKETCH_DEFAULT_SIZE if 0. It counts lines of past streams, not of the
+// target file, so there is nothing to rebuild it from, and a loaded sketch
+// keeps its size.
+bool setup_sketch(sketch *sk, const char *path, const size_t size, const bloom_hash_t hash, const bool verbose) {
+	bloom_error_t error = BF_FOPEN;
+
+	if (path[0] != '\0') {
+		error = sketch_load(sk, path);
+	}
+
+	if (error == BF_SUCCESS) {
+		if (size != 0 && sketch_memory(sk) != size) {
+			fprintf(stderr, "Count sketch %s keeps its size of %zu bytes\n", path, sketch_memory(sk));
+		}
+		return true;
+	}
+
+	if (verbose && error != BF_FOPEN) {
+		fprintf(stderr, "Failed to load count sketch (%s). Counting from zero...\n",
+				bloom_strerror(error));
+	}
+
+	return sketch_init(sk, size ? size : SKETCH_DEFAULT_SIZE, hash) == BF_SUCCESS;
+}
+
+// Say once that a sketch holds more distinct lines than it was sized for,
+// and how often counts are now overstated.
+void warn_overfull(const sketch *sk, const char *path) {
+	fprintf(stderr, "warning: the count sketch holds about %.0f distinct lines but is sized for %zu. "
+			"About %.1f%% of counts are now overstated. ",
+			sketch_distinct(sk), sketch_capacity(sk), sketch_error(sk) * 100.0);
+	if (path[0] != '\0') {
+		fprintf(stderr, "Remove %s and use a larger -C to count in a bigger one\n", path);
+	} else {
+		fprintf(stderr, "Use a larger -C\n");
+	}
+}
+
+// Load the exact table of a target file, catching it up with appended
+// lines, or build it from the whole file. Without a target file, start an
+// empty table.
+bool setup_exact(exact *ex, const char *filepath, const char *path, const key_spec *key, const size_t initial_size, const bool force_rebuild, const bool verbose, stats *st) {
+	bloom_error_t error;
+	size_t        expected;
+	bool          populated;
+
+	if (filepath == NULL) {
+		return exact_init(ex, initial_size) == BF_SUCCESS;
+	}
+
+	if (path[0] != '\0' && force_rebuild) {
+		st->cache = "forced";
+	} else if (path[0] != '\0') {
+		stats_begin(st, STATS_LOAD);
+		error = exact_load(ex, path, filepath);
+		ex->key = key;
+		if (error == BF_SUCCESS) {
+			st->cache = "hit";
+			stats_end(st);
+			return true;
+		}
+
+		if (error == BF_GROWN) {
+			if (verbose) {
+				fprintf(stderr, "Target file has grown. Adding lines from offset %llu...\n",
+						(unsigned long long)ex->target.size);
+			}
+
+			st->bytes_hashed += file_size(filepath) - ex->target.size;
+			if (exact_populate_from_offset(ex, filepath, ex->target.size)) {
+				st->cache = "grown";
+				stats_end(st);
+				return true;
+			}
+			exact_destroy(ex);
+		}
+		stats_end(st);
+
+		st->cache = (error == BF_FOPEN) ? "miss" : "invalid";
+		if (error != BF_FOPEN) {
+			st->reason = bloom_strerror(error);
+		}
+
+		if (verbose && error != BF_FOPEN) {
+			fprintf(stderr, "Failed to load exact table (%s). Rebuilding...\n",
+					bloom_strerror(error));
+		}
+	}
+
+	stats_begin(st, STATS_COUNT);
+	expected = rebuild_expected(filepath, "", initial_size);
+	stats_end(st);
+
+	if (exact_init(ex, expected) != BF_SUCCESS) {
+		return false;
+	}
+	ex->key = key;
+
+	stats_begin(st, STATS_POPULATE);
+	st->bytes_hashed += file_size(filepath);
+	populated = exact_populate_from_offset(ex, filepath, 0);
+	stats_end(st);
+
+	return populated;
+}
+
+// Open the sharded filter of a target file, catching it up with appended
+// lines, or build every shard from the whole file.
+bool setup_shards(sharded *sh, const char *filepath, const char *cache_path, const key_spec *key, const size_t shards, const size_t initial_size,
+                  const size_t max_stacks, const bloom_layout_t layout, const bloom_backend_t backend, const bloom_hash_t hash,
+                  const bool map_cache, const bool force_rebuild, const bool verbose, stats *st) {
+	char          dir[PATH_MAX + 8];
+	uint64_t      offset = 0;
+	size_t        expected;
+	bloom_error_t error = BF_STALE;
+	bool          populated;
+
+	snprintf(dir, sizeof(dir), "%s.shards", cache_path);
+
+	// a loaded manifest brings its own shard size
+	if (!shard_init(sh, dir, filepath, shards, initial_size, 0.0001f, max_stacks, layout, backend, hash, map_cache)) {
+		return false;
+	}
+	sh->key = key;
+
+	if (force_rebuild) {
+		st->cache = "forced";
+	} else {
+		stats_begin(st, STATS_LOAD);
+		error = shard_load(sh, &offset);
+		stats_end(st);
+
+		if (error == BF_SUCCESS) {
+			st->cache = "hit";
+			return true;
+		}
+
+		st->cache = (error == BF_FOPEN) ? "miss" : "invalid";
+		if (error != BF_FOPEN && error != BF_GROWN) {
+			st->reason = bloom_strerror(error);
+			if (verbose) {
+				fprintf(stderr, "Failed to load sharded filter (%s). Rebuilding...\n", bloom_strerror(error));
+			}
+		}
+	}
+
+	if (error == BF_GROWN) {
+		if (verbose) {
+			fprintf(stderr, "Target file has grown. Adding lines from offset %llu...\n", (unsigned long long)offset);
+		}
+		st->cache = "grown";
+	} else {
+		offset = 0;
+		shard_destroy(sh);
+
+		stats_begin(st, STATS_COUNT);
+		expected = rebuild_expected(filepath, "", initial_size);
+		stats_end(st);
+
+		if (!shard_init(sh, dir, filepath, shards, expected, 0.0001f, max_stacks, layout, backend, hash, map_cache) ||
+			!shard_reset(sh)) {
+			return false;
+		}
+		sh->key = key;
+	}
+
+	stats_begin(st, STATS_POPULATE);
+	st->bytes_hashed += file_size(filepath) - offset;
+	populated = shard_populate(sh, offset);
+	stats_end(st);
+
+	return populated;
+}
+
+// the threaded path only stacks between batches. keep a batch well below
+// what the last stack can take so small filters are not overfilled.
+size_t parallel_batch_limit(const bloomfilter *bf, const size_t batch) {
+	size_t limit = bf->stacks[bf->stack_count - 1].expected / 4;
+
+	if (batch <= LINE_BATCH || limit >= batch) {
+		return batch;
+	}
+
+	return limit > LINE_BATCH ? limit : LINE_BATCH;
+}
+
+// Hand stdin to a running server over fd, which appends the new lines to
+// filepath. fd is closed once the server has replied.
+int send_to_daemon(const int fd, const char *filepath) {
+	daemon_reply  reply = {0};
+	bloom_error_t error = daemon_send(fd, filepath, STDIN_FILENO, &reply);
+
+	close(fd);
+	if (error != BF_SUCCESS) {
+		fprintf(stderr, "Server failed to add lines to %s: %s\n", filepath, bloom_strerror(error));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+// Serve the filters of any number of target files until stopped.
+int run_daemon(const size_t initial_size, const size_t max_stacks, const bloom_layout_t layout, const bloom_backend_t backend,
+               const bloom_hash_t hash, const bool map_cache, const size_t jobs, const writer_policy *durability,
+               const bool verbose) {
+	char          socket_path[PATH_MAX];
+	daemon_config cfg = {
+		.initial_size = initial_size,
+		.max_stacks   = max_stacks,
+		.layout       = layout,
+		.backend      = backend,
+		.hash         = hash,
+		.map          = map_cache,
+		.jobs         = jobs,
+		.checkpoint   = DAEMON_CHECKPOINT,
+		.durability   = *durability,
+		.verbose      = verbose,
+		.cache_path   = get_cache_path,
+		.expected     = rebuild_expected
+	};
+
+	if (check_cache_dir() != 0 || get_socket_path(socket_path, sizeof(socket_path)) != 0) {
+		return EXIT_FAILURE;
+	}
+
+	return daemon_serve(socket_path, &cfg);
+}
+
+// Print the distinct lines of a target file as estimated from the bits of
+// its cached filter. The filter is used even if the file changed since.
+int print_estimate(const char *filepath, const key_spec *key, const bool verbose) {
+	char          cache_path[PATH_MAX];
+	bloomfilter   bf;
+	bloom_error_t error;
+	char          shard_dir[PATH_MAX + 8];
+	double        estimate;
+
+	if (get_key_cache_path(filepath, key, cache_path, sizeof(cache_path)) != 0) {
+		return EXIT_FAILURE;
+	}
+
+	snprintf(shard_dir, sizeof(shard_dir), "%s.shards", cache_path);
+	if (shard_exists(shard_dir)) {
+		error = shard_estimate(shard_dir, &estimate);
+		if (error != BF_SUCCESS) {
+			fprintf(stderr, "Failed to read sharded filter for %s (%s)\n", filepath, bloom_strerror(error));
+			return EXIT_FAILURE;
+		}
+
+		printf("%.0f\n", estimate);
+		return EXIT_SUCCESS;
+	}
+
+	error = bloom_load(&bf, cache_path, NULL);
+	if (error != BF_SUCCESS) {
+		fprintf(stderr, "No cached filter for %s (%s)\n", filepath, bloom_strerror(error));
+		return EXIT_FAILURE;
+	}
+
+	if (verbose) {
+		for (size_t i = 0; i < bf.stack_count; i++) {
+			fprintf(stderr, "stack %zu: %.0f of %llu lines, %.1f%% full\n", i,
+					bloom_stack_estimate(&bf, i), (unsigned long long)bf.stacks[i].expected,
+					bloom_stack_fill(&bf, i) * 100);
+		}
+		fprintf(stderr, "estimated false positive rate: %.3g\n", bloom_fpr(&bf));
+	}
+
+	printf("%.0f\n", bloom_estimate(&bf));
+	bloom_destroy(&bf);
+
+	return EXIT_SUCCESS;
+}
+
+// Whether path is a filter written by -w rather than a list of lines
+bool is_filter_file(const char *path) {
+	char magic[sizeof(BLOOM_MAGIC) - 1];
+	int  fd = open(path, O_RDONLY);
+	bool is_filter;
+
+	if (fd == -1) {
+		return false;
+	}
+
+	is_filter = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+		memcmp(magic, BLOOM_MAGIC, sizeof(magic)) == 0;
+	close(fd);
+
+	return is_filter;
+}
+
+// Load the cached filter of a file given with -x or -i, catching it up with
+// lines appended since. Without a usable cache the filter is built from the
+// file, and saved for later runs unless no_cache is set. The file's own
+// runs take it from there; filters loaded here keep no sidecar.
+bool load_listed_filter(const char *arg, const key_spec *key, bloomfilter *bf, const size_t initial_size, const size_t max_stacks,
+                        const bloom_layout_t layout, const bloom_backend_t backend, const bloom_hash_t hash,
+                        const size_t jobs, const bool no_cache, const bool verbose, stats *st) {
+	char          path[PATH_MAX * 2];
+	char          cache_path[PATH_MAX] = {0};
+	bloom_error_t error = BF_FOPEN;
+
+	if (!resolve_path(arg, path, sizeof(path))) {
+		return false;
+	}
+
+	if (is_filter_file(path)) {
+		return bloom_load(bf, path, NULL) == BF_SUCCESS;
+	}
+
+	if (get_key_cache_path(path, key, cache_path, sizeof(cache_path)) == 0) {
+		error = bloom_load(bf, cache_path, path);
+	}
+
+	if (error == BF_GROWN) {
+		bf->key = key;
+		st->bytes_hashed += file_size(path) - bf->target_size;
+		if (bloom_populate_from_offset(bf, path, bf->target_size)) {
+			return true;
+		}
+		bloom_destroy(bf);
+	}
+
+	if (error == BF_SUCCESS) {
+		return true;
+	}
+
+	if (verbose && error == BF_FOPEN) {
+		fprintf(stderr, "Building filter of %s...\n", path);
+	} else if (verbose) {
+		fprintf(stderr, "Failed to load cached filter of %s (%s). Rebuilding...\n", path, bloom_strerror(error));
+	}
+
+	if (bloom_init(bf, rebuild_expected(path, cache_path, initial_size), 0.0001f, max_stacks,
+	               layout, backend, hash) != BF_SUCCESS) {
+		return false;
+	}
+	bf->key = key;
+
+	st->bytes_hashed += file_size(path);
+	if (!parallel_populate(bf, path, jobs)) {
+		bloom_destroy(bf);
+		return false;
+	}
+
+	if (!no_cache && cache_path[0] != '\0' && check_cache_dir() == 0 &&
+		(bloom_set_target(bf, path) != BF_SUCCESS || bloom_save(bf, cache_path) != BF_SUCCESS)) {
+		fprintf(stderr, "Failed to save cache filter to %s: %s\n", cache_path, strerror(errno));
+	}
+
+	return true;
+}
+
+// Load the filters of the files given with -x or -i into set.
+bool setup_filterset(filterset *set, const char **files, const size_t count, const key_spec *key, const size_t initial_size,
+                     const size_t max_stacks, const bloom_layout_t layout, const bloom_backend_t backend,
+                     const bloom_hash_t hash, const size_t jobs, const bool no_cache, const bool verbose, stats *st) {
+	for (size_t i = 0; i < count; i++) {
+		bloomfilter bf;
+
+		if (!load_listed_filter(files[i], key, &bf, initial_size, max_stacks, layout, backend, hash, jobs,
+		                        no_cache, verbose, st)) {
+			fprintf(stderr, "Failed to load filter of %s: %s\n", files[i], strerror(errno));
+			return false;
+		}
+
+		if (!filterset_add(set, &bf)) {
+			fprintf(stderr, "Failed to add filter of %s\n", files[i]);
+			bloom_destroy(&bf);
+			return false;
+		}
+	}
+
+	if (verbose && count > 0) {
+		fprintf(stderr, "%s lines of %zu files with %zu filters\n",
+				set->op == BF_COMBINE_UNION ? "Excluding" : "Requiring", set->files, set->count);
+	}
+
+	return true;
+}
+
+// Combine the filters of files into one with op and save it to out. It
+// covers no one target file, so it is only used where -x or -i name it.
+// A file whose filter does not line up with the others is read into a
+// union line by line instead; an intersection of such filters fails.
+int write_combined(const char *out, const char **files, const size_t count, const bloom_combine_t op,
+                   const key_spec *key, const size_t initial_size, const size_t max_stacks,
+                   const bloom_layout_t layout, const bloom_backend_t backend, const bloom_hash_t hash,
+                   const size_t jobs, const bool no_cache, const bool verbose, stats *st) {
+	bloomfilter   combined;
+	bloom_error_t error;
+
+	if (!load_listed_filter(files[0], key, &combined, initial_size, max_stacks, layout, backend, hash, jobs,
+	                        no_cache, verbose, st)) {
+		fprintf(stderr, "Failed to load filter of %s: %s\n", files[0], strerror(errno));
+		return EXIT_FAILURE;
+	}
+	combined.key = key;
+
+	for (size_t i = 1; i < count; i++) {
+		bloomfilter bf;
+		char        path[PATH_MAX * 2];
+
+		if (!load_listed_filter(files[i], key, &bf, initial_size, max_stacks, layout, backend, hash, jobs,
+		                        no_cache, verbose, st)) {
+			fprintf(stderr, "Failed to load filter of %s: %s\n", files[i], strerror(errno));
+			bloom_destroy(&combined);
+			return EXIT_FAILURE;
+		}
+
+		error = bloom_combine(&combined, &bf, op);
+		bloom_destroy(&bf);
+
+		if (error == BF_INCOMPATIBLE && op == BF_COMBINE_UNION && resolve_path(files[i], path, sizeof(path)) &&
+			!is_filter_file(path)) {
+			if (verbose) {
+				fprintf(stderr, "Filter of %s does not line up. Adding its lines...\n", path);
+			}
+
+			st->bytes_hashed += file_size(path);
+			error = parallel_populate(&combined, path, jobs) ? BF_SUCCESS : BF_FREAD;
+		}
+
+		if (error != BF_SUCCESS) {
+			fprintf(stderr, "Failed to combine filter of %s: %s\n", files[i], bloom_strerror(error));
+			bloom_destroy(&combined);
+			return EXIT_FAILURE;
+		}
+	}
+
+	combined.ino          = 0;
+	combined.dev          = 0;
+	combined.mtime        = 0;
+	combined.target_size  = 0;
+	combined.tail_hash    = 0;
+	combined.fingerprints = BLOOM_NO_FINGERPRINTS;
+
+	error = bloom_save(&combined, out);
+	if (error != BF_SUCCESS) {
+		fprintf(stderr, "Failed to write combined filter to %s: %s\n", out, bloom_strerror(error));
+		bloom_destroy(&combined);
+		return EXIT_FAILURE;
+	}
+
+	if (verbose || bloom_fpr(&combined) > combined.accuracy) {
+		fprintf(stderr, "Wrote the %s of %zu filters to %s: about %.0f lines, false positive rate %.3g\n",
+				op == BF_COMBINE_UNION ? "union" : "intersection", count, out,
+				bloom_estimate(&combined), bloom_fpr(&combined));
+	}
+
+	bloom_destroy(&combined);
+
+	return EXIT_SUCCESS;
+}
+
+// Keep the lines of a batch whose match flag equals keep, along with their
+// keys, in order. keys may be the lines themselves. Returns how many are
+// left.
+size_t keep_lines(const char **lines, size_t *lens, const char **keys, size_t *key_lens,
+                  const size_t n, const bool *match, const bool keep) {
+	size_t kept = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		if (match[i] == keep) {
+			lines[kept]    = lines[i];
+			lens[kept]     = lens[i];
+			keys[kept]     = keys[i];
+			key_lens[kept] = key_lens[i];
+			kept++;
+		}
+	}
+
+	return kept;
+}
+
+// Drop the lines of a batch that -x or -i rule out, along with their keys.
+// match is room for n flags. Returns false if out of memory.
+bool filter_lines(filterset *exclude, filterset *require, const char **lines, size_t *lens,
+                  const char **keys, size_t *key_lens, size_t *n, bool *match) {
+	filterset *sets[2] = { exclude, require };
+
+	for (size_t s = 0; s < 2; s++) {
+		if (sets[s]->files == 0) {
+			continue;
+		}
+
+		if (!filterset_match_batch(sets[s], keys, key_lens, *n, match)) {
+			return false;
+		}
+
+		*n = keep_lines(lines, lens, keys, key_lens, *n, match, sets[s] == require);
+	}
+
+	return true;
+}
+
+// Fill in what the filter or table looks like at exit and print the stats.
+void report_stats(stats *st, const bloomfilter *bf, const exact *ex, const sharded *sh, const bool json) {
+	if (sh) {
+		size_t loaded = 0;
+
+		// a key sees one shard, so the shards it may land in are averaged
+		st->filter_stacks = st->memory = 0;
+		st->fill = st->fpr = 0.0;
+		for (size_t i = 0; i < sh->count; i++) {
+			if (sh->state[i] == SHARD_CLEAN || sh->state[i] == SHARD_DIRTY) {
+				const bloomfilter *f = &sh->filters[i];
+				double             set = 0.0;
+
+				for (size_t j = 0; j < f->stack_count; j++) {
+					set += bloom_stack_fill(f, j) * f->stacks[j].size;
+				}
+
+				st->filter_stacks += f->stack_count;
+				st->memory += f->bitmap_size;
+				st->fill += f->size ? set / f->size : 0.0;
+				st->fpr += bloom_fpr(f);
+				loaded++;
+			}
+		}
+
+		if (loaded > 0) {
+			st->fill /= loaded;
+			st->fpr /= loaded;
+		}
+	} else if (ex) {
+		st->filter_stacks = 0;
+		st->memory = exact_memory(ex);
+		st->fill = ex->table.capacity ? (double)ex->count / ex->table.capacity : 0.0;
+		st->fpr = 0.0;
+	} else {
+		double set = 0.0;
+
+		for (size_t i = 0; i < bf->stack_count; i++) {
+			set += bloom_stack_fill(bf, i) * bf->stacks[i].size;
+		}
+
+		st->filter_stacks = bf->stack_count;
+		st->memory = bf->bitmap_size;
+		st->fill = bf->size ? set / bf->size : 0.0;
+		st->fpr = bloom_fpr(bf);
 	}
+
+	stats_report(st, stderr, json);
 }
 
 int main(int argc, char *argv[]) {
@@ -144,12 +864,54 @@ int main(int argc, char *argv[]) {
 	bool         verbose = false;
 	bool         stdin_mode = false;
 	bool         no_cache = false;
+	bool         map_cache = false;
+	bool         use_sidecar = true;
+	bool         exact_mode = false;
+	bool         count_only = false;
+	bool         daemon_mode = false;
+	size_t       shards = 0;
+	sharded      sh;
+	bool         show_stats = false;
+	bool         stats_json = false;
+	stats        st;
+	exact        ex;
+	char         exact_path[PATH_MAX + 8] = {0};
+	sidecar      sc;
+	char         sidecar_path[PATH_MAX + 4] = {0};
+	long         jobs = 1;
+	size_t       populate_jobs = parallel_cpu_count();
+	parallel     par;
+	bloom_layout_t layout = BF_LAYOUT_STANDARD;
+	bloom_backend_t backend = BF_BACKEND_BLOOM;
+	bloom_hash_t hash = BF_HASH_MMH3;
 	char         cache_path[PATH_MAX] = {0};
 	bool         have_cache = false;
-	FILE        *out = NULL;
+	writer       out;
+	writer_policy durability = { .sync = WRITER_SYNC_EXIT };
+	bool         written;
 	bloomfilter  bf;
+	const char **exclude_files = malloc(argc * sizeof(char *));
+	const char **require_files = malloc(argc * sizeof(char *));
+	size_t       exclude_count = 0;
+	size_t       require_count = 0;
+	filterset    exclude;
+	filterset    require;
+	key_spec     key = { .kind = KEY_LINE, .delim = KEY_DEFAULT_DELIM };
+	const key_spec *keyed = NULL;
+	bool         delim_given = false;
+	long         threshold = 0;
+	size_t       sketch_size = 0;
+	double       sketch_warned = 0.0;  // error the last warning gave
+	sketch       sk;
+	char         sketch_path[PATH_MAX + 8] = {0};
+	const char  *combine_path = NULL;
+
+	if (exclude_files == NULL || require_files == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
+	}
 
-	while ((opt = getopt(argc, argv, "s:m:fvnh")) != -1) {
+	while ((opt = getopt(argc, argv, "s:m:Bb:H:fj:MUy:FeP:t:C:d:k:R:x:i:w:DcSJvnh")) != -1) {
 		switch(opt) {
 		case 's':
 			initial_size = atoi(optarg);
@@ -157,9 +919,114 @@ int main(int argc, char *argv[]) {
 		case 'm':
 			max_stacks = atoi(optarg);
 			break;
+		case 'B':
+			layout = BF_LAYOUT_BLOCKED;
+			break;
+		case 'b':
+			if (!bloom_backend_parse(optarg, &backend)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'H':
+			if (!bloom_hash_parse(optarg, &hash)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
 		case 'f':
 			force_rebuild = true;
 			break;
+		case 'j':
+			jobs = atol(optarg);
+			if (jobs < 0) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			if (jobs == 0) {
+				jobs = parallel_cpu_count();
+			}
+			populate_jobs = jobs;
+			break;
+		case 'M':
+			map_cache = true;
+			break;
+		case 'U':
+			uring_disable();
+			break;
+		case 'y':
+			if (!writer_policy_parse(optarg, &durability)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'F':
+			use_sidecar = false;
+			break;
+		case 'e':
+			exact_mode = true;
+			break;
+		case 'P':
+			shards = atol(optarg);
+			if (shards > SHARD_MAX) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			threshold = atol(optarg);
+			if (threshold < 1 || threshold > SKETCH_MAX) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'C':
+			if (!sketch_size_parse(optarg, &sketch_size)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'd':
+			if (!key_delim_parse(optarg, &key)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			delim_given = true;
+			break;
+		case 'k':
+			if (key.kind != KEY_LINE || !key_field_parse(optarg, &key)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'R':
+			if (key.kind != KEY_LINE || !key_range_parse(optarg, &key)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'w':
+			combine_path = optarg;
+			break;
+		case 'x':
+			exclude_files[exclude_count++] = optarg;
+			break;
+		case 'i':
+			require_files[require_count++] = optarg;
+			break;
+		case 'D':
+			daemon_mode = true;
+			break;
+		case 'c':
+			count_only = true;
+			break;
+		case 'S':
+			show_stats = true;
+			break;
+		case 'J':
+			show_stats = true;
+			stats_json = true;
+			break;
 		case 'v':
 			verbose = true;
 			break;
@@ -173,36 +1040,81 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	// set up output stream and cache file
-	if (optind < argc) {
-		char dirbuf[PATH_MAX];
-		char filebuf[PATH_MAX];
-		char resolved_dir[PATH_MAX];
+	if ((delim_given && key.kind != KEY_FIELD) || (sketch_size > 0 && threshold == 0)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
 
-		snprintf(dirbuf, sizeof(dirbuf), "%s", argv[optind]);
-		snprintf(filebuf, sizeof(filebuf), "%s", argv[optind]);
+	if (key.kind != KEY_LINE) {
+		keyed = &key;
+	}
 
-		char *dir = dirname(dirbuf);
-		char *file = basename(filebuf);
+	if (daemon_mode) {
+		// filters are kept per target file, on the server's terms
+		if (optind < argc || exact_mode || shards > 1 || count_only || no_cache || show_stats ||
+			exclude_count > 0 || require_count > 0 || keyed || threshold > 0 || combine_path) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
 
-		if (!realpath(dir, resolved_dir)) {
+		return run_daemon(initial_size, max_stacks, layout, backend, hash, map_cache, populate_jobs, &durability, verbose);
+	}
+
+	stats_init(&st);
+
+	if (combine_path) {
+		// one set of filters, and nothing to deduplicate
+		if (optind < argc || (exclude_count > 0) == (require_count > 0)) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+
+		return exclude_count > 0 ?
+			write_combined(combine_path, exclude_files, exclude_count, BF_COMBINE_UNION, keyed, initial_size,
+			               max_stacks, layout, backend, hash, populate_jobs, no_cache, verbose, &st) :
+			write_combined(combine_path, require_files, require_count, BF_COMBINE_INTERSECTION, keyed,
+			               initial_size, max_stacks, layout, backend, hash, populate_jobs, no_cache, verbose, &st);
+	}
+
+	// set up output stream and cache file
+	if (optind < argc) {
+		if (!resolve_path(argv[optind], resolved_path, sizeof(resolved_path))) {
 			perror("realpath (directory)");
 			return EXIT_FAILURE;
 		}
 
-		snprintf(resolved_path, sizeof(resolved_path), "%s/%s", resolved_dir, file);
 		filepath = resolved_path;
 	} else {
 		stdin_mode = true;
 	}
 
-	if (!stdin_mode && (out = fopen(filepath, "a")) == NULL) {
-		perror("fopen()");
+	if (count_only) {
+		if (stdin_mode) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+
+		return print_estimate(filepath, keyed, verbose);
+	}
+
+	if (!stdin_mode && optind == 1 && argc == 2) {
+		// with no options, a running server does the work
+		char socket_path[PATH_MAX];
+		int  fd;
+
+		if (get_socket_path(socket_path, sizeof(socket_path)) == 0 && daemon_connect(socket_path, &fd)) {
+			return send_to_daemon(fd, filepath);
+		}
+	}
+
+	if (!stdin_mode && !writer_open(&out, filepath, &durability)) {
+		perror("open()");
 		return EXIT_FAILURE;
 	}
 
-	if (stdin_mode) {
-		out = stdout;
+	if (stdin_mode && !writer_init_fd(&out, STDOUT_FILENO, &durability)) {
+		fprintf(stderr, "Failed to allocate output buffer\n");
+		return EXIT_FAILURE;
 	}
 
 	if (!no_cache && !stdin_mode) {
@@ -210,111 +1122,454 @@ int main(int argc, char *argv[]) {
 			return EXIT_FAILURE;
 		}
 
-		if (get_cache_path(filepath, cache_path, sizeof(cache_path)) == 0) {
-			struct stat st;
-			if (stat(cache_path, &st) == 0) {
+		if (get_key_cache_path(filepath, keyed, cache_path, sizeof(cache_path)) == 0) {
+			struct stat sb;
+			if (stat(cache_path, &sb) == 0) {
 				have_cache = true;
 			}
+			snprintf(sidecar_path, sizeof(sidecar_path), "%s.fp", cache_path);
+			snprintf(exact_path, sizeof(exact_path), "%s.exact", cache_path);
+			snprintf(sketch_path, sizeof(sketch_path), "%s.cms", cache_path);
 		}
 	}
 
+	if (shards > 1 && (exact_mode || backend == BF_BACKEND_FUSE)) {
+		fprintf(stderr, "-P cannot be combined with -e or -b fuse\n");
+		return EXIT_FAILURE;
+	}
+
+	if (stdin_mode || no_cache || shards == 1) {
+		// shards only help a filter that is cached
+		shards = 0;
+	}
+
+	if (exact_mode || shards > 1) {
+		// the exact table and sharded filters are single threaded
+		jobs = 1;
+	}
+
+	if (sidecar_path[0] == '\0') {
+		use_sidecar = false;
+	}
+
 	if (stdin_mode && verbose) {
 		printf("Running in stdin-only dedup mode\n");
 	}
 
 	// initialize or load cached bloom filter
-	if (stdin_mode || no_cache) {
+	if (exact_mode) {
+		if (!setup_exact(&ex, filepath, exact_path, keyed, initial_size, force_rebuild, verbose, &st)) {
+			fprintf(stderr, "Failed to initialize exact table\n");
+			return EXIT_FAILURE;
+		}
+	} else if (shards > 1) {
+		if (!setup_shards(&sh, filepath, cache_path, keyed, shards, initial_size, max_stacks, layout, backend, hash,
+		                  map_cache, force_rebuild, verbose, &st)) {
+			fprintf(stderr, "Failed to initialize sharded filter\n");
+			return EXIT_FAILURE;
+		}
+	} else if (stdin_mode || no_cache) {
 		// stdin/no cach mode: create filter with stack size of 0 (infinite)
 		// TODO consider defaulting to a larger initial_size
-		if (bloom_init(&bf, initial_size, 0.0001f, 0) != BF_SUCCESS) {
+		if (bloom_init(&bf, initial_size, 0.0001f, 0, layout, backend, hash) != BF_SUCCESS) {
 			fprintf(stderr, "Failed to initialize Bloom filter\n");
 			return EXIT_FAILURE;
 		}
+		st.known_stacks = bf.stack_count;
 	} else {
+		st.cache = force_rebuild ? "forced" : have_cache ? "hit" : "miss";
+
 		if (have_cache && !force_rebuild) {
-			if (bloom_load(&bf, cache_path) != BF_SUCCESS) {
+			stats_begin(&st, STATS_LOAD);
+
+			// the filter is only valid for the target file as it was saved
+			bloom_error_t error = map_cache ?
+				bloom_map(&bf, cache_path, filepath) :
+				bloom_load(&bf, cache_path, filepath);
+
+			bf.key = keyed;
+
+			if ((error == BF_SUCCESS || error == BF_GROWN) && use_sidecar) {
+				// the sidecar only helps if it holds every key of the filter
+				if (bf.fingerprints != BLOOM_NO_FINGERPRINTS &&
+					sidecar_open(&sc, sidecar_path, bf.fingerprints, bf.hash)) {
+					bf.sidecar = &sc;
+				} else {
+					unlink(sidecar_path);
+				}
+			}
+
+			if (error == BF_SUCCESS || error == BF_GROWN) {
+				st.known_stacks = bf.stack_count;
+			}
+
+			if (error == BF_GROWN) {
+				// lines were appended by someone else. only hash the new tail
+				if (verbose) {
+					fprintf(stderr, "Target file has grown. Adding lines from offset %llu...\n",
+							(unsigned long long)bf.target_size);
+				}
+
+				st.cache = "grown";
+				st.bytes_hashed += file_size(filepath) - bf.target_size;
+				if (bloom_populate_from_offset(&bf, filepath, bf.target_size)) {
+					error = BF_SUCCESS;
+					stats_stacks(&st, bf.stack_count);
+				} else {
+					close_sidecar(&bf);
+					bloom_destroy(&bf);
+				}
+			}
+
+			if (error != BF_SUCCESS) {
 				if (verbose) {
-					fprintf(stderr, "Failed to load cached filter. Rebuilding...\n");
+					fprintf(stderr, "Failed to load cached filter (%s). Rebuilding...\n",
+							bloom_strerror(error));
 				}
+				st.cache = "invalid";
+				st.reason = bloom_strerror(error);
 				have_cache = false;
 			}
+
+			stats_end(&st);
 		}
 
 		if (!have_cache || force_rebuild) {
-			size_t expected = is_large_file(filepath) ? count_lines(filepath) * 2 : initial_size;
+			stats_begin(&st, STATS_COUNT);
+			size_t expected = rebuild_expected(filepath, cache_path, initial_size);
+			stats_end(&st);
 
-			if (bloom_init(&bf, expected, 0.0001f, max_stacks) != BF_SUCCESS) {
+			if (bloom_init(&bf, expected, 0.0001f, max_stacks, layout, backend, hash) != BF_SUCCESS) {
 				fprintf(stderr, "Failed to initialize Bloom filter\n");
 				return EXIT_FAILURE;
 			}
+			bf.key = keyed;
+
+			if (use_sidecar) {
+				start_sidecar(&bf, &sc, sidecar_path);
+			}
 
-			if (!bloom_populate_from_file(&bf, filepath)) {
+			stats_begin(&st, STATS_POPULATE);
+			st.known_stacks = bf.stack_count;
+			st.bytes_hashed += file_size(filepath);
+			if (!parallel_populate(&bf, filepath, populate_jobs)) {
 				fprintf(stderr, "Failed to populate Bloom filter from file %s: %s\n",
 						filepath, strerror(errno));
 				return EXIT_FAILURE;
 			}
+			stats_stacks(&st, bf.stack_count);
+			stats_end(&st);
 		}
 	}
 
-	// read from stdin, lookup line in filter, add if not seen yet
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t read;
+	// filters of other files that lines are held against first
+	filterset_init(&exclude, BF_COMBINE_UNION);
+	filterset_init(&require, BF_COMBINE_INTERSECTION);
+	stats_begin(&st, STATS_LOAD);
+	if (!setup_filterset(&exclude, exclude_files, exclude_count, keyed, initial_size, max_stacks, layout, backend, hash,
+	                     populate_jobs, no_cache, verbose, &st) ||
+		!setup_filterset(&require, require_files, require_count, keyed, initial_size, max_stacks, layout, backend, hash,
+		                 populate_jobs, no_cache, verbose, &st)) {
+		return EXIT_FAILURE;
+	}
+	stats_end(&st);
+
+	if (threshold > 0 && !setup_sketch(&sk, sketch_path, sketch_size, hash, verbose)) {
+		fprintf(stderr, "Failed to allocate count sketch\n");
+		return EXIT_FAILURE;
+	}
+
+	// read stdin in batches so the filter can overlap the cache misses of
+	// many lines, or spread them over several threads. output order still
+	// follows input order.
+	reader       input;
+	size_t       batch = (jobs > 1) ? PARALLEL_BATCH : LINE_BATCH;
+	const char **lines = malloc(batch * sizeof(char *));
+	size_t      *lens = malloc(batch * sizeof(size_t));
+	bool        *seen = malloc(batch * sizeof(bool));
+	size_t       n;
+
+	// with -k or -R, lines are looked up by their keys: slices of the
+	// lines themselves. the lines are still what is written.
+	const char **keys = keyed ? malloc(batch * sizeof(char *)) : lines;
+	size_t      *key_lens = keyed ? malloc(batch * sizeof(size_t)) : lens;
+
+	if (lines == NULL || lens == NULL || seen == NULL || keys == NULL || key_lens == NULL ||
+		!reader_init_fd(&input, STDIN_FILENO)) {
+		fprintf(stderr, "Failed to allocate input buffer\n");
+		return EXIT_FAILURE;
+	}
 
-	while ((read = getline(&line, &len, stdin)) != -1) {
-		if (read > 0 && line[read - 1] == '\n') {
-			line[read - 1] = '\0';  // strip newline
+	if (jobs > 1 && !parallel_init(&par, jobs)) {
+		fprintf(stderr, "Failed to start %ld worker threads\n", jobs);
+		return EXIT_FAILURE;
+	}
+
+	stats_begin(&st, STATS_STREAM);
+	while ((n = reader_read_lines(&input, lines, lens, (exact_mode || shards > 1) ? batch : parallel_batch_limit(&bf, batch))) > 0) {
+		size_t added = 0;
+
+		if (keyed) {
+			memcpy(keys, lines, n * sizeof(char *));
+			memcpy(key_lens, lens, n * sizeof(size_t));
+			key_extract_batch(keyed, keys, key_lens, n);
 		}
 
-		if (!bloom_lookup_or_add_string(&bf, line)) {
-			if (verbose) {
-				fprintf(stderr, "NEW: %s\n", line);
+		if (exclude.files > 0 || require.files > 0) {
+			size_t read = n;
+
+			if (!filter_lines(&exclude, &require, lines, lens, keys, key_lens, &n, seen)) {
+				fprintf(stderr, "Failed to allocate filter buffer\n");
+				return EXIT_FAILURE;
+			}
+			stats_filtered(&st, read - n);
+		}
+
+		if (threshold > 0) {
+			size_t read = n;
+
+			// lines not seen often enough yet go no further
+			sketch_add_batch(&sk, (const void *const *)keys, key_lens, n, threshold, seen);
+			n = keep_lines(lines, lens, keys, key_lens, n, seen, true);
+			stats_filtered(&st, read - n);
+
+			if (sk.overfull && sketch_warned == 0.0) {
+				warn_overfull(&sk, sketch_path);
+				sketch_warned = sketch_error(&sk);
+			}
+		}
+
+		if (exact_mode) {
+			exact_lookup_or_add_batch(&ex, (const void *const *)keys, key_lens, n, seen);
+		} else if (shards > 1) {
+			if (!shard_lookup_or_add_batch(&sh, (const void *const *)keys, key_lens, n, seen)) {
+				fprintf(stderr, "Failed to load a shard of the filter\n");
+				return EXIT_FAILURE;
+			}
+		} else if (jobs > 1) {
+			parallel_lookup_or_add(&par, &bf, keys, key_lens, n, seen);
+		} else {
+			bloom_lookup_or_add_batch(&bf, (const void *const *)keys, key_lens, n, seen);
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			if (!seen[i]) {
+				added++;
+				if (verbose) {
+					fprintf(stderr, "NEW: %.*s\n", (int)lens[i], lines[i]);
+				}
+				writer_add(&out, lines[i], lens[i]);
 			}
-			fprintf(out, "%s\n", line);
 		}
 
-		if (bf.needs_rebuild) {
+		stats_lines(&st, key_lens, n, added);
+		if (!exact_mode && shards <= 1) {
+			stats_stacks(&st, bf.stack_count);
+		}
+
+		if (shards > 1 && shard_needs_rebuild(&sh)) {
+			if (verbose) {
+				fprintf(stderr, "Rebuilding full shards...\n");
+			}
+
+			// lines written so far must be on disk to be part of the new shards
+			stats_begin(&st, STATS_REBUILD);
+			st.rebuilds++;
+			st.bytes_hashed += file_size(filepath);
+			writer_flush(&out);
+			if (!shard_rebuild(&sh)) {
+				fprintf(stderr, "Failed to rebuild shards\n");
+				return EXIT_FAILURE;
+			}
+			stats_end(&st);
+		} else if (!exact_mode && shards <= 1 && bf.needs_rebuild && !stdin_mode) {
 			if (verbose) {
 				fprintf(stderr, "Rebuilding Bloom filter...\n");
 			}
 
+			stats_begin(&st, STATS_REBUILD);
+			st.rebuilds++;
+
 			bloomfilter new_bf;
-			size_t new_expected = bf.expected * bf.max_stacks * 2;
+			size_t distinct = bloom_distinct(&bf);
+			size_t new_expected = bloom_capacity(&bf);
+			new_expected = (distinct > new_expected ? distinct : new_expected) * 2;
 
-			if (bloom_init(&new_bf, new_expected, bf.accuracy, max_stacks) != BF_SUCCESS) {
+			if (bloom_init(&new_bf, new_expected, bf.accuracy, max_stacks, bf.layout, bf.backend, bf.hash) != BF_SUCCESS) {
 				fprintf(stderr, "error: failed to allocate new filter\n");
 				return EXIT_FAILURE;
 			}
+			new_bf.key = bf.key;
 
-			if (!bloom_populate_from_file(&new_bf, filepath)) {
-				fprintf(stderr, "Failed to re-populate new filter\n");
-				return EXIT_FAILURE;
+			// lines written so far must be in the file to be part of the new filter
+			writer_flush(&out);
+			st.known_stacks = new_bf.stack_count;
+
+			if (bf.sidecar && parallel_populate_sidecar(&new_bf, bf.sidecar, populate_jobs)) {
+				// every key is already in the sidecar. keep appending to it
+				new_bf.sidecar = bf.sidecar;
+				bf.sidecar = NULL;
+			} else {
+				if (bf.sidecar) {
+					// the sidecar could not be read. start it over from the text
+					close_sidecar(&bf);
+					unlink(sidecar_path);
+				}
+
+				if (use_sidecar) {
+					start_sidecar(&new_bf, &sc, sidecar_path);
+				}
+
+				st.bytes_hashed += file_size(filepath);
+				if (!parallel_populate(&new_bf, filepath, populate_jobs)) {
+					fprintf(stderr, "Failed to re-populate new filter\n");
+					return EXIT_FAILURE;
+				}
 			}
 
-			update_stat_metadata(&new_bf, filepath);
+			bloom_set_target(&new_bf, filepath);
 			bloom_destroy(&bf);
 			bf = new_bf;
+			stats_stacks(&st, bf.stack_count);
+			stats_end(&st);
+		}
+
+		writer_tick(&out);
+
+		if (stats_progress_requested) {
+			stats_progress(&st, stderr);
 		}
 	}
+	stats_end(&st);
+
+	reader_close(&input);
+	free(lines);
+	free(lens);
+	free(seen);
+	if (keyed) {
+		free(keys);
+		free(key_lens);
+	}
+	filterset_destroy(&exclude);
+	filterset_destroy(&require);
+	free(exclude_files);
+	free(require_files);
+
+	if (jobs > 1) {
+		parallel_destroy(&par);
+	}
+
+	// a cache may only cover lines that made it to the file, and as
+	// durably as the policy asks
+	stats_begin(&st, STATS_SAVE);
+	written = writer_close(&out);
+	stats_end(&st);
+	if (!written) {
+		fprintf(stderr, "Failed to write new lines to %s: %s\n",
+				stdin_mode ? "stdout" : filepath, strerror(out.error));
+		no_cache = true;
+	}
 
-	free(line);
+	if (threshold > 0) {
+		if (verbose) {
+			fprintf(stderr, "Count sketch: %zu counters in %zu bytes, %llu lines counted, "
+					"about %.0f distinct of %zu it is sized for, %.2g of counts overstated\n",
+					sk.counters, sketch_memory(&sk), (unsigned long long)sk.counted,
+					sketch_distinct(&sk), sketch_capacity(&sk), sketch_error(&sk));
+		}
+
+		if (sk.overfull && sketch_error(&sk) > sketch_warned * 2) {
+			// where it ended up, well past the first warning
+			warn_overfull(&sk, sketch_path);
+		}
+
+		if (written && sketch_path[0] != '\0') {
+			stats_begin(&st, STATS_SAVE);
+			if (sketch_save(&sk, sketch_path) != BF_SUCCESS) {
+				fprintf(stderr, "Failed to save count sketch to %s: %s\n",
+						sketch_path, strerror(errno));
+			} else if (verbose) {
+				fprintf(stderr, "Saved count sketch: %s\n", sketch_path);
+			}
+			stats_end(&st);
+		}
+
+		sketch_destroy(&sk);
+	}
+
+	if (shards > 1) {
+		if (written) {
+			stats_begin(&st, STATS_SAVE);
+			bloom_error_t error = shard_save(&sh);
+			if (error != BF_SUCCESS) {
+				fprintf(stderr, "Failed to save sharded filter to %s.shards: %s\n",
+						cache_path, bloom_strerror(error));
+			} else if (verbose) {
+				fprintf(stderr, "Saved sharded filter: %s.shards (%zu of %zu shards read from disk)\n",
+						cache_path, sh.loads, sh.count);
+			}
+			stats_end(&st);
+		}
+
+		if (show_stats) {
+			report_stats(&st, NULL, NULL, &sh, stats_json);
+		}
+
+		shard_destroy(&sh);
+
+		return written ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (exact_mode) {
+		if (verbose) {
+			fprintf(stderr, "Exact table: %zu lines in %zu bytes (%.1f bytes per line)\n",
+					ex.count, exact_memory(&ex), ex.count ? (double)exact_memory(&ex) / ex.count : 0.0);
+		}
+
+		if (!stdin_mode && !no_cache) {
+			stats_begin(&st, STATS_SAVE);
+			if (exact_set_target(&ex, filepath) != BF_SUCCESS ||
+				exact_save(&ex, exact_path) != BF_SUCCESS) {
+				fprintf(stderr, "Failed to save exact table to %s: %s\n",
+						exact_path, strerror(errno));
+			} else if (verbose) {
+				fprintf(stderr, "Saved exact table: %s\n", exact_path);
+			}
+			stats_end(&st);
+		}
+
+		if (show_stats) {
+			report_stats(&st, NULL, &ex, NULL, stats_json);
+		}
+
+		exact_destroy(&ex);
+
+		return written ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
 
 	// save filter for caching purposes, cleanup
 	if (!stdin_mode && !no_cache) {
-        fflush(out);
-		fsync(fileno(out));
-		update_stat_metadata(&bf, filepath);
-
-		if (bloom_save(&bf, cache_path) != BF_SUCCESS) {
+		stats_begin(&st, STATS_SAVE);
+		if (bf.sidecar) {
+			// the header may only count records that made it to the sidecar
+			sidecar_flush(bf.sidecar);
+		}
+		if (bloom_set_target(&bf, filepath) != BF_SUCCESS ||
+			bloom_save(&bf, cache_path) != BF_SUCCESS) {
 			fprintf(stderr, "Failed to save cache filter to %s: %s\n",
 					cache_path, strerror(errno));
 		} else if (verbose) {
 			fprintf(stderr, "Saved Bloom filter cache: %s\n", cache_path);
 		}
+		stats_end(&st);
 	}
 
-	fclose(out);
+	if (show_stats) {
+		report_stats(&st, &bf, NULL, NULL, stats_json);
+	}
+
+	close_sidecar(&bf);
 	bloom_destroy(&bf);
 
-	return EXIT_SUCCESS;
+	return written ? EXIT_SUCCESS : EXIT_FAILURE;
 }
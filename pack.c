@@ -0,0 +1,421 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "pack.h"
+#include "parallel.h"
+#include "popcount.h"
+#include "uring.h"
+#include "wyhash.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// A chunk is kept sparse only if it takes at most half its raw size. Each
+// set bit costs at least a byte of gap, so that needs fewer set bits than
+// half its bytes: fewer than one in 16 of its bits. Only such chunks are
+// tried as sparse.
+#define PACK_SPARSE_BITS  16
+#define PACK_SPARSE_LIMIT 2
+
+typedef struct {
+	pack_chunk     *chunks;
+	uint8_t       **payloads;  // sparse chunks: their encoding
+	uint8_t        *bitmap;
+	size_t          size;
+	size_t          count;
+	const uint8_t  *stored;    // pack_read: what was stored for non-raw chunks
+	size_t         *stored_at; // pack_read: where in stored each one starts
+	bool            failed;
+} pack_job;
+
+size_t pack_chunk_count(const size_t size) {
+	return (size + PACK_CHUNK_SIZE - 1) / PACK_CHUNK_SIZE;
+}
+
+static size_t chunk_length(const size_t size, const size_t i) {
+	size_t start = i * PACK_CHUNK_SIZE;
+
+	return size - start < PACK_CHUNK_SIZE ? size - start : PACK_CHUNK_SIZE;
+}
+
+// bytes a word can take to encode: one gap of up to 10 bytes, the other
+// 63 under 64 bits apart
+#define PACK_WORD_MAX (10 + 63)
+
+static inline uint8_t *put_gap(uint8_t *out, uint64_t gap) {
+	while (gap > 0x7f) {
+		*out++ = (gap & 0x7f) | 0x80;
+		gap >>= 7;
+	}
+	*out++ = gap;
+
+	return out;
+}
+
+// Encode the positions of the bits set in data as LEB128 gaps from the one
+// before. Returns the length written, or 0 if it could exceed limit.
+static size_t sparse_encode(const uint8_t *data, const size_t len, uint8_t *out, const size_t limit) {
+	uint8_t  *at = out;
+	uint8_t  *end = out + limit;
+	uint64_t  next = 0;   // position the next gap counts from
+	size_t    i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		uint64_t word;
+
+		memcpy(&word, data + i, 8);
+		if (word == 0) {
+			continue;
+		}
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		word = __builtin_bswap64(word);
+#endif
+
+		if (end - at < PACK_WORD_MAX) {
+			return 0;
+		}
+
+		do {
+			uint64_t pos = (uint64_t)i * 8 + __builtin_ctzll(word);
+
+			at = put_gap(at, pos - next);
+			next = pos + 1;
+			word &= word - 1;
+		} while (word);
+	}
+
+	for (; i < len; i++) {
+		unsigned byte = data[i];
+
+		if (byte && end - at < PACK_WORD_MAX) {
+			return 0;
+		}
+
+		while (byte) {
+			uint64_t pos = (uint64_t)i * 8 + __builtin_ctz(byte);
+
+			at = put_gap(at, pos - next);
+			next = pos + 1;
+			byte &= byte - 1;
+		}
+	}
+
+	return at - out;
+}
+
+static bool sparse_decode(const uint8_t *in, const size_t in_len, uint8_t *data, const size_t len) {
+	const uint64_t  bits = (uint64_t)len * 8;
+	uint64_t        pos = 0;
+	size_t          used = 0;
+
+	memset(data, 0, len);
+	while (used < in_len) {
+		uint64_t gap = in[used++];
+
+		if (gap & 0x80) {
+			unsigned shift = 7;
+			uint8_t  b;
+
+			gap &= 0x7f;
+			do {
+				if (used == in_len || shift > 56) {
+					return false;
+				}
+				b = in[used++];
+				gap |= (uint64_t)(b & 0x7f) << shift;
+				shift += 7;
+			} while (b & 0x80);
+		}
+
+		pos += gap;
+		if (pos >= bits) {
+			return false;
+		}
+		data[pos / 8] |= 1 << (pos % 8);
+		pos++;
+	}
+
+	return true;
+}
+
+static void pack_worker(void *arg, const size_t worker, const size_t count) {
+	pack_job *job = arg;
+
+	for (size_t i = worker; i < job->count; i += count) {
+		pack_chunk    *c = &job->chunks[i];
+		size_t         len = chunk_length(job->size, i);
+		const uint8_t *data = job->bitmap + i * PACK_CHUNK_SIZE;
+		uint64_t       bits = popcount_bytes(data, len);
+
+		c->method = PACK_RAW;
+		c->length = len;
+
+		if (bits == 0) {
+			c->method = PACK_ZERO;
+			c->length = 0;
+			c->checksum = 0;
+			continue;
+		}
+
+		if (bits < (uint64_t)len * 8 / PACK_SPARSE_BITS) {
+			uint8_t *out = malloc(len / PACK_SPARSE_LIMIT);
+			size_t   used = out ? sparse_encode(data, len, out, len / PACK_SPARSE_LIMIT) : 0;
+
+			if (used > 0) {
+				job->payloads[i] = out;
+				c->method = PACK_SPARSE;
+				c->length = used;
+				data = out;
+			} else {
+				free(out);
+			}
+		}
+
+		c->checksum = wyhash(data, c->length, PACK_SEED);
+	}
+}
+
+// write every byte of iov at offset
+static bool write_iov(const int fd, struct iovec *iov, int count, off_t offset) {
+	if (count == 1) {
+		// one long run of raw chunks. let io_uring keep several writes in flight
+		return uring_pwrite_all(fd, iov->iov_base, iov->iov_len, offset);
+	}
+
+	while (count > 0) {
+		ssize_t put = pwritev(fd, iov, count, offset);
+
+		if (put == -1 && errno == EINTR) {
+			continue;
+		}
+		if (put <= 0) {
+			return false;
+		}
+
+		offset += put;
+		while (count > 0 && (size_t)put >= iov->iov_len) {
+			put -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + put;
+			iov->iov_len -= put;
+		}
+	}
+
+	return true;
+}
+
+// Pack bitmap and write it at offset: the directory, then what is stored
+// for each chunk, in order. dir_checksum receives the checksum of the
+// directory, which the caller keeps in its header.
+bool pack_write(const int fd, const off_t offset, const uint8_t *bitmap, const size_t size, uint64_t *dir_checksum) {
+	size_t        count = pack_chunk_count(size);
+	size_t        dir_size = count * sizeof(pack_chunk);
+	size_t        jobs = parallel_cpu_count();
+	pack_job      job = {0};
+	pool          p;
+	struct iovec  iov[IOV_MAX];
+	int           n = 0;
+	off_t         at = offset + dir_size;
+	off_t         run_at = at;
+	bool          ok = true;
+
+	job.chunks   = calloc(count, sizeof(pack_chunk));
+	job.payloads = calloc(count, sizeof(uint8_t *));
+	job.bitmap   = (uint8_t *)bitmap;
+	job.size     = size;
+	job.count    = count;
+
+	if (job.chunks == NULL || job.payloads == NULL || !pool_init(&p, jobs < count ? jobs : count)) {
+		free(job.chunks);
+		free(job.payloads);
+		return false;
+	}
+
+	pool_run(&p, pack_worker, &job);
+	pool_destroy(&p);
+
+	for (size_t i = 0; i < count; i++) {
+		job.chunks[i].offset = at;
+		at += job.chunks[i].length;
+	}
+	*dir_checksum = wyhash(job.chunks, dir_size, PACK_SEED);
+
+	ok = uring_pwrite_all(fd, job.chunks, dir_size, offset);
+
+	// raw chunks are adjacent in the bitmap as well as in the file, so a run
+	// of them goes out as one piece
+	for (size_t i = 0; ok && i < count; i++) {
+		pack_chunk *c = &job.chunks[i];
+		uint8_t    *data = job.payloads[i] ? job.payloads[i] : job.bitmap + i * PACK_CHUNK_SIZE;
+
+		if (c->length == 0) {
+			continue;
+		}
+
+		if (n > 0 && c->method == PACK_RAW && job.chunks[i - 1].method == PACK_RAW &&
+			(uint8_t *)iov[n - 1].iov_base + iov[n - 1].iov_len == data) {
+			iov[n - 1].iov_len += c->length;
+			continue;
+		}
+
+		if (n == IOV_MAX) {
+			ok = write_iov(fd, iov, n, run_at);
+			run_at = c->offset;
+			n = 0;
+		}
+
+		iov[n].iov_base = data;
+		iov[n].iov_len  = c->length;
+		n++;
+	}
+
+	if (ok && n > 0) {
+		ok = write_iov(fd, iov, n, run_at);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		free(job.payloads[i]);
+	}
+	free(job.payloads);
+	free(job.chunks);
+
+	return ok;
+}
+
+static void unpack_worker(void *arg, const size_t worker, const size_t count) {
+	pack_job *job = arg;
+
+	for (size_t i = worker; i < job->count && !job->failed; i += count) {
+		pack_chunk    *c = &job->chunks[i];
+		size_t         len = chunk_length(job->size, i);
+		uint8_t       *data = job->bitmap + i * PACK_CHUNK_SIZE;
+		const uint8_t *stored = c->method == PACK_RAW ? data : job->stored + job->stored_at[i];
+		bool           ok;
+
+		switch (c->method) {
+		case PACK_ZERO:
+			memset(data, 0, len);
+			ok = c->checksum == 0;
+			break;
+		case PACK_SPARSE:
+			ok = wyhash(stored, c->length, PACK_SEED) == c->checksum &&
+				sparse_decode(stored, c->length, data, len);
+			break;
+		default:
+			ok = wyhash(stored, c->length, PACK_SEED) == c->checksum;
+			break;
+		}
+
+		if (!ok) {
+			__atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+// Read a bitmap written by pack_write at offset into bitmap. Fails if the
+// directory does not describe a file of file_size bytes, or if any chunk
+// does not match its checksum.
+bool pack_read(const int fd, const off_t offset, const off_t file_size, uint8_t *bitmap, const size_t size, const uint64_t dir_checksum) {
+	size_t    count = pack_chunk_count(size);
+	size_t    dir_size = count * sizeof(pack_chunk);
+	size_t    jobs = parallel_cpu_count();
+	size_t    stored_size = 0;
+	uint8_t  *stored = NULL;
+	off_t     at = offset + dir_size;
+	pack_job  job = {0};
+	pool      p;
+	bool      ok = true;
+
+	job.chunks    = malloc(dir_size);
+	job.stored_at = calloc(count, sizeof(size_t));
+	job.bitmap    = bitmap;
+	job.size      = size;
+	job.count     = count;
+
+	if (job.chunks == NULL || job.stored_at == NULL ||
+		!uring_pread_all(fd, job.chunks, dir_size, offset) ||
+		wyhash(job.chunks, dir_size, PACK_SEED) != dir_checksum) {
+		ok = false;
+		goto out;
+	}
+
+	// the chunks must follow each other with nothing in between
+	for (size_t i = 0; i < count; i++) {
+		pack_chunk *c = &job.chunks[i];
+		size_t      len = chunk_length(size, i);
+
+		if (c->offset != (uint64_t)at || c->method > PACK_SPARSE ||
+			(c->method == PACK_RAW && c->length != len) ||
+			(c->method == PACK_ZERO && c->length != 0) ||
+			(c->method == PACK_SPARSE && (c->length == 0 || c->length > len))) {
+			ok = false;
+			goto out;
+		}
+
+		if (c->method != PACK_RAW) {
+			job.stored_at[i] = stored_size;
+			stored_size += c->length;
+		}
+		at += c->length;
+	}
+
+	if (at != file_size) {
+		ok = false;
+		goto out;
+	}
+
+	if (stored_size > 0) {
+		stored = malloc(stored_size);
+		if (stored == NULL) {
+			ok = false;
+			goto out;
+		}
+	}
+	job.stored = stored;
+
+	// raw chunks are read straight into place, a run of them at a time, and
+	// runs of the others into stored
+	for (size_t i = 0; ok && i < count; ) {
+		bool    raw = job.chunks[i].method == PACK_RAW;
+		size_t  j = i;
+		size_t  len = 0;
+
+		while (j < count && (job.chunks[j].method == PACK_RAW) == raw) {
+			len += job.chunks[j].length;
+			j++;
+		}
+
+		if (len > 0) {
+			ok = uring_pread_all(fd, raw ? bitmap + i * PACK_CHUNK_SIZE : stored + job.stored_at[i],
+				len, job.chunks[i].offset);
+		}
+		i = j;
+	}
+
+	if (ok) {
+		if (!pool_init(&p, jobs < count ? jobs : count)) {
+			ok = false;
+			goto out;
+		}
+		pool_run(&p, unpack_worker, &job);
+		pool_destroy(&p);
+		ok = !job.failed;
+	}
+
+out:
+	free(stored);
+	free(job.stored_at);
+	free(job.chunks);
+
+	return ok;
+}
@@ -0,0 +1,36 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// A bitmap stored as independent PACK_CHUNK_SIZE chunks behind a
+// directory, each with a checksum of what is stored for it. A chunk with
+// no bits set stores nothing, a sparse one stores the gaps between its set
+// bits as varints, and the rest are stored raw: the bits of a filter that
+// is filling up are too random for a general purpose compressor to find
+// anything in. Chunks are packed and unpacked on all CPUs.
+#define PACK_CHUNK_SIZE  (1024 * 1024)
+#define PACK_SEED        0x7061636b63686b73ULL
+
+typedef enum {
+	PACK_RAW = 0,
+	PACK_ZERO,
+	PACK_SPARSE
+} pack_method;
+
+// one directory entry, as stored
+typedef struct {
+	uint64_t  offset;     // in the file
+	uint32_t  length;     // bytes stored
+	uint32_t  method;     // pack_method
+	uint64_t  checksum;   // wyhash of the bytes stored
+} pack_chunk;
+
+size_t  pack_chunk_count(const size_t);
+bool    pack_write(const int, const off_t, const uint8_t *, const size_t, uint64_t *);
+bool    pack_read(const int, const off_t, const off_t, uint8_t *, const size_t, const uint64_t);
+
+#endif /* PACK_H */
@@ -0,0 +1,532 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bloom.h"
+#include "reader.h"
+#include "parallel.h"
+
+// lines each populate worker hashes and prefetches before setting their bits
+#define POPULATE_GROUP 32
+
+typedef struct {
+	pool   *p;
+	size_t  index;
+} pool_worker;
+
+static void *pool_thread(void *arg) {
+	pool_worker *w = arg;
+	pool        *p = w->p;
+	size_t       index = w->index;
+	uint64_t     seen = 0;
+
+	free(w);
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->stop && p->generation == seen) {
+			pthread_cond_wait(&p->start, &p->lock);
+		}
+
+		if (p->stop) {
+			break;
+		}
+
+		seen = p->generation;
+		pool_fn fn = p->fn;
+		void *fn_arg = p->arg;
+		pthread_mutex_unlock(&p->lock);
+
+		fn(fn_arg, index, p->count);
+
+		pthread_mutex_lock(&p->lock);
+		if (--p->pending == 0) {
+			pthread_cond_signal(&p->done);
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+bool pool_init(pool *p, const size_t count) {
+	memset(p, 0, sizeof(pool));
+	p->count = count ? count : 1;
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->start, NULL);
+	pthread_cond_init(&p->done, NULL);
+
+	p->threads = calloc(p->count, sizeof(pthread_t));
+	if (p->threads == NULL) {
+		return false;
+	}
+
+	for (size_t i = 1; i < p->count; i++) {
+		pool_worker *w = malloc(sizeof(pool_worker));
+		if (w == NULL) {
+			p->count = i;
+			pool_destroy(p);
+			return false;
+		}
+
+		w->p = p;
+		w->index = i;
+		if (pthread_create(&p->threads[i], NULL, pool_thread, w) != 0) {
+			free(w);
+			p->count = i;
+			pool_destroy(p);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// run fn(arg, worker, count) on every worker and wait for all of them
+void pool_run(pool *p, pool_fn fn, void *arg) {
+	pthread_mutex_lock(&p->lock);
+	p->fn = fn;
+	p->arg = arg;
+	p->pending = p->count - 1;
+	p->generation++;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->lock);
+
+	fn(arg, 0, p->count);
+
+	pthread_mutex_lock(&p->lock);
+	while (p->pending > 0) {
+		pthread_cond_wait(&p->done, &p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+void pool_destroy(pool *p) {
+	pthread_mutex_lock(&p->lock);
+	p->stop = true;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->lock);
+
+	for (size_t i = 1; i < p->count; i++) {
+		pthread_join(p->threads[i], NULL);
+	}
+
+	free(p->threads);
+	p->threads = NULL;
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->start);
+	pthread_cond_destroy(&p->done);
+}
+
+size_t parallel_cpu_count(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? n : 1;
+}
+
+bool parallel_init(parallel *par, const size_t jobs) {
+	memset(par, 0, sizeof(parallel));
+
+	if (!pool_init(&par->pool, jobs)) {
+		return false;
+	}
+
+	par->added = calloc(par->pool.count, sizeof(size_t));
+	if (par->added == NULL) {
+		pool_destroy(&par->pool);
+		return false;
+	}
+
+	return true;
+}
+
+// hash an even share of the batch and decide which worker owns each line.
+// a line is owned by a worker picked from its own hash, so every copy of
+// the same line is tested and set by the same worker, in input order.
+static void hash_share(void *arg, const size_t worker, const size_t count) {
+	parallel *par = arg;
+	size_t    start = par->n * worker / count;
+	size_t    end = par->n * (worker + 1) / count;
+
+	bloom_hash_batch(par->bf, (const void *const *)par->lines + start, par->lens + start, end - start,
+		(uint64_t (*)[BLOOM_HASH_WORDS])(par->hashes + start * BLOOM_HASH_WORDS));
+
+	for (size_t i = start; i < end; i++) {
+		uint64_t *hash = par->hashes + i * BLOOM_HASH_WORDS;
+
+		par->owner[i] = ((hash[0] * 0x9e3779b97f4a7c15ULL) >> 32) % count;
+	}
+}
+
+static void probe_share(void *arg, const size_t worker, const size_t count) {
+	parallel *par = arg;
+	size_t    added = 0;
+
+	(void)count;
+
+	for (size_t i = 0; i < par->n; i++) {
+		if (par->owner[i] != worker) {
+			continue;
+		}
+
+		par->seen[i] = bloom_lookup_or_set_hashed(par->bf, par->hashes + i * BLOOM_HASH_WORDS);
+		if (!par->seen[i]) {
+			added++;
+		}
+	}
+
+	par->added[worker] = added;
+}
+
+// Look up or add a batch of lines using every worker in the pool. Lines are
+// hashed in parallel, then each worker tests and sets the lines it owns.
+// Two copies of a new line always land on the same worker, so only the
+// first is reported as new, exactly as with bloom_lookup_or_add_batch. The
+// filter only stacks between batches. Cuckoo stacks move fingerprints
+// around as they insert, so filters of other backends are not shared
+// between threads and take the single threaded path.
+size_t parallel_lookup_or_add(parallel *par, bloomfilter *bf, const char **lines, const size_t *lens, const size_t n, bool *seen) {
+	size_t added = 0;
+
+	if (bf->backend != BF_BACKEND_BLOOM) {
+		return bloom_lookup_or_add_batch(bf, (const void *const *)lines, lens, n, seen);
+	}
+
+	if (n > par->capacity) {
+		uint64_t *hashes = realloc(par->hashes, n * BLOOM_HASH_WORDS * sizeof(uint64_t));
+		if (hashes == NULL) {
+			// out of memory. fall back to the single threaded path
+			return bloom_lookup_or_add_batch(bf, (const void *const *)lines, lens, n, seen);
+		}
+
+		par->hashes = hashes;
+
+		uint32_t *owner = realloc(par->owner, n * sizeof(uint32_t));
+		if (owner == NULL) {
+			return bloom_lookup_or_add_batch(bf, (const void *const *)lines, lens, n, seen);
+		}
+
+		par->owner = owner;
+		par->capacity = n;
+	}
+
+	par->bf = bf;
+	par->lines = lines;
+	par->lens = lens;
+	par->n = n;
+	par->seen = seen;
+
+	pool_run(&par->pool, hash_share, par);
+	pool_run(&par->pool, probe_share, par);
+
+	for (size_t i = 0; i < par->pool.count; i++) {
+		added += par->added[i];
+	}
+
+	// recorded here rather than by the workers so the sidecar keeps input order
+	if (bf->sidecar) {
+		for (size_t i = 0; i < n; i++) {
+			if (!seen[i]) {
+				sidecar_add(bf->sidecar, par->hashes + i * BLOOM_HASH_WORDS);
+			}
+		}
+	}
+
+	bloom_count_inserts(bf, added);
+
+	return added;
+}
+
+void parallel_destroy(parallel *par) {
+	pool_destroy(&par->pool);
+	free(par->hashes);
+	free(par->owner);
+	free(par->added);
+}
+
+// Keys the next round of a parallel populate may insert. Threads never
+// stack the filter, so a round only takes what the last stack has room
+// for before it is checked again, and at least an eighth of the stack so
+// rounds stay large enough to be worth spreading over threads.
+static size_t round_keys(const bloomfilter *bf) {
+	size_t expected = bf->stacks[bf->stack_count - 1].expected;
+	size_t least = expected / 8 ? expected / 8 : 1;
+
+	if (bf->insert_count + least >= expected) {
+		return least;
+	}
+
+	return expected - bf->insert_count;
+}
+
+typedef struct {
+	bloomfilter *bf;
+	const char  *data;     // of the current round
+	size_t       size;
+	size_t      *added;
+	size_t      *lines;    // read by each worker
+} populate_job;
+
+// start of the range a worker populates: the first line that begins at or
+// after its even share of the file.
+static size_t range_start(const populate_job *job, const size_t worker, const size_t count) {
+	size_t      pos = job->size * worker / count;
+	const char *nl;
+
+	if (pos == 0 || job->data[pos - 1] == '\n') {
+		return pos;
+	}
+
+	nl = memchr(job->data + pos, '\n', job->size - pos);
+	return nl ? (size_t)(nl - job->data) + 1 : job->size;
+}
+
+static void populate_range(void *arg, const size_t worker, const size_t count) {
+	populate_job *job = arg;
+	bloomfilter  *bf = job->bf;
+	size_t        start = range_start(job, worker, count);
+	size_t        end = range_start(job, worker + 1, count);
+	uint64_t      hashes[POPULATE_GROUP][BLOOM_HASH_WORDS];
+	const char   *lines[POPULATE_GROUP];
+	size_t        lens[POPULATE_GROUP];
+	size_t        added = 0;
+	size_t        read = 0;
+	size_t        n;
+	reader        r;
+
+	reader_init_buffer(&r, job->data + start, end > start ? end - start : 0);
+	r.key = bf->key;
+
+	while ((n = reader_read_lines(&r, lines, lens, POPULATE_GROUP)) > 0) {
+		read += n;
+		bloom_hash_batch(bf, (const void *const *)lines, lens, n, hashes);
+		for (size_t i = 0; i < n; i++) {
+			bloom_prefetch(bf, hashes[i]);
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			if (!bloom_lookup_or_set_hashed(bf, hashes[i])) {
+				added++;
+			}
+		}
+
+		// every line, as in bloom_populate_from_offset
+		if (bf->sidecar) {
+			sidecar_append(bf->sidecar, (const uint64_t (*)[SIDECAR_WORDS])hashes, n);
+		}
+	}
+
+	reader_close(&r);
+	job->added[worker] = added;
+	job->lines[worker] = read;
+}
+
+// Populate a filter from a file using jobs threads. The file is mapped and
+// taken in rounds, each cut into one newline aligned range per thread.
+// Within a round threads never wait on each other; bits are set with
+// atomic ORs, and the new keys are counted between rounds, where the
+// filter stacks as bloom_populate_from_file would. A round holds about as
+// many lines as the last stack has room for, going by the line length
+// seen so far.
+bool parallel_populate(bloomfilter *bf, const char *filepath, const size_t jobs) {
+	populate_job  job = { .bf = bf };
+	pool          p;
+	struct stat   st;
+	const char   *data;
+	size_t        done = 0;
+	size_t        lines_done = 0;
+	int           fd;
+
+	if (jobs <= 1 || bf->backend != BF_BACKEND_BLOOM) {
+		return bloom_populate_from_file(bf, filepath);
+	}
+
+	fd = open(filepath, O_RDONLY);
+	if (fd == -1) {
+		perror("open");
+		return false;
+	}
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		close(fd);
+		return bloom_populate_from_file(bf, filepath);
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return bloom_populate_from_file(bf, filepath);
+	}
+
+	madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+	job.added = calloc(jobs, sizeof(size_t));
+	job.lines = calloc(jobs, sizeof(size_t));
+
+	if (job.added == NULL || job.lines == NULL || !pool_init(&p, jobs)) {
+		free(job.added);
+		free(job.lines);
+		munmap((void *)data, st.st_size);
+		return bloom_populate_from_file(bf, filepath);
+	}
+
+	while (done < (size_t)st.st_size) {
+		size_t      left = st.st_size - done;
+		size_t      line_size;
+		size_t      size;
+		size_t      added = 0;
+		const char *nl;
+
+		if (lines_done > 0) {
+			line_size = done / lines_done;
+		} else {
+			// the first round goes by the lines of its first 64 KB
+			size_t sample = left < 65536 ? left : 65536;
+			size_t count = 0;
+
+			for (nl = data; (nl = memchr(nl, '\n', data + sample - nl)) != NULL; nl++) {
+				count++;
+			}
+			line_size = count ? sample / count : sample;
+		}
+
+		size = round_keys(bf) * (line_size ? line_size : 1);
+		if (size < left) {
+			nl = memchr(data + done + size, '\n', left - size);
+			size = nl ? (size_t)(nl - (data + done)) + 1 : left;
+		} else {
+			size = left;
+		}
+
+		job.data = data + done;
+		job.size = size;
+		pool_run(&p, populate_range, &job);
+
+		for (size_t i = 0; i < p.count; i++) {
+			added += job.added[i];
+			lines_done += job.lines[i];
+		}
+		bloom_count_inserts(bf, added);
+		done += size;
+	}
+
+	pool_destroy(&p);
+	free(job.added);
+	free(job.lines);
+	munmap((void *)data, st.st_size);
+
+	return true;
+}
+
+typedef struct {
+	bloomfilter            *bf;
+	const uint64_t        (*hashes)[BLOOM_HASH_WORDS];  // of the current round
+	size_t                  count;
+	size_t                 *added;
+} sidecar_job;
+
+static void sidecar_range(void *arg, const size_t worker, const size_t count) {
+	sidecar_job  *job = arg;
+	size_t        start = job->count * worker / count;
+	size_t        end = job->count * (worker + 1) / count;
+	size_t        added = 0;
+
+	for (size_t i = start; i < end; i += POPULATE_GROUP) {
+		size_t group = (end - i < POPULATE_GROUP) ? end - i : POPULATE_GROUP;
+
+		for (size_t j = 0; j < group; j++) {
+			bloom_prefetch(job->bf, job->hashes[i + j]);
+		}
+
+		for (size_t j = 0; j < group; j++) {
+			if (!bloom_lookup_or_set_hashed(job->bf, job->hashes[i + j])) {
+				added++;
+			}
+		}
+	}
+
+	job->added[worker] = added;
+}
+
+// Populate a filter from the records of a sidecar instead of the text of
+// its target file. Records are fixed width, so they are cut into even
+// ranges with no scanning for newlines and nothing is hashed. The filter
+// must not have the same sidecar attached; its keys are already there.
+bool parallel_populate_sidecar(bloomfilter *bf, sidecar *sc, const size_t jobs) {
+	sidecar_job   job = { .bf = bf };
+	size_t        map_size;
+	uint8_t      *data;
+	pool          p;
+
+	if (!sidecar_flush(sc)) {
+		return false;
+	}
+
+	job.count = sidecar_count(sc);
+	if (job.count == 0) {
+		return true;
+	}
+
+	map_size = SIDECAR_HEADER_SIZE + job.count * SIDECAR_RECORD_SIZE;
+	data = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, sc->fd, 0);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+
+	madvise(data, map_size, MADV_SEQUENTIAL);
+	job.hashes = (const uint64_t (*)[BLOOM_HASH_WORDS])(data + SIDECAR_HEADER_SIZE);
+
+	// a fuse filter is built from all the records at once
+	if (bf->backend == BF_BACKEND_FUSE && bloom_build_static(bf, job.hashes, job.count)) {
+		munmap(data, map_size);
+		return true;
+	}
+
+	if (jobs <= 1 || bf->backend != BF_BACKEND_BLOOM) {
+		bloom_add_hashed(bf, job.hashes, job.count);
+		munmap(data, map_size);
+		return true;
+	}
+
+	job.added = calloc(jobs, sizeof(size_t));
+	if (job.added == NULL || !pool_init(&p, jobs)) {
+		free(job.added);
+		bloom_add_hashed(bf, job.hashes, job.count);
+		munmap(data, map_size);
+		return true;
+	}
+
+	// in rounds as in parallel_populate. records are one key each
+	const uint64_t (*hashes)[BLOOM_HASH_WORDS] = job.hashes;
+	size_t           total = job.count;
+
+	for (size_t done = 0; done < total; done += job.count) {
+		size_t added = 0;
+
+		job.hashes = hashes + done;
+		job.count  = round_keys(bf);
+		if (job.count > total - done) {
+			job.count = total - done;
+		}
+
+		pool_run(&p, sidecar_range, &job);
+		for (size_t i = 0; i < p.count; i++) {
+			added += job.added[i];
+		}
+		bloom_count_inserts(bf, added);
+	}
+	pool_destroy(&p);
+
+	free(job.added);
+	munmap(data, map_size);
+
+	return true;
+}
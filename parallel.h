@@ -0,0 +1,53 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "bloom.h"
+
+// A fixed set of threads that run one function together. The calling
+// thread takes part as worker 0, so a pool of one runs everything inline.
+typedef void (*pool_fn)(void *, const size_t, const size_t);
+
+typedef struct {
+	size_t           count;
+	pthread_t       *threads;
+	pthread_mutex_t  lock;
+	pthread_cond_t   start;
+	pthread_cond_t   done;
+	pool_fn          fn;
+	void            *arg;
+	uint64_t         generation;
+	size_t           pending;
+	bool             stop;
+} pool;
+
+bool    pool_init(pool *, const size_t);
+void    pool_run(pool *, pool_fn, void *);
+void    pool_destroy(pool *);
+
+// State for deduplicating batches of lines on a pool.
+typedef struct {
+	pool          pool;
+	bloomfilter  *bf;
+	const char  **lines;
+	const size_t *lens;
+	size_t        n;
+	bool         *seen;
+	uint64_t     *hashes;     // BLOOM_HASH_WORDS per line
+	uint32_t     *owner;      // worker that tests and sets each line
+	size_t        capacity;   // lines hashes and owner have room for
+	size_t       *added;      // new lines found by each worker
+} parallel;
+
+bool    parallel_init(parallel *, const size_t);
+size_t  parallel_lookup_or_add(parallel *, bloomfilter *, const char **, const size_t *, const size_t, bool *);
+void    parallel_destroy(parallel *);
+size_t  parallel_cpu_count(void);
+bool    parallel_populate(bloomfilter *, const char *, const size_t);
+bool    parallel_populate_sidecar(bloomfilter *, sidecar *, const size_t);
+
+#endif /* PARALLEL_H */
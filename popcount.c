@@ -0,0 +1,118 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define POPCOUNT_X86
+#endif
+
+#include "popcount.h"
+
+typedef uint64_t (*popcount_fn)(const uint8_t *, const size_t);
+
+static inline __attribute__((always_inline))
+uint64_t count_words(const uint8_t *bytes, const size_t n) {
+	uint64_t count[4] = {0};
+	size_t   i = 0;
+
+	// four sums so the adds do not wait on each other
+	for (; i + 32 <= n; i += 32) {
+		uint64_t w[4];
+
+		memcpy(w, bytes + i, sizeof(w));
+		count[0] += __builtin_popcountll(w[0]);
+		count[1] += __builtin_popcountll(w[1]);
+		count[2] += __builtin_popcountll(w[2]);
+		count[3] += __builtin_popcountll(w[3]);
+	}
+
+	for (; i + 8 <= n; i += 8) {
+		uint64_t w;
+
+		memcpy(&w, bytes + i, sizeof(w));
+		count[0] += __builtin_popcountll(w);
+	}
+
+	for (; i < n; i++) {
+		count[0] += __builtin_popcount(bytes[i]);
+	}
+
+	return count[0] + count[1] + count[2] + count[3];
+}
+
+static uint64_t count_scalar(const uint8_t *bytes, const size_t n) {
+	return count_words(bytes, n);
+}
+
+#ifdef POPCOUNT_X86
+__attribute__((target("popcnt")))
+static uint64_t count_popcnt(const uint8_t *bytes, const size_t n) {
+	return count_words(bytes, n);
+}
+
+// Look up the bits of every nibble with a byte shuffle, and add the bytes
+// up with a sum of absolute differences every 32 bytes (Mula, Kurz and
+// Lemire, 2018).
+__attribute__((target("avx2,popcnt")))
+static uint64_t count_avx2(const uint8_t *bytes, const size_t n) {
+	const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+			0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	__m256i       total = _mm256_setzero_si256();
+	size_t        i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(bytes + i));
+		__m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, low));
+		__m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+
+		total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+	}
+
+	return _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+		_mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3) +
+		count_words(bytes + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static uint64_t count_avx512(const uint8_t *bytes, const size_t n) {
+	__m512i total = _mm512_setzero_si512();
+	size_t  i = 0;
+
+	for (; i + 64 <= n; i += 64) {
+		total = _mm512_add_epi64(total, _mm512_popcnt_epi64(_mm512_loadu_si512(bytes + i)));
+	}
+
+	return _mm512_reduce_add_epi64(total) + count_words(bytes + i, n - i);
+}
+#endif
+
+// pick the widest kernel the CPU runs, once
+static popcount_fn popcount_select(void) {
+#ifdef POPCOUNT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512vpopcntdq")) {
+		return count_avx512;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return count_avx2;
+	}
+	if (__builtin_cpu_supports("popcnt")) {
+		return count_popcnt;
+	}
+#endif
+	return count_scalar;
+}
+
+uint64_t popcount_bytes(const uint8_t *bytes, const size_t n) {
+	static popcount_fn  selected;
+	popcount_fn         count = __atomic_load_n(&selected, __ATOMIC_RELAXED);
+
+	if (count == NULL) {
+		count = popcount_select();
+		__atomic_store_n(&selected, count, __ATOMIC_RELAXED);
+	}
+
+	return count(bytes, n);
+}
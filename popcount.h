@@ -0,0 +1,11 @@
+#ifndef POPCOUNT_H
+#define POPCOUNT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Count the bits set in a byte range, with the widest kernel the CPU runs:
+// VPOPCNTQ on AVX-512, a nibble lookup table on AVX2, POPCNT, or plain C.
+uint64_t  popcount_bytes(const uint8_t *, const size_t);
+
+#endif /* POPCOUNT_H */
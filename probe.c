@@ -0,0 +1,305 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define PROBE_X86
+#endif
+
+#include "probe.h"
+#include "cuckoo.h"
+#include "fuse.h"
+
+// hashcounts up to this get a standard kernel with the count built in
+#define PROBE_FIXED_HASHES 32
+
+typedef enum {
+	PROBE_SCALAR = 0,
+	PROBE_AVX2,
+	PROBE_AVX512
+} probe_isa;
+
+static inline bool test_bit(const uint8_t *bitmap, const uint64_t position) {
+	return __atomic_load_n(&bitmap[position / 8], __ATOMIC_RELAXED) & (1 << (position % 8));
+}
+
+static inline void set_bit(uint8_t *bitmap, const uint64_t position, const bool atomic) {
+	if (atomic) {
+		__atomic_fetch_or(&bitmap[position / 8], (uint8_t)(1 << (position % 8)), __ATOMIC_RELAXED);
+	} else {
+		bitmap[position / 8] |= (1 << (position % 8));
+	}
+}
+
+// Generic kernels: any reduction, any size, any hashcount. Probes are
+// reduced one at a time, so a miss in an older stack stops after a probe
+// or two without reducing the rest.
+static bool standard_contains(const uint8_t *bitmap, const bloom_segment *seg, const uint64_t *hash) {
+	for (size_t i = 0; i < seg->hashcount; i++) {
+		if (!test_bit(bitmap, probe_position(seg, hash, i))) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void standard_set(uint8_t *bitmap, const bloom_segment *seg, const uint64_t *hash, const bool atomic) {
+	for (size_t i = 0; i < seg->hashcount; i++) {
+		set_bit(bitmap, probe_position(seg, hash, i), atomic);
+	}
+}
+
+// Kernels for multiplied stacks below 2^32 bits, where every probe only
+// takes one 32x32 bit multiply to reduce. All probes of a key are reduced
+// up front, several per instruction on vector units, before any bit is
+// tested. positions must have room for k rounded up to 8.
+static inline __attribute__((always_inline))
+void positions_scalar(const bloom_segment *seg, const uint64_t *hash, const size_t k, uint64_t *positions) {
+	uint64_t probe = hash[0];
+
+	for (size_t i = 0; i < k; i++) {
+		positions[i] = seg->offset + (((probe >> 32) * seg->size) >> 32);
+		probe += hash[1];
+	}
+}
+
+#ifdef PROBE_X86
+__attribute__((target("avx2"))) static inline __attribute__((always_inline))
+void positions_avx2(const bloom_segment *seg, const uint64_t *hash, const size_t k, uint64_t *positions) {
+	__m256i probe = _mm256_set_epi64x(hash[0] + 3 * hash[1], hash[0] + 2 * hash[1], hash[0] + hash[1], hash[0]);
+	__m256i step = _mm256_set1_epi64x(4 * hash[1]);
+	__m256i size = _mm256_set1_epi64x(seg->size);
+	__m256i offset = _mm256_set1_epi64x(seg->offset);
+
+	for (size_t i = 0; i < k; i += 4) {
+		__m256i bit = _mm256_srli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(probe, 32), size), 32);
+
+		_mm256_storeu_si256((__m256i *)(positions + i), _mm256_add_epi64(bit, offset));
+		probe = _mm256_add_epi64(probe, step);
+	}
+}
+
+__attribute__((target("avx512f,avx512dq"))) static inline __attribute__((always_inline))
+void positions_avx512(const bloom_segment *seg, const uint64_t *hash, const size_t k, uint64_t *positions) {
+	__m512i lanes = _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0);
+	__m512i probe = _mm512_add_epi64(_mm512_set1_epi64(hash[0]), _mm512_mullo_epi64(lanes, _mm512_set1_epi64(hash[1])));
+	__m512i step = _mm512_set1_epi64(8 * hash[1]);
+	__m512i size = _mm512_set1_epi64(seg->size);
+	__m512i offset = _mm512_set1_epi64(seg->offset);
+
+	for (size_t i = 0; i < k; i += 8) {
+		__m512i bit = _mm512_srli_epi64(_mm512_mul_epu32(_mm512_srli_epi64(probe, 32), size), 32);
+
+		_mm512_storeu_si512(positions + i, _mm512_add_epi64(bit, offset));
+		probe = _mm512_add_epi64(probe, step);
+	}
+}
+#endif
+
+// Define the kernels of one instruction set: contains for every fixed
+// hashcount, contains for any hashcount, and set.
+#define PROBE_FIXED(isa, k) \
+	static PROBE_TARGET_##isa bool contains_##isa##_##k(const uint8_t *bitmap, const bloom_segment *seg, const uint64_t *hash) { \
+		uint64_t positions[(k + 7) / 8 * 8]; \
+		positions_##isa(seg, hash, k, positions); \
+		for (size_t i = 0; i < k; i++) { \
+			if (!test_bit(bitmap, positions[i])) { \
+				return false; \
+			} \
+		} \
+		return true; \
+	}
+
+#define PROBE_HASHCOUNTS(X, isa) \
+	X(isa, 1)  X(isa, 2)  X(isa, 3)  X(isa, 4)  X(isa, 5)  X(isa, 6)  X(isa, 7)  X(isa, 8) \
+	X(isa, 9)  X(isa, 10) X(isa, 11) X(isa, 12) X(isa, 13) X(isa, 14) X(isa, 15) X(isa, 16) \
+	X(isa, 17) X(isa, 18) X(isa, 19) X(isa, 20) X(isa, 21) X(isa, 22) X(isa, 23) X(isa, 24) \
+	X(isa, 25) X(isa, 26) X(isa, 27) X(isa, 28) X(isa, 29) X(isa, 30) X(isa, 31) X(isa, 32)
+
+#define PROBE_ENTRY(isa, k) contains_##isa##_##k,
+
+#define PROBE_KERNELS(isa) \
+	PROBE_HASHCOUNTS(PROBE_FIXED, isa) \
+	static const bloom_contains_fn fixed_##isa[PROBE_FIXED_HASHES + 1] = { \
+		NULL, PROBE_HASHCOUNTS(PROBE_ENTRY, isa) \
+	}; \
+	static PROBE_TARGET_##isa bool contains_##isa(const uint8_t *bitmap, const bloom_segment *seg, const uint64_t *hash) { \
+		uint64_t positions[BLOOM_MAX_HASHES]; \
+		positions_##isa(seg, hash, seg->hashcount, positions); \
+		for (size_t i = 0; i < seg->hashcount; i++) { \
+			if (!test_bit(bitmap, positions[i])) { \
+				return false; \
+			} \
+		} \
+		return true; \
+	} \
+	static PROBE_TARGET_##isa void set_##isa(uint8_t *bitmap, const bloom_segment *seg, const uint64_t *hash, const bool atomic) { \
+		uint64_t positions[BLOOM_MAX_HASHES]; \
+		positions_##isa(seg, hash, seg->hashcount, positions); \
+		for (size_t i = 0; i < seg->hashcount; i++) { \
+			set_bit(bitmap, positions[i], atomic); \
+		} \
+	}
+
+#define PROBE_TARGET_scalar
+PROBE_KERNELS(scalar)
+
+#ifdef PROBE_X86
+#define PROBE_TARGET_avx2 __attribute__((target("avx2")))
+PROBE_KERNELS(avx2)
+
+#define PROBE_TARGET_avx512 __attribute__((target("avx512f,avx512dq")))
+PROBE_KERNELS(avx512)
+#endif
+
+// The blocked layout draws the bits of a key from an LCG. Its i'th output
+// is a fixed affine function of the seed, so all of them can be computed at
+// once instead of one after another: x_i = lcg_mul[i] * x + lcg_add[i].
+static uint64_t lcg_mul[BLOOM_MAX_HASHES];
+static uint64_t lcg_add[BLOOM_MAX_HASHES];
+
+static void lcg_init(void) {
+	uint64_t mul = 1;
+	uint64_t add = 0;
+
+	for (size_t i = 0; i < BLOOM_MAX_HASHES; i++) {
+		mul = mul * 6364136223846793005ULL;
+		add = add * 6364136223846793005ULL + 1442695040888963407ULL;
+		lcg_mul[i] = mul;
+		lcg_add[i] = add;
+	}
+}
+
+// Gather the bits of a key into a mask of its block, one word per 64 bits,
+// so the whole block is set with at most eight word operations. Lookups
+// test bit by bit instead, since most misses stop at the first or second.
+static inline __attribute__((always_inline))
+void block_mask(const bloom_segment *seg, const uint64_t *hash, uint64_t *mask) {
+	uint64_t x = probe_hash(hash, 1);
+
+	for (size_t i = 0; i < BLOOM_BLOCK_BITS / 64; i++) {
+		mask[i] = 0;
+	}
+
+	for (size_t i = 0; i < seg->hashcount; i++) {
+		uint64_t bit = (lcg_mul[i] * x + lcg_add[i]) >> 55;
+
+		mask[bit / 64] |= 1ULL << (bit % 64);
+	}
+}
+
+static inline const uint64_t *block_words(const uint8_t *bitmap, const bloom_segment *seg, const uint64_t *hash) {
+	return (const uint64_t *)(bitmap + probe_block(seg, hash) / 8);
+}
+
+static bool blocked_contains(const uint8_t *bitmap, const bloom_segment *seg, const uint64_t *hash) {
+	const uint64_t *words = block_words(bitmap, seg, hash);
+	uint64_t        x = probe_hash(hash, 1);
+
+	for (size_t i = 0; i < seg->hashcount; i++) {
+		uint64_t bit = (lcg_mul[i] * x + lcg_add[i]) >> 55;
+
+		if (!(__atomic_load_n(&words[bit / 64], __ATOMIC_RELAXED) & (1ULL << (bit % 64)))) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void blocked_set(uint8_t *bitmap, const bloom_segment *seg, const uint64_t *hash, const bool atomic) {
+	uint64_t *words = (uint64_t *)block_words(bitmap, seg, hash);
+	uint64_t  mask[BLOOM_BLOCK_BITS / 64];
+
+	block_mask(seg, hash, mask);
+	for (size_t i = 0; i < BLOOM_BLOCK_BITS / 64; i++) {
+		if (mask[i] == 0) {
+			continue;
+		}
+
+		if (atomic) {
+			__atomic_fetch_or(&words[i], mask[i], __ATOMIC_RELAXED);
+		} else {
+			words[i] |= mask[i];
+		}
+	}
+}
+
+static probe_isa detect_isa(void) {
+#ifdef PROBE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) {
+		return PROBE_AVX512;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return PROBE_AVX2;
+	}
+#endif
+	return PROBE_SCALAR;
+}
+
+// Pick the kernels of a stack whose geometry and kind are set.
+void probe_select(bloom_segment *seg, const bloom_layout_t layout, const bloom_reduction_t reduction) {
+	static bool      ready;
+	static probe_isa isa;
+	uint64_t         modulus = seg->size;
+
+	if (!ready) {
+		isa = detect_isa();
+		lcg_init();
+		ready = true;
+	}
+
+	seg->reduction = reduction;
+	seg->magic     = 0;
+	seg->set       = NULL;
+
+	if (seg->kind == BF_SEGMENT_CUCKOO) {
+		seg->contains = cuckoo_contains;
+		return;
+	} else if (seg->kind == BF_SEGMENT_FUSE) {
+		seg->contains = fuse_contains;
+		return;
+	}
+
+	if (layout == BF_LAYOUT_BLOCKED) {
+		modulus = seg->size / BLOOM_BLOCK_BITS;
+	}
+
+	if (reduction == BF_REDUCE_MODULO && modulus > 0) {
+		seg->magic = UINT64_MAX;
+		seg->magic = ((seg->magic << 64 | UINT64_MAX) / modulus) + 1;
+	}
+
+	if (layout == BF_LAYOUT_BLOCKED) {
+		seg->contains = blocked_contains;
+		seg->set      = blocked_set;
+		return;
+	}
+
+	seg->contains = standard_contains;
+	seg->set      = standard_set;
+
+	if (reduction != BF_REDUCE_MULTIPLY || seg->size > UINT32_MAX) {
+		return;
+	}
+
+	switch (isa) {
+#ifdef PROBE_X86
+	case PROBE_AVX512:
+		seg->contains = seg->hashcount <= PROBE_FIXED_HASHES ? fixed_avx512[seg->hashcount] : contains_avx512;
+		seg->set      = set_avx512;
+		break;
+	case PROBE_AVX2:
+		seg->contains = seg->hashcount <= PROBE_FIXED_HASHES ? fixed_avx2[seg->hashcount] : contains_avx2;
+		seg->set      = set_avx2;
+		break;
+#endif
+	default:
+		seg->contains = seg->hashcount <= PROBE_FIXED_HASHES ? fixed_scalar[seg->hashcount] : contains_scalar;
+		seg->set      = set_scalar;
+		break;
+	}
+}
@@ -0,0 +1,61 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bloom.h"
+
+// Probe kernels test and set the bits of a key in one stack. Each stack
+// gets its own pair when it is created or loaded, picked from its kind,
+// layout, reduction, size and hashcount and from what the CPU supports, so
+// the hot loop never branches on any of them.
+
+// the i'th probe of a key before it is reduced to a stack. this follows
+// mmh3_64_make_hashes so existing caches stay valid. it used to be taken
+// mod UINT64_MAX, which only ever changed a sum of exactly UINT64_MAX.
+static inline uint64_t probe_hash(const uint64_t *hash, const size_t i) {
+	return hash[0] + i * hash[1];
+}
+
+static inline uint64_t probe_mulhi(const uint64_t a, const uint64_t b) {
+	return ((__uint128_t)a * b) >> 64;
+}
+
+// a % d for the d magic was computed for, with multiplies instead of a
+// division (Lemire, Kaser and Kurz, 2019)
+static inline uint64_t probe_fastmod(const uint64_t a, const __uint128_t magic, const uint64_t d) {
+	__uint128_t low = magic * a;
+	__uint128_t bottom = ((low & UINT64_MAX) * d) >> 64;
+
+	return (bottom + (low >> 64) * d) >> 64;
+}
+
+// Reduce a probe to a bit of a stack of size bits. Stacks below 2^32 bits
+// only need the high half of the probe, which vector units can multiply.
+static inline uint64_t probe_reduce(const bloom_segment *seg, const uint64_t probe, const uint64_t size) {
+	if (seg->reduction == BF_REDUCE_MODULO) {
+		return probe_fastmod(probe, seg->magic, size);
+	}
+
+	if (size <= UINT32_MAX) {
+		return ((probe >> 32) * size) >> 32;
+	}
+
+	return probe_mulhi(probe, size);
+}
+
+// first bit of the one block a key touches in a blocked stack
+static inline uint64_t probe_block(const bloom_segment *seg, const uint64_t *hash) {
+	return seg->offset + probe_reduce(seg, probe_hash(hash, 0), seg->size / BLOOM_BLOCK_BITS) * BLOOM_BLOCK_BITS;
+}
+
+// bit of the i'th probe of a key in a standard stack
+static inline uint64_t probe_position(const bloom_segment *seg, const uint64_t *hash, const size_t i) {
+	return seg->offset + probe_reduce(seg, probe_hash(hash, i), seg->size);
+}
+
+void  probe_select(bloom_segment *, const bloom_layout_t, const bloom_reduction_t);
+
+#endif /* PROBE_H */
@@ -0,0 +1,407 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define READER_X86
+#endif
+
+#include "reader.h"
+
+// Split lines out of p[0..len). At most max lines are stored and *used is
+// set to the offset just past the last newline consumed. A trailing partial
+// line is left alone so it can be completed by the next read.
+typedef size_t (*split_fn)(const char *, const size_t, const char **, size_t *, const size_t, size_t *);
+
+static size_t split_scalar_from(const char *p, const size_t len, size_t i, size_t line_start, size_t n,
+								const char **lines, size_t *lens, const size_t max, size_t *used) {
+	for (; i < len && n < max; i++) {
+		if (p[i] == '\n') {
+			lines[n] = p + line_start;
+			lens[n]  = i - line_start;
+			n++;
+			line_start = i + 1;
+		}
+	}
+
+	*used = line_start;
+	return n;
+}
+
+static size_t split_scalar(const char *p, const size_t len, const char **lines, size_t *lens, const size_t max, size_t *used) {
+	return split_scalar_from(p, len, 0, 0, 0, lines, lens, max, used);
+}
+
+#ifdef READER_X86
+// compare a whole vector against '\n' and walk the set bits of the mask, so
+// short lines cost one ctz each instead of a byte loop or a memchr call.
+#define SPLIT_VECTOR(WIDTH, MASK)										\
+	size_t   n = 0;															\
+	size_t   line_start = 0;												\
+	size_t   i = 0;															\
+																			\
+	for (; i + WIDTH <= len; i += WIDTH) {									\
+		uint32_t mask = (MASK);												\
+																			\
+		while (mask) {														\
+			size_t pos = i + __builtin_ctz(mask);							\
+																			\
+			lines[n] = p + line_start;										\
+			lens[n]  = pos - line_start;									\
+			line_start = pos + 1;											\
+			if (++n == max) {												\
+				*used = line_start;											\
+				return n;													\
+			}																\
+			mask &= mask - 1;												\
+		}																	\
+	}																		\
+																			\
+	return split_scalar_from(p, len, i, line_start, n, lines, lens, max, used);
+
+static size_t split_sse2(const char *p, const size_t len, const char **lines, size_t *lens, const size_t max, size_t *used) {
+	const __m128i nl = _mm_set1_epi8('\n');
+
+	SPLIT_VECTOR(16, _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), nl)))
+}
+
+__attribute__((target("avx2")))
+static size_t split_avx2(const char *p, const size_t len, const char **lines, size_t *lens, const size_t max, size_t *used) {
+	const __m256i nl = _mm256_set1_epi8('\n');
+
+	SPLIT_VECTOR(32, (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), nl)))
+}
+#endif
+
+static split_fn select_split(void) {
+#ifdef READER_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return split_avx2;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		return split_sse2;
+	}
+#endif
+	return split_scalar;
+}
+
+static split_fn split_lines;
+
+// Queue reads of the rest of the file into the free end of the buffer and
+// start them.
+static void stream_queue(reader *r) {
+	while (r->pending < URING_DEPTH && r->next_off < r->file_end && r->queued_end < r->buf_size) {
+		size_t        slot = (r->head + r->pending) % URING_DEPTH;
+		reader_chunk *c = &r->chunks[slot];
+
+		c->pos  = r->queued_end;
+		c->len  = r->buf_size - r->queued_end;
+		c->done = false;
+		if (c->len > URING_CHUNK) {
+			c->len = URING_CHUNK;
+		}
+		if ((off_t)c->len > r->file_end - r->next_off) {
+			c->len = r->file_end - r->next_off;
+		}
+
+		if (!uring_read(r->ring, r->fd, r->buf + c->pos, c->len, r->next_off, slot)) {
+			break;
+		}
+
+		r->queued_end += c->len;
+		r->next_off   += c->len;
+		r->pending++;
+	}
+
+	uring_submit(r->ring);
+}
+
+// wait for every read in flight, so the buffer can be moved or freed
+static void stream_drain(reader *r) {
+	uint64_t slot;
+	int32_t  res;
+
+	while (r->pending > 0 && uring_wait(r->ring, &slot, &res)) {
+		r->pending--;
+	}
+	r->pending = 0;
+}
+
+// Make the reads at the front of the queue part of the buffer, waiting
+// for the first if it is not done yet. A failed or short read ends the
+// input there, like a read error does for a pipe.
+static bool stream_refill(reader *r) {
+	uint64_t slot;
+	int32_t  res;
+
+	if (r->pending == 0) {
+		// nothing could be queued
+		r->eof = true;
+		return true;
+	}
+
+	while (!r->chunks[r->head].done) {
+		if (!uring_wait(r->ring, &slot, &res)) {
+			r->pending = 0;
+			r->eof = true;
+			return true;
+		}
+		r->chunks[slot].res  = res;
+		r->chunks[slot].done = true;
+	}
+
+	while (r->pending > 0 && r->chunks[r->head].done) {
+		reader_chunk *c = &r->chunks[r->head];
+
+		if (c->res != (int32_t)c->len) {
+			r->end += c->res > 0 ? (size_t)c->res : 0;
+			r->pending--;
+			stream_drain(r);
+			r->eof = true;
+			return true;
+		}
+
+		r->end += c->len;
+		r->head = (r->head + 1) % URING_DEPTH;
+		r->pending--;
+	}
+
+	stream_queue(r);
+	if (r->pending == 0 && r->next_off >= r->file_end) {
+		r->eof = true;
+	}
+
+	return true;
+}
+
+// Read a regular file from offset through a ring of its own. Falls back to
+// a mapping if no ring can be set up.
+static bool stream_init(reader *r, const off_t offset, const off_t size) {
+	r->ring = malloc(sizeof(uring));
+	if (r->ring == NULL) {
+		return false;
+	}
+
+	if (!uring_init(r->ring, URING_DEPTH)) {
+		free(r->ring);
+		r->ring = NULL;
+		return false;
+	}
+
+	r->buf_size = READER_STREAM_BUFFER;
+	if (posix_memalign((void **)&r->buf, 64, r->buf_size) != 0) {
+		uring_destroy(r->ring);
+		free(r->ring);
+		r->ring = NULL;
+		r->buf  = NULL;
+		return false;
+	}
+
+	r->next_off = offset;
+	r->file_end = size;
+
+	// leave the descriptor where a read() loop would have left it
+	lseek(r->fd, size, SEEK_SET);
+
+	stream_queue(r);
+	return true;
+}
+
+bool reader_open(reader *r, const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+
+	if (!reader_init_fd(r, fd)) {
+		close(fd);
+		return false;
+	}
+
+	r->owns_fd = true;
+	return true;
+}
+
+// Regular files are mapped from the current offset to their size at this
+// point. Anything else (pipes, terminals) is read into a growing buffer.
+bool reader_init_fd(reader *r, const int fd) {
+	struct stat st;
+	off_t       offset;
+
+	if (split_lines == NULL) {
+		split_lines = select_split();
+	}
+
+	memset(r, 0, sizeof(reader));
+	r->fd = fd;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+		(offset = lseek(fd, 0, SEEK_CUR)) != -1) {
+		off_t aligned = offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+
+		if (st.st_size <= offset) {
+			r->mapped = true;
+			r->eof    = true;
+			return true;
+		}
+
+		if (st.st_size - offset >= READER_STREAM_MIN && stream_init(r, offset, st.st_size)) {
+			return true;
+		}
+
+		r->buf = mmap(NULL, st.st_size - aligned, PROT_READ, MAP_PRIVATE, fd, aligned);
+		if (r->buf != MAP_FAILED) {
+			madvise(r->buf, st.st_size - aligned, MADV_SEQUENTIAL);
+			r->mapped     = true;
+			r->eof        = true;
+			r->buf_size   = st.st_size - aligned;
+			r->start      = offset - aligned;
+			r->end        = r->buf_size;
+
+			// leave the descriptor where a read() loop would have left it
+			lseek(fd, st.st_size, SEEK_SET);
+			return true;
+		}
+	}
+
+	r->buf_size = READER_BUFFER_SIZE;
+	if (posix_memalign((void **)&r->buf, 64, r->buf_size) != 0) {
+		r->buf = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+// Split lines out of memory the caller owns, such as one range of a mapped
+// file. The buffer must outlive the reader.
+void reader_init_buffer(reader *r, const char *buf, const size_t len) {
+	if (split_lines == NULL) {
+		split_lines = select_split();
+	}
+
+	memset(r, 0, sizeof(reader));
+	r->fd       = -1;
+	r->borrowed = true;
+	r->eof      = true;
+	r->buf      = (char *)buf;
+	r->buf_size = len;
+	r->end      = len;
+}
+
+// move the unfinished line to the front of the buffer, growing it if the
+// line fills the whole buffer, then read more input behind it. returns false
+// only when the buffer cannot grow.
+static bool refill(reader *r) {
+	size_t  remaining = r->end - r->start;
+	ssize_t got;
+
+	if (r->ring && r->pending > 0) {
+		return stream_refill(r);
+	}
+
+	if (remaining == r->buf_size) {
+		char *grown;
+
+		if (posix_memalign((void **)&grown, 64, r->buf_size * 2) != 0) {
+			return false;
+		}
+
+		memcpy(grown, r->buf + r->start, remaining);
+		free(r->buf);
+		r->buf = grown;
+		r->buf_size *= 2;
+	} else if (r->start > 0) {
+		memmove(r->buf, r->buf + r->start, remaining);
+	}
+
+	r->start = 0;
+	r->end   = remaining;
+
+	if (r->ring) {
+		r->queued_end = r->end;
+		stream_queue(r);
+		return stream_refill(r);
+	}
+
+	do {
+		got = read(r->fd, r->buf + r->end, r->buf_size - r->end);
+	} while (got == -1 && errno == EINTR);
+
+	// like getline, a read error ends the input
+	if (got <= 0) {
+		r->eof = true;
+		return true;
+	}
+
+	r->end += got;
+	return true;
+}
+
+// Return up to max lines as (lines[i], lens[i]) views. The buffer is only
+// refilled when it holds no complete line, so every view returned by one
+// call stays valid until the next. A final line without a trailing newline
+// is returned as is. Returns 0 at end of input.
+size_t reader_read_lines(reader *r, const char **lines, size_t *lens, const size_t max) {
+	size_t n;
+	size_t used;
+
+	for (;;) {
+		n = split_lines(r->buf + r->start, r->end - r->start, lines, lens, max, &used);
+		r->start += used;
+
+		if (n == 0 && r->eof && r->start < r->end) {
+			lines[0] = r->buf + r->start;
+			lens[0]  = r->end - r->start;
+			r->start = r->end;
+			n = 1;
+		}
+
+		if (n > 0) {
+			if (r->key) {
+				key_extract_batch(r->key, lines, lens, n);
+			}
+			return n;
+		}
+
+		if (r->eof) {
+			return 0;
+		}
+
+		if (!refill(r)) {
+			return 0;
+		}
+	}
+}
+
+void reader_close(reader *r) {
+	if (r->ring) {
+		stream_drain(r);
+		uring_destroy(r->ring);
+		free(r->ring);
+		r->ring = NULL;
+	}
+
+	if (r->borrowed) {
+		// nothing to release
+	} else if (r->mapped) {
+		if (r->buf_size > 0) {
+			munmap(r->buf, r->buf_size);
+		}
+	} else {
+		free(r->buf);
+	}
+	r->buf = NULL;
+
+	if (r->owns_fd) {
+		close(r->fd);
+	}
+}
@@ -0,0 +1,58 @@
+#ifndef READER_H
+#define READER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "uring.h"
+#include "key.h"
+
+#define READER_BUFFER_SIZE (1024 * 1024)
+
+// Regular files at least READER_STREAM_MIN bytes long are read through an
+// io_uring when there is one, with up to URING_DEPTH reads of URING_CHUNK
+// bytes in flight ahead of the lines being returned.
+#define READER_STREAM_MIN     (4 * URING_CHUNK)
+#define READER_STREAM_BUFFER  (2 * URING_DEPTH * URING_CHUNK)
+
+typedef struct {
+	size_t   pos;       // where in buf the read lands
+	size_t   len;
+	int32_t  res;
+	bool     done;
+} reader_chunk;
+
+// Lines are returned as views into the reader's buffer or mapping, without
+// their trailing newline. Views stay valid until the next call to
+// reader_read_lines. If key is set, each line is cut down to its key.
+typedef struct {
+	int    fd;
+	bool   owns_fd;
+	bool   mapped;     // buf is a mapping of the whole input
+	bool   borrowed;   // buf belongs to the caller
+	bool   eof;
+	char  *buf;
+	size_t buf_size;   // capacity of buf, or length of the mapping
+	size_t start;      // first byte not yet returned
+	size_t end;        // end of valid data in buf
+
+	// streamed files: reads in flight, in file order from chunk head
+	uring        *ring;
+	reader_chunk  chunks[URING_DEPTH];
+	size_t        head;
+	size_t        pending;
+	size_t        queued_end; // reads are queued into buf up to here
+	off_t         next_off;   // file offset of the next read to queue
+	off_t         file_end;
+
+	const key_spec *key;
+} reader;
+
+bool    reader_open(reader *, const char *);
+bool    reader_init_fd(reader *, const int);
+void    reader_init_buffer(reader *, const char *, const size_t);
+size_t  reader_read_lines(reader *, const char **, size_t *, const size_t);
+void    reader_close(reader *);
+
+#endif /* READER_H */
@@ -0,0 +1,496 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "shard.h"
+#include "reader.h"
+
+// lines read from the target file per batch while populating
+#define SHARD_POPULATE_BATCH 1024
+
+// The shard of a key. The hash words are mixed first so the shard has
+// nothing to do with the bits the probes of a stack are taken from.
+static inline size_t shard_of(const sharded *s, const uint64_t *hash) {
+	uint64_t h = (hash[0] ^ hash[1]) * 0x9e3779b97f4a7c15ULL;
+
+	return ((__uint128_t)h * s->count) >> 64;
+}
+
+static void shard_path(const char *dir, const size_t i, char *path, const size_t size) {
+	snprintf(path, size, "%s/%04zx", dir, i);
+}
+
+// every shard hashes with the same function, so any filter set up with it
+// will do
+static void hash_lines(const sharded *s, const char **lines, const size_t *lens, const size_t n, uint64_t (*hashes)[BLOOM_HASH_WORDS]) {
+	bloomfilter hasher = {.hash = s->hash};
+
+	bloom_hash_batch(&hasher, (const void *const *)lines, lens, n, hashes);
+}
+
+static bool shard_loaded(const sharded *s, const size_t i) {
+	return s->state[i] == SHARD_CLEAN || s->state[i] == SHARD_DIRTY;
+}
+
+// Set up count shards of a filter for target, kept in dir, for expected
+// keys in all. Nothing is read until shard_load.
+bool shard_init(sharded *s, const char *dir, const char *target, const size_t count, const size_t expected, const float accuracy,
+                const size_t max_stacks, const bloom_layout_t layout, const bloom_backend_t backend, const bloom_hash_t hash,
+                const bool map) {
+	memset(s, 0, sizeof(*s));
+
+	if (count == 0 || count > SHARD_MAX || backend == BF_BACKEND_FUSE) {
+		return false;
+	}
+
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+		perror("mkdir");
+		return false;
+	}
+
+	snprintf(s->dir, sizeof(s->dir), "%s", dir);
+	s->target     = target;
+	s->count      = count;
+	s->expected   = (expected + count - 1) / count;
+	s->accuracy   = accuracy;
+	s->max_stacks = max_stacks;
+	s->layout     = layout;
+	s->backend    = backend;
+	s->hash       = hash;
+	s->map        = map;
+
+	if (s->expected < SHARD_MIN_EXPECTED) {
+		s->expected = SHARD_MIN_EXPECTED;
+	}
+
+	s->filters = calloc(count, sizeof(bloomfilter));
+	s->state   = calloc(count, sizeof(uint8_t));
+	if (s->filters == NULL || s->state == NULL) {
+		free(s->filters);
+		free(s->state);
+		return false;
+	}
+
+	return true;
+}
+
+void shard_destroy(sharded *s) {
+	for (size_t i = 0; i < s->count; i++) {
+		if (shard_loaded(s, i)) {
+			bloom_destroy(&s->filters[i]);
+		}
+	}
+
+	free(s->filters);
+	free(s->state);
+	s->filters = NULL;
+	s->state   = NULL;
+}
+
+static bloom_error_t read_manifest(const char *dir, shard_manifest *m) {
+	char path[PATH_MAX + 32];
+	int  fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, SHARD_MANIFEST);
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return BF_FOPEN;
+	}
+
+	if (read(fd, m, sizeof(*m)) != sizeof(*m)) {
+		close(fd);
+		return BF_FREAD;
+	}
+	close(fd);
+
+	if (memcmp(m->magic, SHARD_MAGIC, sizeof(m->magic)) != 0 || m->version != SHARD_VERSION ||
+		m->count == 0 || m->count > SHARD_MAX || m->layout > BF_LAYOUT_BLOCKED ||
+		m->backend > BF_BACKEND_CUCKOO || m->hash > BF_HASH_WYHASH || m->expected == 0) {
+		return BF_INVALIDFILE;
+	}
+
+	return BF_SUCCESS;
+}
+
+// Check the manifest against the target file. On BF_SUCCESS or BF_GROWN
+// the shards are loaded from their files as keys land in them, and offset
+// is set to the end of the lines they already hold; on BF_GROWN the caller
+// catches up with shard_populate from there. Anything else means the
+// shards have to be built again with shard_reset and shard_populate. Like
+// a cached filter, the manifest decides layout, backend and hash.
+bloom_error_t shard_load(sharded *s, uint64_t *offset) {
+	shard_manifest m;
+	bloom_error_t  error;
+
+	error = read_manifest(s->dir, &m);
+	if (error != BF_SUCCESS) {
+		return error;
+	}
+
+	// resharding moves every key, so it is a rebuild
+	if (m.count != s->count) {
+		return BF_STALE;
+	}
+
+	error = bloom_target_check(&m.target, s->target);
+	if (error != BF_SUCCESS && error != BF_GROWN) {
+		return error;
+	}
+
+	s->layout   = m.layout;
+	s->backend  = m.backend;
+	s->hash     = m.hash;
+	s->expected = m.expected;
+	*offset     = m.target.size;
+
+	return error;
+}
+
+// Start over with every shard empty, removing the files of the old ones.
+bool shard_reset(sharded *s) {
+	DIR           *dir;
+	struct dirent *entry;
+	char           path[PATH_MAX + 256];
+
+	for (size_t i = 0; i < s->count; i++) {
+		if (shard_loaded(s, i)) {
+			bloom_destroy(&s->filters[i]);
+		}
+		s->state[i] = SHARD_EMPTY;
+	}
+
+	dir = opendir(s->dir);
+	if (dir == NULL) {
+		return false;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", s->dir, entry->d_name);
+		unlink(path);
+	}
+	closedir(dir);
+
+	return true;
+}
+
+// Build new filters for the shards flagged in which from the target file.
+// Every line is hashed, but only the keys of those shards are added. A
+// loaded shard is sized for twice the keys it holds, as a filter rebuilt
+// in full would be.
+static bool rebuild(sharded *s, const bool *which) {
+	bloomfilter *fresh = calloc(s->count, sizeof(bloomfilter));
+	const char  *lines[SHARD_POPULATE_BATCH];
+	size_t       lens[SHARD_POPULATE_BATCH];
+	uint64_t     hashes[SHARD_POPULATE_BATCH][BLOOM_HASH_WORDS];
+	reader       r;
+	size_t       n;
+	bool         ok = true;
+
+	if (fresh == NULL) {
+		return false;
+	}
+
+	for (size_t i = 0; i < s->count && ok; i++) {
+		size_t expected = s->expected;
+
+		if (!which[i]) {
+			continue;
+		}
+
+		if (shard_loaded(s, i)) {
+			size_t distinct = bloom_distinct(&s->filters[i]);
+			size_t capacity = bloom_capacity(&s->filters[i]);
+
+			expected = (distinct > capacity ? distinct : capacity) * 2;
+		}
+
+		ok = bloom_init(&fresh[i], expected, s->accuracy, s->max_stacks, s->layout, s->backend, s->hash) == BF_SUCCESS;
+	}
+
+	if (ok && !reader_open(&r, s->target)) {
+		ok = false;
+	}
+	r.key = s->key;
+
+	if (ok) {
+		while ((n = reader_read_lines(&r, lines, lens, SHARD_POPULATE_BATCH)) > 0) {
+			hash_lines(s, lines, lens, n, hashes);
+			for (size_t k = 0; k < n; k++) {
+				size_t i = shard_of(s, hashes[k]);
+
+				if (which[i]) {
+					bloom_add_hashed(&fresh[i], (const uint64_t (*)[BLOOM_HASH_WORDS])&hashes[k], 1);
+				}
+			}
+		}
+		reader_close(&r);
+	}
+
+	for (size_t i = 0; i < s->count; i++) {
+		if (!which[i]) {
+			continue;
+		}
+
+		if (!ok) {
+			bloom_destroy(&fresh[i]);
+			continue;
+		}
+
+		if (shard_loaded(s, i)) {
+			bloom_destroy(&s->filters[i]);
+		}
+		s->filters[i] = fresh[i];
+		s->state[i]   = SHARD_DIRTY;
+	}
+
+	free(fresh);
+	return ok;
+}
+
+// The filter of shard i, read or mapped from its file first if need be. A
+// shard file that is missing or cannot be read is rebuilt from the target
+// file: no key of this run has landed in that shard yet, so lines the file
+// gained meanwhile are its own keys or belong to other shards.
+static bloomfilter *shard_get(sharded *s, const size_t i) {
+	char          path[PATH_MAX + 32];
+	bloom_error_t error;
+
+	if (shard_loaded(s, i)) {
+		return &s->filters[i];
+	}
+
+	if (s->state[i] == SHARD_EMPTY) {
+		if (bloom_init(&s->filters[i], s->expected, s->accuracy, s->max_stacks, s->layout, s->backend, s->hash) != BF_SUCCESS) {
+			return NULL;
+		}
+		s->state[i] = SHARD_DIRTY;
+		return &s->filters[i];
+	}
+
+	shard_path(s->dir, i, path, sizeof(path));
+	error = s->map ? bloom_map(&s->filters[i], path, NULL) : bloom_load(&s->filters[i], path, NULL);
+	if (error == BF_SUCCESS) {
+		s->state[i] = SHARD_CLEAN;
+		s->loads++;
+		return &s->filters[i];
+	}
+
+	{
+		bool which[SHARD_MAX] = {false};
+
+		which[i] = true;
+		if (!rebuild(s, which)) {
+			return NULL;
+		}
+	}
+
+	return &s->filters[i];
+}
+
+// Add the lines of the target file from offset on, loading the shards they
+// land in.
+bool shard_populate(sharded *s, const off_t offset) {
+	const char  *lines[SHARD_POPULATE_BATCH];
+	size_t       lens[SHARD_POPULATE_BATCH];
+	uint64_t     hashes[SHARD_POPULATE_BATCH][BLOOM_HASH_WORDS];
+	reader       r;
+	size_t       n;
+	int          fd;
+
+	fd = open(s->target, O_RDONLY);
+	if (fd == -1) {
+		perror("open");
+		return false;
+	}
+
+	if (lseek(fd, offset, SEEK_SET) == -1 || !reader_init_fd(&r, fd)) {
+		close(fd);
+		return false;
+	}
+	r.owns_fd = true;
+	r.key = s->key;
+
+	while ((n = reader_read_lines(&r, lines, lens, SHARD_POPULATE_BATCH)) > 0) {
+		hash_lines(s, lines, lens, n, hashes);
+		for (size_t k = 0; k < n; k++) {
+			size_t       i = shard_of(s, hashes[k]);
+			bloomfilter *bf = shard_get(s, i);
+
+			if (bf == NULL) {
+				reader_close(&r);
+				return false;
+			}
+
+			if (bloom_add_hashed(bf, (const uint64_t (*)[BLOOM_HASH_WORDS])&hashes[k], 1) > 0) {
+				s->state[i] = SHARD_DIRTY;
+			}
+		}
+	}
+
+	reader_close(&r);
+	return true;
+}
+
+// Look up or add n keys, storing whether each was already present in
+// results, like bloom_lookup_or_add_batch. Keys are hashed and their bits
+// prefetched in groups first. Fails if a shard could not be loaded.
+bool shard_lookup_or_add_batch(sharded *s, const void *const *keys, const size_t *lens, const size_t n, bool *results) {
+	uint64_t      hashes[BLOOM_BATCH_SIZE][BLOOM_HASH_WORDS];
+	bloomfilter  *filters[BLOOM_BATCH_SIZE];
+	size_t        shards[BLOOM_BATCH_SIZE];
+
+	for (size_t start = 0; start < n; start += BLOOM_BATCH_SIZE) {
+		size_t group = (n - start < BLOOM_BATCH_SIZE) ? n - start : BLOOM_BATCH_SIZE;
+
+		hash_lines(s, (const char **)keys + start, lens + start, group, hashes);
+		for (size_t j = 0; j < group; j++) {
+			shards[j]  = shard_of(s, hashes[j]);
+			filters[j] = shard_get(s, shards[j]);
+			if (filters[j] == NULL) {
+				return false;
+			}
+			bloom_prefetch(filters[j], hashes[j]);
+		}
+
+		// a key may stack its shard. filters stay valid, only their bitmaps move
+		for (size_t j = 0; j < group; j++) {
+			results[start + j] = bloom_add_hashed(filters[j], (const uint64_t (*)[BLOOM_HASH_WORDS])&hashes[j], 1) == 0;
+			if (!results[start + j]) {
+				s->state[shards[j]] = SHARD_DIRTY;
+			}
+		}
+	}
+
+	return true;
+}
+
+bool shard_needs_rebuild(const sharded *s) {
+	for (size_t i = 0; i < s->count; i++) {
+		if (shard_loaded(s, i) && s->filters[i].needs_rebuild) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Rebuild every shard that reached its stack limit, in one pass over the
+// target file. Lines written so far must be flushed to it first.
+bool shard_rebuild(sharded *s) {
+	bool which[SHARD_MAX] = {false};
+
+	for (size_t i = 0; i < s->count; i++) {
+		which[i] = shard_loaded(s, i) && s->filters[i].needs_rebuild;
+	}
+
+	return rebuild(s, which);
+}
+
+// Save every shard that changed, and any never created, then record the
+// target file in the manifest. The manifest goes last and is replaced in
+// one rename, so a crash leaves shards ahead of it at worst, and catching
+// them up again only re-adds keys they already hold.
+bloom_error_t shard_save(sharded *s) {
+	shard_manifest m = {0};
+	char           path[PATH_MAX + 32];
+	char           temp[PATH_MAX + 64];
+	bloom_error_t  error;
+	int            fd;
+
+	for (size_t i = 0; i < s->count; i++) {
+		if (s->state[i] == SHARD_EMPTY && shard_get(s, i) == NULL) {
+			return BF_OUTOFMEMORY;
+		}
+
+		if (s->state[i] != SHARD_DIRTY) {
+			continue;
+		}
+
+		shard_path(s->dir, i, path, sizeof(path));
+		error = bloom_save(&s->filters[i], path);
+		if (error != BF_SUCCESS) {
+			return error;
+		}
+		s->state[i] = SHARD_CLEAN;
+	}
+
+	memcpy(m.magic, SHARD_MAGIC, sizeof(m.magic));
+	m.version  = SHARD_VERSION;
+	m.count    = s->count;
+	m.layout   = s->layout;
+	m.backend  = s->backend;
+	m.hash     = s->hash;
+	m.expected = s->expected;
+
+	error = bloom_target_record(&m.target, s->target);
+	if (error != BF_SUCCESS) {
+		return error;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", s->dir, SHARD_MANIFEST);
+	snprintf(temp, sizeof(temp), "%s.tmp", path);
+
+	fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		return BF_FOPEN;
+	}
+
+	if (write(fd, &m, sizeof(m)) != sizeof(m) || fsync(fd) == -1) {
+		close(fd);
+		unlink(temp);
+		return BF_FWRITE;
+	}
+	close(fd);
+
+	if (rename(temp, path) == -1) {
+		unlink(temp);
+		return BF_FWRITE;
+	}
+
+	return BF_SUCCESS;
+}
+
+bool shard_exists(const char *dir) {
+	shard_manifest m;
+
+	return read_manifest(dir, &m) == BF_SUCCESS;
+}
+
+// Estimate the distinct keys of a sharded filter from the bits of every
+// shard, reading one shard at a time.
+bloom_error_t shard_estimate(const char *dir, double *estimate) {
+	shard_manifest m;
+	bloom_error_t  error;
+	char           path[PATH_MAX + 32];
+
+	error = read_manifest(dir, &m);
+	if (error != BF_SUCCESS) {
+		return error;
+	}
+
+	*estimate = 0.0;
+	for (size_t i = 0; i < m.count; i++) {
+		bloomfilter bf;
+
+		shard_path(dir, i, path, sizeof(path));
+		error = bloom_load(&bf, path, NULL);
+		if (error != BF_SUCCESS) {
+			return error;
+		}
+
+		*estimate += bloom_estimate(&bf);
+		bloom_destroy(&bf);
+	}
+
+	return BF_SUCCESS;
+}
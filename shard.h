@@ -0,0 +1,78 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#include "bloom.h"
+
+// A sharded filter: the hash of a key picks one of count independent
+// filters, each in its own cache file in one directory under ~/.new. A
+// shard is read or mapped only once a key lands in it, so a short append
+// to a large target file touches a few shards instead of the whole filter,
+// and every shard stacks and is rebuilt on its own.
+//
+// The manifest records the target file once for all shards. A shard that
+// was never loaded took no keys, so it stays valid however often the
+// manifest is rewritten.
+#define SHARD_MAGIC     "!bloomsh"
+#define SHARD_VERSION   1
+#define SHARD_MAX       256
+#define SHARD_MANIFEST  "manifest"
+
+// a shard is never sized for fewer keys than this
+#define SHARD_MIN_EXPECTED 1024
+
+typedef enum {
+	SHARD_UNLOADED = 0,  // on disk, not read yet
+	SHARD_EMPTY,         // not on disk: the filter is being built from scratch
+	SHARD_CLEAN,         // loaded, unchanged
+	SHARD_DIRTY          // loaded and changed since
+} shard_state;
+
+typedef struct {
+	uint8_t       magic[8];
+	uint32_t      version;
+	uint32_t      count;
+	uint32_t      layout;
+	uint32_t      backend;
+	uint32_t      hash;
+	uint32_t      reserved;
+	uint64_t      expected;   // keys a new shard is sized for
+	bloom_target  target;
+} shard_manifest;
+
+typedef struct {
+	size_t           count;
+	bloomfilter     *filters;
+	uint8_t         *state;       // shard_state of every shard
+	char             dir[PATH_MAX];
+	const char      *target;
+	const key_spec  *key;         // if set, what lines of the target file are keyed by
+	size_t           expected;
+	float            accuracy;
+	size_t           max_stacks;
+	bloom_layout_t   layout;
+	bloom_backend_t  backend;
+	bloom_hash_t     hash;
+	bool             map;         // map shard files instead of reading them
+	size_t           loads;       // shards read or mapped so far
+} sharded;
+
+bool           shard_init(sharded *, const char *, const char *, const size_t, const size_t, const float, const size_t,
+                          const bloom_layout_t, const bloom_backend_t, const bloom_hash_t, const bool);
+void           shard_destroy(sharded *);
+bloom_error_t  shard_load(sharded *, uint64_t *);
+bool           shard_reset(sharded *);
+bool           shard_populate(sharded *, const off_t);
+bool           shard_lookup_or_add_batch(sharded *, const void *const *, const size_t *, const size_t, bool *);
+bool           shard_needs_rebuild(const sharded *);
+bool           shard_rebuild(sharded *);
+bloom_error_t  shard_save(sharded *);
+bool           shard_exists(const char *);
+bloom_error_t  shard_estimate(const char *, double *);
+
+#endif /* SHARD_H */
@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "sidecar.h"
+
+typedef struct {
+	uint8_t  magic[8];
+	uint32_t version;
+	uint32_t hash;     // function the records were hashed with
+} sidecar_header;
+
+_Static_assert(sizeof(sidecar_header) == SIDECAR_HEADER_SIZE, "sidecar header size");
+
+static bool sidecar_setup(sidecar *sc, const int fd) {
+	sc->fd       = fd;
+	sc->count    = 0;
+	sc->failed   = false;
+	sc->buffered = 0;
+	sc->buf      = malloc(SIDECAR_BUFFER * SIDECAR_RECORD_SIZE);
+
+	return sc->buf != NULL;
+}
+
+// Start an empty sidecar at path, replacing any existing one, for records
+// hashed with hash function id hash.
+bool sidecar_create(sidecar *sc, const char *path, const uint32_t hash) {
+	sidecar_header header = { .version = SIDECAR_VERSION, .hash = hash };
+	int            fd;
+
+	memcpy(header.magic, SIDECAR_MAGIC, sizeof(header.magic));
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		return false;
+	}
+
+	if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+		!sidecar_setup(sc, fd)) {
+		close(fd);
+		unlink(path);
+		return false;
+	}
+
+	return true;
+}
+
+// Open an existing sidecar that must hold at least count records, the
+// number its filter was saved with, hashed with hash function id hash.
+// Records past count were written by a run that never saved its filter and
+// are dropped.
+bool sidecar_open(sidecar *sc, const char *path, const uint64_t count, const uint32_t hash) {
+	sidecar_header header;
+	struct stat    st;
+	int            fd;
+
+	fd = open(path, O_RDWR);
+	if (fd == -1) {
+		return false;
+	}
+
+	if (fstat(fd, &st) == -1 ||
+		pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+		memcmp(header.magic, SIDECAR_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version != SIDECAR_VERSION ||
+		header.hash != hash ||
+		count > ((uint64_t)st.st_size - SIDECAR_HEADER_SIZE) / SIDECAR_RECORD_SIZE) {
+		close(fd);
+		return false;
+	}
+
+	if ((uint64_t)st.st_size != SIDECAR_HEADER_SIZE + count * SIDECAR_RECORD_SIZE &&
+		ftruncate(fd, SIDECAR_HEADER_SIZE + count * SIDECAR_RECORD_SIZE) == -1) {
+		close(fd);
+		return false;
+	}
+
+	if (!sidecar_setup(sc, fd)) {
+		close(fd);
+		return false;
+	}
+
+	sc->count = count;
+	return true;
+}
+
+// Write n records. Safe to call from several threads at once: each call
+// reserves its own slots and writes them with pwrite.
+bool sidecar_append(sidecar *sc, const uint64_t (*hashes)[SIDECAR_WORDS], const size_t n) {
+	const uint8_t *p = (const uint8_t *)hashes;
+	size_t         left = n * SIDECAR_RECORD_SIZE;
+	off_t          offset;
+	ssize_t        wrote;
+
+	if (n == 0) {
+		return true;
+	}
+
+	offset = SIDECAR_HEADER_SIZE + __atomic_fetch_add(&sc->count, n, __ATOMIC_RELAXED) * SIDECAR_RECORD_SIZE;
+
+	while (left > 0) {
+		wrote = pwrite(sc->fd, p, left, offset);
+		if (wrote == -1 && errno == EINTR) {
+			continue;
+		}
+
+		if (wrote <= 0) {
+			__atomic_store_n(&sc->failed, true, __ATOMIC_RELAXED);
+			return false;
+		}
+
+		p      += wrote;
+		offset += wrote;
+		left   -= wrote;
+	}
+
+	return true;
+}
+
+// buffer one record. not thread safe
+void sidecar_add(sidecar *sc, const uint64_t *hash) {
+	memcpy(sc->buf[sc->buffered++], hash, SIDECAR_RECORD_SIZE);
+
+	if (sc->buffered == SIDECAR_BUFFER) {
+		sidecar_flush(sc);
+	}
+}
+
+bool sidecar_flush(sidecar *sc) {
+	size_t n = sc->buffered;
+
+	sc->buffered = 0;
+	return sidecar_append(sc, (const uint64_t (*)[SIDECAR_WORDS])sc->buf, n) && !sc->failed;
+}
+
+// records written so far, including buffered ones
+uint64_t sidecar_count(const sidecar *sc) {
+	return sc->count + sc->buffered;
+}
+
+void sidecar_close(sidecar *sc) {
+	sidecar_flush(sc);
+	free(sc->buf);
+	sc->buf = NULL;
+	close(sc->fd);
+}
@@ -0,0 +1,37 @@
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// A sidecar file keeps the 128-bit hash of every key inserted into a
+// filter, 16 bytes per key behind a short header. A filter can be rebuilt
+// at any size by streaming it back, without reading or hashing the text of
+// the target file again.
+#define SIDECAR_MAGIC        "!bloomfp"
+#define SIDECAR_VERSION      1
+#define SIDECAR_HEADER_SIZE  16
+#define SIDECAR_WORDS        2
+#define SIDECAR_RECORD_SIZE  (SIDECAR_WORDS * sizeof(uint64_t))
+
+// records sidecar_add buffers before writing them out
+#define SIDECAR_BUFFER       4096
+
+typedef struct {
+	int        fd;
+	uint64_t   count;      // records written, or reserved by sidecar_append
+	bool       failed;     // a write failed. the record count cannot be trusted
+	size_t     buffered;
+	uint64_t (*buf)[SIDECAR_WORDS];
+} sidecar;
+
+bool      sidecar_create(sidecar *, const char *, const uint32_t);
+bool      sidecar_open(sidecar *, const char *, const uint64_t, const uint32_t);
+void      sidecar_add(sidecar *, const uint64_t *);
+bool      sidecar_append(sidecar *, const uint64_t (*)[SIDECAR_WORDS], const size_t);
+bool      sidecar_flush(sidecar *);
+uint64_t  sidecar_count(const sidecar *);
+void      sidecar_close(sidecar *);
+
+#endif /* SIDECAR_H */
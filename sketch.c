@@ -0,0 +1,280 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <limits.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "mmh3.h"
+#include "wyhash.h"
+#include "pack.h"
+#include "hll.h"
+#include "sketch.h"
+
+// Counter i of hash: the same sequence of probes as mmh3_64_make_hashes,
+// spread over every counter by a multiply rather than a modulo.
+static inline size_t sketch_position(const sketch *sk, const uint64_t *hash, const size_t i) {
+	uint64_t probe = hash[0] + i * hash[1];
+
+	return (size_t)(((unsigned __int128)probe * sk->counters) >> 64);
+}
+
+static inline unsigned cell_get(const uint8_t *cells, const size_t i) {
+	return (cells[i / 2] >> ((i % 2) * 4)) & 0x0f;
+}
+
+static inline void cell_increment(uint8_t *cells, const size_t i) {
+	cells[i / 2] += 1 << ((i % 2) * 4);
+}
+
+// Parse a memory size such as 512M for a sketch
+bool sketch_size_parse(const char *s, size_t *size) {
+	char     *end;
+	uint64_t  n;
+
+	errno = 0;
+	n = strtoull(s, &end, 10);
+	if (errno != 0 || end == s || n == 0) {
+		return false;
+	}
+
+	switch (*end) {
+	case '\0':
+		*size = n;
+		return true;
+	case 'k': case 'K':
+		*size = n << 10;
+		break;
+	case 'm': case 'M':
+		*size = n << 20;
+		break;
+	case 'g': case 'G':
+		*size = n << 30;
+		break;
+	default:
+		return false;
+	}
+
+	return end[1] == '\0' || strcasecmp(end + 1, "b") == 0;
+}
+
+// Start an empty sketch of size bytes
+bloom_error_t sketch_init(sketch *sk, const size_t size, const bloom_hash_t hash) {
+	memset(sk, 0, sizeof(sketch));
+
+	sk->counters = size * 2 < SKETCH_MIN_COUNTERS ? SKETCH_MIN_COUNTERS : size * 2;
+	sk->hashes   = SKETCH_HASHES;
+	sk->hash     = hash;
+
+	sk->cells = calloc(sk->counters / 2, 1);
+	if (sk->cells == NULL) {
+		return BF_OUTOFMEMORY;
+	}
+
+	return BF_SUCCESS;
+}
+
+void sketch_destroy(sketch *sk) {
+	free(sk->cells);
+	sk->cells = NULL;
+}
+
+// Count each of n keys once more, in order, so repeats within a batch are
+// all counted. reached[i] says whether key i has now been seen at least
+// threshold times. Returns how many have.
+size_t sketch_add_batch(sketch *sk, const void *const *keys, const size_t *lens, const size_t n,
+                        const unsigned threshold, bool *reached) {
+	uint64_t hashes[SKETCH_GROUP][2];
+	size_t   total = 0;
+
+	for (size_t start = 0; start < n; start += SKETCH_GROUP) {
+		size_t group = (n - start < SKETCH_GROUP) ? n - start : SKETCH_GROUP;
+
+		if (sk->hash == BF_HASH_WYHASH) {
+			for (size_t i = 0; i < group; i++) {
+				wyhash_128(keys[start + i], lens[start + i], 0, hashes[i]);
+			}
+		} else {
+			mmh3_128_batch(keys + start, lens + start, group, 0, hashes);
+		}
+
+		// the counters of a whole group are fetched while the first is updated
+		for (size_t i = 0; i < group; i++) {
+			for (size_t j = 0; j < sk->hashes; j++) {
+				__builtin_prefetch(&sk->cells[sketch_position(sk, hashes[i], j) / 2], 1);
+			}
+		}
+
+		for (size_t i = 0; i < group; i++) {
+			size_t   positions[SKETCH_HASHES];
+			unsigned count = SKETCH_MAX;
+
+			for (size_t j = 0; j < sk->hashes; j++) {
+				unsigned cell;
+
+				positions[j] = sketch_position(sk, hashes[i], j);
+				cell = cell_get(sk->cells, positions[j]);
+				if (cell < count) {
+					count = cell;
+				}
+			}
+
+			// only the counters holding the minimum are behind. a key may
+			// probe the same counter twice, which must not count twice
+			if (count < SKETCH_MAX) {
+				for (size_t j = 0; j < sk->hashes; j++) {
+					if (cell_get(sk->cells, positions[j]) == count) {
+						cell_increment(sk->cells, positions[j]);
+					}
+				}
+				count++;
+			}
+
+			hll_add(sk->hll, hashes[i][0]);
+			reached[start + i] = count >= threshold;
+			if (reached[start + i]) {
+				total++;
+			}
+		}
+	}
+
+	sk->counted += n;
+
+	// there cannot be more distinct keys than keys, so estimating them only
+	// starts once as many have been counted as the sketch is sized for
+	if (!sk->overfull && sk->counted >= sk->checked + sketch_capacity(sk) / 8 &&
+		sk->counted >= sketch_capacity(sk)) {
+		sk->checked  = sk->counted;
+		sk->overfull = sketch_distinct(sk) > sketch_capacity(sk);
+	}
+
+	return total;
+}
+
+// Save a sketch to path, packed and checksummed like a cached filter. It
+// is written to a temporary file first, header last, and renamed over
+// path, so a crash leaves either the old sketch or the new one.
+bloom_error_t sketch_save(const sketch *sk, const char *path) {
+	uint8_t      header[SKETCH_HEADER_SIZE] = {0};
+	sketch_file *sf = (sketch_file *)header;
+	char         temp[PATH_MAX];
+	bool         ok;
+	int          fd;
+
+	memcpy(sf->magic, SKETCH_MAGIC, sizeof(sf->magic));
+	sf->version     = SKETCH_FILE_VERSION;
+	sf->hash        = sk->hash;
+	sf->counters    = sk->counters;
+	sf->hashes      = sk->hashes;
+	sf->counted     = sk->counted;
+	sf->chunk_count = pack_chunk_count(sk->counters / 2);
+	memcpy(sf->hll, sk->hll, sizeof(sf->hll));
+
+	if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int)sizeof(temp)) {
+		return BF_FOPEN;
+	}
+
+	fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1) {
+		return BF_FOPEN;
+	}
+
+	ok = pack_write(fd, sizeof(header), sk->cells, sk->counters / 2, &sf->dir_checksum);
+	ok = ok && pwrite(fd, header, sizeof(header), 0) == sizeof(header);
+	if (close(fd) == -1 || !ok) {
+		unlink(temp);
+		return BF_FWRITE;
+	}
+
+	if (rename(temp, path) == -1) {
+		unlink(temp);
+		return BF_FWRITE;
+	}
+
+	return BF_SUCCESS;
+}
+
+// Load a sketch saved by sketch_save. It keeps the size it was created
+// with. A damaged file fails its checksums and gives BF_INVALIDFILE.
+bloom_error_t sketch_load(sketch *sk, const char *path) {
+	sketch_file  sf;
+	struct stat  sb;
+	int          fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return BF_FOPEN;
+	}
+
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return BF_FSTAT;
+	}
+
+	if (pread(fd, &sf, sizeof(sf), 0) != sizeof(sf)) {
+		close(fd);
+		return BF_FREAD;
+	}
+
+	if (memcmp(sf.magic, SKETCH_MAGIC, sizeof(sf.magic)) != 0 ||
+		sf.version != SKETCH_FILE_VERSION ||
+		(sf.hash != BF_HASH_MMH3 && sf.hash != BF_HASH_WYHASH) ||
+		sf.counters < SKETCH_MIN_COUNTERS ||
+		sf.counters % 2 != 0 ||
+		sf.hashes < 1 || sf.hashes > SKETCH_HASHES ||
+		sf.chunk_count != pack_chunk_count(sf.counters / 2)) {
+		close(fd);
+		return BF_INVALIDFILE;
+	}
+
+	memset(sk, 0, sizeof(sketch));
+	sk->cells = malloc(sf.counters / 2);
+	if (sk->cells == NULL) {
+		close(fd);
+		return BF_OUTOFMEMORY;
+	}
+
+	if (!pack_read(fd, SKETCH_HEADER_SIZE, sb.st_size, sk->cells, sf.counters / 2, sf.dir_checksum)) {
+		close(fd);
+		sketch_destroy(sk);
+		return BF_INVALIDFILE;
+	}
+	close(fd);
+
+	sk->counters = sf.counters;
+	sk->hashes   = sf.hashes;
+	sk->hash     = sf.hash;
+	sk->counted  = sf.counted;
+	memcpy(sk->hll, sf.hll, sizeof(sk->hll));
+	sk->checked  = sk->counted;
+	sk->overfull = sketch_distinct(sk) > sketch_capacity(sk);
+
+	return BF_SUCCESS;
+}
+
+size_t sketch_memory(const sketch *sk) {
+	return sk->counters / 2;
+}
+
+// distinct keys the sketch is sized for
+size_t sketch_capacity(const sketch *sk) {
+	return sk->counters * log(2) / sk->hashes;
+}
+
+// distinct keys counted so far, estimated
+double sketch_distinct(const sketch *sk) {
+	return hll_estimate(sk->hll);
+}
+
+// chance that the count of a key is overstated, at the keys counted so far
+double sketch_error(const sketch *sk) {
+	double k = sk->hashes;
+
+	return pow(1.0 - exp(-k * sketch_distinct(sk) / sk->counters), k);
+}
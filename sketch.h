@@ -0,0 +1,73 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bloom.h"
+#include "hll.h"
+
+// A count-min sketch of how often each key has been seen, in a fixed
+// amount of memory however many keys pass through it. Counters are four
+// bits, two to a byte, and stop at SKETCH_MAX. A key maps to k counters at
+// the same double hashing positions a Bloom filter probes, and its count
+// is the smallest of them: never below the true count, and above it only
+// when every one of its counters is shared. Adding a key only raises the
+// counters at that minimum (conservative update), so shared counters are
+// inflated as little as possible.
+//
+// A sketch of m counters probed k times holding n distinct keys overstates
+// a key's count with a chance of about (1 - e^(-kn/m))^k. The sketch is
+// sized for m ln 2 / k keys, where that is 2^-k. It cannot grow, as the
+// keys it counted are gone, so it only warns once it holds more.
+#define SKETCH_MAX           15
+#define SKETCH_HASHES        10
+#define SKETCH_MIN_COUNTERS  1024
+#define SKETCH_DEFAULT_SIZE  (128ULL << 20)
+
+// keys hashed and prefetched together in sketch_add_batch
+#define SKETCH_GROUP         16
+
+#define SKETCH_MAGIC         "!bloomcm"
+#define SKETCH_FILE_VERSION  2
+#define SKETCH_HEADER_SIZE   4096
+
+typedef struct {
+	uint8_t       *cells;
+	size_t         counters;
+	size_t         hashes;
+	bloom_hash_t   hash;
+	uint64_t       counted;   // keys added
+	uint64_t       checked;   // counted when the distinct keys were last estimated
+	bool           overfull;  // holds more distinct keys than it was sized for
+	uint8_t        hll[HLL_REGISTERS];
+} sketch;
+
+// the header of a cache file, followed by the cells packed as in pack.h
+typedef struct {
+	uint8_t   magic[8];
+	uint32_t  version;
+	uint32_t  hash;          // bloom_hash_t
+	uint64_t  counters;
+	uint64_t  hashes;
+	uint64_t  counted;
+	uint64_t  chunk_count;
+	uint64_t  dir_checksum;
+	uint8_t   hll[HLL_REGISTERS];
+} sketch_file;
+
+_Static_assert(sizeof(sketch_file) <= SKETCH_HEADER_SIZE, "header does not fit its page");
+
+bool           sketch_size_parse(const char *, size_t *);
+bloom_error_t  sketch_init(sketch *, const size_t, const bloom_hash_t);
+void           sketch_destroy(sketch *);
+size_t         sketch_add_batch(sketch *, const void *const *, const size_t *, const size_t, const unsigned, bool *);
+bloom_error_t  sketch_save(const sketch *, const char *);
+bloom_error_t  sketch_load(sketch *, const char *);
+size_t         sketch_memory(const sketch *);
+size_t         sketch_capacity(const sketch *);
+double         sketch_distinct(const sketch *);
+double         sketch_error(const sketch *);
+
+#endif /* SKETCH_H */
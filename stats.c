@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include "stats.h"
+
+static const char *phase_names[STATS_PHASES] = {
+	"load",
+	"count",
+	"populate",
+	"stream",
+	"rebuild",
+	"save",
+};
+
+volatile sig_atomic_t stats_progress_requested = 0;
+
+static void request_progress(int sig) {
+	(void)sig;
+	stats_progress_requested = 1;
+}
+
+static double clock_seconds(const clockid_t clock) {
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// charge the time since the innermost phase last started to it
+static void charge(stats *s) {
+	double wall = clock_seconds(CLOCK_MONOTONIC);
+	double cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+
+	if (s->depth > 0) {
+		stats_phase p = s->running[s->depth - 1];
+
+		s->wall[p] += wall - s->wall_start;
+		s->cpu[p]  += cpu - s->cpu_start;
+	}
+
+	s->wall_start = wall;
+	s->cpu_start  = cpu;
+}
+
+// Start collecting. SIGUSR1 now asks for a progress line instead of ending
+// the process; the caller prints it between batches with stats_progress.
+void stats_init(stats *s) {
+	struct sigaction sa;
+
+	memset(s, 0, sizeof(*s));
+	s->started = clock_seconds(CLOCK_MONOTONIC);
+	s->cache   = "off";
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = request_progress;
+	sa.sa_flags   = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+void stats_begin(stats *s, const stats_phase phase) {
+	charge(s);
+	if (s->depth < STATS_DEPTH) {
+		s->running[s->depth++] = phase;
+	}
+}
+
+void stats_end(stats *s) {
+	charge(s);
+	if (s->depth > 0) {
+		s->depth--;
+	}
+}
+
+// count a batch of n lines from stdin, added of them new
+void stats_lines(stats *s, const size_t *lens, const size_t n, const size_t added) {
+	s->lines     += n;
+	s->new_lines += added;
+	for (size_t i = 0; i < n; i++) {
+		s->bytes_hashed += lens[i];
+	}
+}
+
+// count lines from stdin dropped before they reached the filter
+void stats_filtered(stats *s, const size_t n) {
+	s->lines    += n;
+	s->filtered += n;
+}
+
+// count the stacks a filter gained since known_stacks was set
+void stats_stacks(stats *s, const size_t stack_count) {
+	if (stack_count > s->known_stacks) {
+		s->stacks += stack_count - s->known_stacks;
+	}
+	s->known_stacks = stack_count;
+}
+
+void stats_progress(stats *s, FILE *fp) {
+	double elapsed = clock_seconds(CLOCK_MONOTONIC) - s->started;
+
+	stats_progress_requested = 0;
+	fprintf(fp, "progress: %.1fs %s, %llu lines (%llu new, %llu duplicate), %.0f lines/s, %llu stacks added, %llu rebuilds\n",
+			elapsed, s->depth > 0 ? phase_names[s->running[s->depth - 1]] : "idle",
+			(unsigned long long)s->lines, (unsigned long long)s->new_lines,
+			(unsigned long long)(s->lines - s->new_lines - s->filtered),
+			elapsed > 0 ? s->lines / elapsed : 0.0,
+			(unsigned long long)s->stacks, (unsigned long long)s->rebuilds);
+}
+
+static void report_text(const stats *s, FILE *fp, const double elapsed) {
+	fprintf(fp, "%-10s %10s %10s\n", "phase", "wall (s)", "cpu (s)");
+	for (int p = 0; p < STATS_PHASES; p++) {
+		fprintf(fp, "%-10s %10.3f %10.3f\n", phase_names[p], s->wall[p], s->cpu[p]);
+	}
+	fprintf(fp, "%-10s %10.3f\n", "total", elapsed);
+
+	fprintf(fp, "lines:         %llu (%llu new, %llu duplicate)\n",
+			(unsigned long long)s->lines, (unsigned long long)s->new_lines,
+			(unsigned long long)(s->lines - s->new_lines - s->filtered));
+	if (s->filtered > 0) {
+		fprintf(fp, "filtered:      %llu\n", (unsigned long long)s->filtered);
+	}
+	fprintf(fp, "bytes hashed:  %llu\n", (unsigned long long)s->bytes_hashed);
+	fprintf(fp, "stacks:        %zu (%llu added)\n", s->filter_stacks, (unsigned long long)s->stacks);
+	fprintf(fp, "rebuilds:      %llu\n", (unsigned long long)s->rebuilds);
+	fprintf(fp, "memory:        %zu bytes\n", s->memory);
+	fprintf(fp, "fill:          %.4f\n", s->fill);
+	fprintf(fp, "estimated fpr: %.3g\n", s->fpr);
+	if (s->reason) {
+		fprintf(fp, "cache:         %s (%s)\n", s->cache, s->reason);
+	} else {
+		fprintf(fp, "cache:         %s\n", s->cache);
+	}
+}
+
+static void report_json(const stats *s, FILE *fp, const double elapsed) {
+	fprintf(fp, "{\"phases\": {");
+	for (int p = 0; p < STATS_PHASES; p++) {
+		fprintf(fp, "%s\"%s\": {\"wall\": %.6f, \"cpu\": %.6f}",
+				p ? ", " : "", phase_names[p], s->wall[p], s->cpu[p]);
+	}
+	fprintf(fp, "}, \"wall\": %.6f, \"lines\": %llu, \"new\": %llu, \"duplicate\": %llu, \"filtered\": %llu, "
+			"\"bytes_hashed\": %llu, \"stacks\": %zu, \"stacks_added\": %llu, \"rebuilds\": %llu, "
+			"\"memory\": %zu, \"fill\": %.6f, \"estimated_fpr\": %.6g, \"cache\": \"%s\"",
+			elapsed, (unsigned long long)s->lines, (unsigned long long)s->new_lines,
+			(unsigned long long)(s->lines - s->new_lines - s->filtered), (unsigned long long)s->filtered,
+			(unsigned long long)s->bytes_hashed, s->filter_stacks, (unsigned long long)s->stacks,
+			(unsigned long long)s->rebuilds, s->memory, s->fill, s->fpr, s->cache);
+	if (s->reason) {
+		fprintf(fp, ", \"cache_reason\": \"%s\"", s->reason);
+	}
+	fprintf(fp, "}\n");
+}
+
+// Report the run so far, as a table or one line of JSON. Phases still
+// running are charged up to now.
+void stats_report(stats *s, FILE *fp, const bool json) {
+	double elapsed;
+
+	charge(s);
+	elapsed = s->wall_start - s->started;
+
+	if (json) {
+		report_json(s, fp, elapsed);
+	} else {
+		report_text(s, fp, elapsed);
+	}
+}
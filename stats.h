@@ -0,0 +1,63 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+
+// Counters and per-phase timings of one run, reported to stderr at exit
+// with -S, and as a progress line whenever SIGUSR1 arrives.
+typedef enum {
+	STATS_LOAD,      // reading the cache and catching it up
+	STATS_COUNT,     // sizing a rebuild from the target file
+	STATS_POPULATE,  // building a filter from the target file
+	STATS_STREAM,    // deduplicating stdin
+	STATS_REBUILD,   // replacing a filter with a larger one
+	STATS_SAVE,      // writing the cache
+	STATS_PHASES
+} stats_phase;
+
+// phases may nest, such as a rebuild during the stream
+#define STATS_DEPTH 4
+
+typedef struct {
+	double       wall[STATS_PHASES];
+	double       cpu[STATS_PHASES];
+	stats_phase  running[STATS_DEPTH];
+	size_t       depth;
+	double       wall_start;  // of the innermost running phase
+	double       cpu_start;
+	double       started;     // of the run
+
+	uint64_t     lines;       // read from stdin
+	uint64_t     new_lines;
+	uint64_t     filtered;    // dropped by -x, -i or -t before the filter saw them
+	uint64_t     bytes_hashed;
+	uint64_t     stacks;      // stacks added
+	size_t       known_stacks;  // stacks of the filter when last counted
+	uint64_t     rebuilds;
+
+	const char  *cache;       // hit, grown, miss, invalid, forced or off
+	const char  *reason;      // why the cache was invalid
+
+	// filled in by the caller just before stats_report
+	size_t       filter_stacks;
+	size_t       memory;
+	double       fill;
+	double       fpr;
+} stats;
+
+extern volatile sig_atomic_t stats_progress_requested;
+
+void  stats_init(stats *);
+void  stats_begin(stats *, const stats_phase);
+void  stats_end(stats *);
+void  stats_lines(stats *, const size_t *, const size_t, const size_t);
+void  stats_filtered(stats *, const size_t);
+void  stats_stacks(stats *, const size_t);
+void  stats_progress(stats *, FILE *);
+void  stats_report(stats *, FILE *, const bool);
+
+#endif /* STATS_H */
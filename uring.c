@@ -0,0 +1,283 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+// cleared by uring_disable, or once the kernel turns a ring down
+static bool uring_usable = true;
+
+void uring_disable(void) {
+	__atomic_store_n(&uring_usable, false, __ATOMIC_RELAXED);
+}
+
+bool uring_init(uring *r, const unsigned entries) {
+	struct io_uring_params p;
+
+	memset(r, 0, sizeof(uring));
+	r->fd = -1;
+
+	if (!__atomic_load_n(&uring_usable, __ATOMIC_RELAXED)) {
+		return false;
+	}
+
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd == -1) {
+		// ENOSYS, or a seccomp filter. asking again will not help
+		if (errno == ENOSYS || errno == EPERM) {
+			uring_disable();
+		}
+		return false;
+	}
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size    = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size) {
+			r->sq_ring_size = r->cq_ring_size;
+		}
+		r->cq_ring_size = r->sq_ring_size;
+	}
+
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) {
+		r->sq_ring = NULL;
+		uring_destroy(r);
+		return false;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) {
+			r->cq_ring = NULL;
+			uring_destroy(r);
+			return false;
+		}
+	}
+
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		uring_destroy(r);
+		return false;
+	}
+
+	r->sq_head  = (unsigned *)((uint8_t *)r->sq_ring + p.sq_off.head);
+	r->sq_tail  = (unsigned *)((uint8_t *)r->sq_ring + p.sq_off.tail);
+	r->sq_mask  = (unsigned *)((uint8_t *)r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((uint8_t *)r->sq_ring + p.sq_off.array);
+	r->cq_head  = (unsigned *)((uint8_t *)r->cq_ring + p.cq_off.head);
+	r->cq_tail  = (unsigned *)((uint8_t *)r->cq_ring + p.cq_off.tail);
+	r->cq_mask  = (unsigned *)((uint8_t *)r->cq_ring + p.cq_off.ring_mask);
+	r->cqes     = (struct io_uring_cqe *)((uint8_t *)r->cq_ring + p.cq_off.cqes);
+
+	return true;
+}
+
+// The kernel may still write to the buffers of requests in flight, so only
+// destroy a ring once everything it submitted was reaped.
+void uring_destroy(uring *r) {
+	if (r->sqes) {
+		munmap(r->sqes, r->sqes_size);
+	}
+	if (r->cq_ring && r->cq_ring != r->sq_ring) {
+		munmap(r->cq_ring, r->cq_ring_size);
+	}
+	if (r->sq_ring) {
+		munmap(r->sq_ring, r->sq_ring_size);
+	}
+	if (r->fd != -1) {
+		close(r->fd);
+	}
+
+	memset(r, 0, sizeof(uring));
+	r->fd = -1;
+}
+
+static bool queue(uring *r, const uint8_t op, const int fd, const void *buf, const size_t len, const uint64_t off, const uint64_t data) {
+	unsigned             tail = *r->sq_tail;
+	unsigned             head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	unsigned             index;
+	struct io_uring_sqe *sqe;
+
+	if (tail - head > *r->sq_mask || len > UINT32_MAX) {
+		return false;
+	}
+
+	index = tail & *r->sq_mask;
+	sqe = &r->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode    = op;
+	sqe->fd        = fd;
+	sqe->addr      = (uint64_t)(uintptr_t)buf;
+	sqe->len       = len;
+	sqe->off       = off;
+	sqe->user_data = data;
+
+	r->sq_array[index] = index;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->queued++;
+
+	return true;
+}
+
+// Queue a read of len bytes of fd at off into buf. It is submitted by the
+// next uring_submit or uring_wait.
+bool uring_read(uring *r, const int fd, void *buf, const size_t len, const uint64_t off, const uint64_t data) {
+	return queue(r, IORING_OP_READ, fd, buf, len, off, data);
+}
+
+bool uring_write(uring *r, const int fd, const void *buf, const size_t len, const uint64_t off, const uint64_t data) {
+	return queue(r, IORING_OP_WRITE, fd, buf, len, off, data);
+}
+
+// Start whatever was queued without waiting for any of it.
+bool uring_submit(uring *r) {
+	while (r->queued > 0) {
+		int ret = syscall(__NR_io_uring_enter, r->fd, r->queued, 0, 0, NULL, 0);
+
+		if (ret == -1) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+				continue;
+			}
+			return false;
+		}
+
+		r->queued -= ret;
+		r->inflight += ret;
+	}
+
+	return true;
+}
+
+// Submit whatever was queued and take one completion, waiting for it if
+// none is ready. Fails if nothing is in flight.
+bool uring_wait(uring *r, uint64_t *data, int32_t *res) {
+	for (;;) {
+		unsigned head = *r->cq_head;
+		unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+		if (head != tail) {
+			struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+
+			*data = cqe->user_data;
+			*res  = cqe->res;
+			__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+			r->inflight--;
+			return true;
+		}
+
+		if (r->queued == 0 && r->inflight == 0) {
+			return false;
+		}
+
+		int ret = syscall(__NR_io_uring_enter, r->fd, r->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret == -1) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+				continue;
+			}
+			return false;
+		}
+
+		r->queued -= ret;
+		r->inflight += ret;
+	}
+}
+
+static bool transfer_plain(const int fd, uint8_t *buf, size_t len, off_t off, const bool write) {
+	while (len > 0) {
+		ssize_t done = write ? pwrite(fd, buf, len, off) : pread(fd, buf, len, off);
+
+		if (done == -1 && errno == EINTR) {
+			continue;
+		}
+		if (done <= 0) {
+			return false;
+		}
+
+		buf += done;
+		off += done;
+		len -= done;
+	}
+
+	return true;
+}
+
+// Move len bytes between buf and fd at off, URING_DEPTH chunks at a time.
+// A short transfer queues the rest of its chunk again.
+static bool transfer(const int fd, uint8_t *buf, const size_t len, const off_t off, const bool write) {
+	struct {
+		size_t pos;
+		size_t left;
+	}        piece[URING_DEPTH];
+	uring    r;
+	size_t   next = 0;
+	bool     ok = true;
+	uint64_t slot;
+	int32_t  res;
+
+	// a ring costs a few system calls to set up
+	if (len < 2 * URING_CHUNK || !uring_init(&r, URING_DEPTH)) {
+		return transfer_plain(fd, buf, len, off, write);
+	}
+
+	for (slot = 0; slot < URING_DEPTH && next < len; slot++) {
+		piece[slot].pos  = next;
+		piece[slot].left = (len - next < URING_CHUNK) ? len - next : URING_CHUNK;
+		next += piece[slot].left;
+
+		queue(&r, write ? IORING_OP_WRITE : IORING_OP_READ, fd, buf + piece[slot].pos, piece[slot].left,
+			off + piece[slot].pos, slot);
+	}
+
+	while (uring_wait(&r, &slot, &res)) {
+		if (res == -EINTR || res == -EAGAIN) {
+			res = 0;
+		} else if (res <= 0) {
+			// an error, or the end of the file before len bytes
+			ok = false;
+			continue;
+		}
+
+		piece[slot].pos  += res;
+		piece[slot].left -= res;
+
+		if (ok && piece[slot].left == 0 && next < len) {
+			piece[slot].pos  = next;
+			piece[slot].left = (len - next < URING_CHUNK) ? len - next : URING_CHUNK;
+			next += piece[slot].left;
+		}
+
+		if (ok && piece[slot].left > 0) {
+			queue(&r, write ? IORING_OP_WRITE : IORING_OP_READ, fd, buf + piece[slot].pos, piece[slot].left,
+				off + piece[slot].pos, slot);
+		}
+	}
+
+	// uring_wait only stops early if io_uring_enter fails
+	if (ok && (r.inflight > 0 || r.queued > 0)) {
+		ok = false;
+	}
+
+	uring_destroy(&r);
+	return ok;
+}
+
+bool uring_pread_all(const int fd, void *buf, const size_t len, const off_t off) {
+	return transfer(fd, buf, len, off, false);
+}
+
+bool uring_pwrite_all(const int fd, const void *buf, const size_t len, const off_t off) {
+	return transfer(fd, (uint8_t *)buf, len, off, true);
+}
@@ -0,0 +1,53 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// A minimal io_uring, set up with raw system calls so nothing beyond the
+// kernel headers is needed. Every user falls back to plain reads and
+// writes when the kernel has no io_uring, it is filtered out, or
+// uring_disable was called.
+//
+// Large transfers are cut into URING_CHUNK pieces with up to URING_DEPTH
+// of them in flight, so the device sees a queue instead of one request at
+// a time.
+#define URING_CHUNK  (1024 * 1024)
+#define URING_DEPTH  8
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+typedef struct {
+	int                   fd;
+	unsigned             *sq_head;
+	unsigned             *sq_tail;
+	unsigned             *sq_mask;
+	unsigned             *sq_array;
+	unsigned             *cq_head;
+	unsigned             *cq_tail;
+	unsigned             *cq_mask;
+	struct io_uring_sqe  *sqes;
+	struct io_uring_cqe  *cqes;
+	void                 *sq_ring;
+	size_t                sq_ring_size;
+	void                 *cq_ring;
+	size_t                cq_ring_size;
+	size_t                sqes_size;
+	unsigned              queued;     // prepared, not yet submitted
+	unsigned              inflight;   // submitted, not yet reaped
+} uring;
+
+void  uring_disable(void);
+bool  uring_init(uring *, const unsigned);
+void  uring_destroy(uring *);
+bool  uring_read(uring *, const int, void *, const size_t, const uint64_t, const uint64_t);
+bool  uring_write(uring *, const int, const void *, const size_t, const uint64_t, const uint64_t);
+bool  uring_submit(uring *);
+bool  uring_wait(uring *, uint64_t *, int32_t *);
+bool  uring_pread_all(const int, void *, const size_t, const off_t);
+bool  uring_pwrite_all(const int, const void *, const size_t, const off_t);
+
+#endif /* URING_H */
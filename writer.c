@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include "writer.h"
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// keep the first error, the one worth reporting
+static void fail(writer *w) {
+	if (!w->failed) {
+		w->error  = errno ? errno : EIO;
+		w->failed = true;
+	}
+}
+
+// none, exit, a size such as 64M, or an interval such as 500ms or 2s
+bool writer_policy_parse(const char *s, writer_policy *policy) {
+	char     *end;
+	uint64_t  n;
+
+	if (strcasecmp(s, "none") == 0) {
+		policy->sync  = WRITER_SYNC_NONE;
+		policy->every = 0;
+		return true;
+	}
+
+	if (strcasecmp(s, "exit") == 0) {
+		policy->sync  = WRITER_SYNC_EXIT;
+		policy->every = 0;
+		return true;
+	}
+
+	errno = 0;
+	n = strtoull(s, &end, 10);
+	if (errno != 0 || end == s || n == 0) {
+		return false;
+	}
+
+	if (strcasecmp(end, "ms") == 0 || strcasecmp(end, "s") == 0) {
+		policy->sync  = WRITER_SYNC_INTERVAL;
+		policy->every = (strcasecmp(end, "s") == 0) ? n * 1000 : n;
+		return true;
+	}
+
+	policy->sync = WRITER_SYNC_BYTES;
+	switch (*end) {
+	case '\0':
+		policy->every = n;
+		return true;
+	case 'k': case 'K':
+		policy->every = n << 10;
+		break;
+	case 'm': case 'M':
+		policy->every = n << 20;
+		break;
+	case 'g': case 'G':
+		policy->every = n << 30;
+		break;
+	default:
+		return false;
+	}
+
+	return end[1] == '\0' || strcasecmp(end + 1, "b") == 0;
+}
+
+bool writer_init_fd(writer *w, const int fd, const writer_policy *policy) {
+	struct stat st;
+
+	memset(w, 0, sizeof(writer));
+	w->fd      = fd;
+	w->policy  = *policy;
+	w->regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+	w->flushed_at = w->synced_at = now_ms();
+
+	w->buf = malloc(WRITER_BUFFER);
+	return w->buf != NULL;
+}
+
+// Append to path. Every write lands at the end of the file, wherever
+// other writers left it.
+bool writer_open(writer *w, const char *path, const writer_policy *policy) {
+	int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+
+	if (fd == -1) {
+		return false;
+	}
+
+	if (!writer_init_fd(w, fd, policy)) {
+		close(fd);
+		return false;
+	}
+
+	w->owns_fd = true;
+	return true;
+}
+
+// write every byte of iov, picking up after short writes
+static void write_iov(writer *w, struct iovec *iov, int count) {
+	uint64_t total = 0;
+
+	for (int i = 0; i < count; i++) {
+		total += iov[i].iov_len;
+	}
+
+	while (count > 0) {
+		ssize_t put = writev(w->fd, iov, count);
+
+		if (put == -1 && errno == EINTR) {
+			continue;
+		}
+		if (put <= 0) {
+			fail(w);
+			return;
+		}
+
+		while (count > 0 && (size_t)put >= iov->iov_len) {
+			put -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + put;
+			iov->iov_len -= put;
+		}
+	}
+
+	w->written += total;
+	if (w->policy.sync == WRITER_SYNC_BYTES && w->written - w->durable >= w->policy.every) {
+		writer_sync(w);
+	}
+}
+
+void writer_add(writer *w, const char *line, const size_t len) {
+	if (w->used + len + 1 > WRITER_BUFFER) {
+		if (len + 1 > WRITER_BUFFER) {
+			// too large to buffer. send it along with what is waiting
+			struct iovec iov[3] = {
+				{ .iov_base = w->buf, .iov_len = w->used },
+				{ .iov_base = (char *)line, .iov_len = len },
+				{ .iov_base = "\n", .iov_len = 1 }
+			};
+
+			w->used = 0;
+			write_iov(w, iov, 3);
+			return;
+		}
+
+		writer_flush(w);
+	}
+
+	memcpy(w->buf + w->used, line, len);
+	w->buf[w->used + len] = '\n';
+	w->used += len + 1;
+}
+
+// Hand buffered lines to the kernel.
+bool writer_flush(writer *w) {
+	if (w->used > 0) {
+		struct iovec iov = { .iov_base = w->buf, .iov_len = w->used };
+
+		w->used = 0;
+		write_iov(w, &iov, 1);
+	}
+	w->flushed_at = now_ms();
+
+	return !w->failed;
+}
+
+// Flush, then wait for everything written so far to be on disk.
+bool writer_sync(writer *w) {
+	writer_flush(w);
+
+	if (w->regular && w->written > w->durable) {
+		if (fdatasync(w->fd) == -1) {
+			fail(w);
+		} else {
+			w->durable = w->written;
+		}
+	}
+	w->synced_at = now_ms();
+
+	return !w->failed;
+}
+
+// Called between batches: flush lines that have waited long enough, and
+// sync if the policy says it is time.
+bool writer_tick(writer *w) {
+	uint64_t now;
+
+	if (w->used == 0 && w->policy.sync != WRITER_SYNC_INTERVAL) {
+		return !w->failed;
+	}
+
+	now = now_ms();
+	if (w->policy.sync == WRITER_SYNC_INTERVAL && now - w->synced_at >= w->policy.every &&
+		w->written + w->used > w->durable) {
+		return writer_sync(w);
+	}
+
+	if (w->used > 0 && now - w->flushed_at >= WRITER_LATENCY_MS) {
+		return writer_flush(w);
+	}
+
+	return !w->failed;
+}
+
+// Flush and, unless the policy is none, sync. Returns false if any line
+// may not have made it.
+bool writer_close(writer *w) {
+	if (w->policy.sync == WRITER_SYNC_NONE) {
+		writer_flush(w);
+	} else {
+		writer_sync(w);
+	}
+
+	if (w->owns_fd && close(w->fd) == -1) {
+		fail(w);
+	}
+
+	free(w->buf);
+	w->buf = NULL;
+
+	return !w->failed;
+}
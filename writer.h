@@ -0,0 +1,58 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The output stage. New lines are gathered into one large buffer and
+// appended with writev, whole lines at a time, so an O_APPEND target only
+// ever grows by complete lines even with other writers about. A line too
+// large for the buffer is written straight from the caller's memory.
+//
+// The sync policy says when appended lines are made durable with
+// fdatasync: never, at exit, or every so many bytes or milliseconds.
+// Cache files are only saved after the lines they cover are durable.
+#define WRITER_BUFFER      (1024 * 1024)
+
+// buffered lines are handed to the kernel at the end of a batch once they
+// have waited this long, so a slow stream still shows up downstream
+#define WRITER_LATENCY_MS  100
+
+typedef enum {
+	WRITER_SYNC_NONE = 0,
+	WRITER_SYNC_EXIT,
+	WRITER_SYNC_BYTES,
+	WRITER_SYNC_INTERVAL
+} writer_sync_mode;
+
+typedef struct {
+	writer_sync_mode  sync;
+	uint64_t          every;  // bytes, or milliseconds
+} writer_policy;
+
+typedef struct {
+	int            fd;
+	bool           owns_fd;
+	bool           regular;    // only regular files can be synced
+	bool           failed;     // a write or sync failed
+	int            error;      // errno of the first failure
+	char          *buf;
+	size_t         used;
+	writer_policy  policy;
+	uint64_t       written;    // bytes handed to the kernel
+	uint64_t       durable;    // bytes of those known to be on disk
+	uint64_t       flushed_at; // ms
+	uint64_t       synced_at;  // ms
+} writer;
+
+bool  writer_policy_parse(const char *, writer_policy *);
+bool  writer_open(writer *, const char *, const writer_policy *);
+bool  writer_init_fd(writer *, const int, const writer_policy *);
+void  writer_add(writer *, const char *, const size_t);
+bool  writer_flush(writer *);
+bool  writer_sync(writer *);
+bool  writer_tick(writer *);
+bool  writer_close(writer *);
+
+#endif /* WRITER_H */
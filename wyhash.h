@@ -0,0 +1,13 @@
+#ifndef WYHASH_H
+#define WYHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// wyhash (final version 4) by Wang Yi, public domain. A few 64x64->128 bit
+// multiplies per 16 bytes and none of mmh3's long dependency chains, so it
+// is several times faster on short lines.
+uint64_t  wyhash(const void *, const size_t, const uint64_t);
+void      wyhash_128(const void *, const size_t, const uint64_t, uint64_t *);
+
+#endif /* WYHASH_H */